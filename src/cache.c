@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "env.h"
+#include "err.h"
+
+struct cache_entry_t {
+  int frame;
+  int refs;  /* callers copying in or out of buffer */
+  int ready; /* buffer holds the frame */
+  int *buffer;
+  struct cache_entry_t *prev; /* towards most recently used */
+  struct cache_entry_t *next; /* towards least recently used */
+};
+
+struct frame_cache_t {
+  pthread_mutex_t lock;
+  struct cache_entry_t **frames; /* entry for each frame number, or NULL */
+  int n_frames;
+  size_t frame_size_px;
+  size_t n_entries;
+  size_t max_entries;
+  struct cache_entry_t *head;
+  struct cache_entry_t *tail;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+static void unlink_entry(struct frame_cache_t *cache,
+                         struct cache_entry_t *entry) {
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  else
+    cache->head = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+  else
+    cache->tail = entry->prev;
+  entry->prev = entry->next = NULL;
+}
+
+static void push_entry(struct frame_cache_t *cache,
+                       struct cache_entry_t *entry) {
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head)
+    cache->head->prev = entry;
+  cache->head = entry;
+  if (!cache->tail)
+    cache->tail = entry;
+}
+
+/* least recently used entry nobody is copying - lock must be held */
+static struct cache_entry_t *evict_entry(struct frame_cache_t *cache) {
+  struct cache_entry_t *entry = cache->tail;
+  while (entry && entry->refs > 0)
+    entry = entry->prev;
+  if (entry) {
+    unlink_entry(cache, entry);
+    cache->frames[entry->frame] = NULL;
+  }
+  return entry;
+}
+
+int create_frame_cache(int n_frames, size_t frame_size_px,
+                       struct frame_cache_t **cache) {
+  int retval = 0;
+  long budget_mb = get_env_long("DURIN_CACHE_MB", 0);
+  size_t max_entries;
+  struct frame_cache_t *fc = NULL;
+
+  *cache = NULL;
+  if (budget_mb <= 0)
+    goto done;
+
+  max_entries = ((size_t)budget_mb << 20) / (frame_size_px * sizeof(int));
+  if (max_entries == 0) {
+    ERROR_JUMP(-1, done, "Frame cache budget is smaller than one frame");
+  }
+
+  fc = calloc(1, sizeof(*fc));
+  if (!fc) {
+    ERROR_JUMP(-1, done, "Unable to allocate frame cache");
+  }
+  fc->frames = calloc(n_frames, sizeof(*fc->frames));
+  if (!fc->frames) {
+    free(fc);
+    ERROR_JUMP(-1, done, "Unable to allocate frame cache");
+  }
+  pthread_mutex_init(&fc->lock, NULL);
+  fc->n_frames = n_frames;
+  fc->frame_size_px = frame_size_px;
+  fc->max_entries = max_entries;
+  *cache = fc;
+
+done:
+  return retval;
+}
+
+int get_cached_frame(struct frame_cache_t *cache, int n, int *buffer) {
+  struct cache_entry_t *entry = NULL;
+
+  if (n < 0 || n >= cache->n_frames)
+    return 0;
+
+  pthread_mutex_lock(&cache->lock);
+  entry = cache->frames[n];
+  if (entry && entry->ready) {
+    entry->refs++;
+    unlink_entry(cache, entry);
+    push_entry(cache, entry);
+    cache->hits++;
+  } else {
+    entry = NULL;
+    cache->misses++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  if (!entry)
+    return 0;
+
+  memcpy(buffer, entry->buffer, cache->frame_size_px * sizeof(*buffer));
+  pthread_mutex_lock(&cache->lock);
+  entry->refs--;
+  pthread_mutex_unlock(&cache->lock);
+  return 1;
+}
+
+void put_cached_frame(struct frame_cache_t *cache, int n, const int *buffer) {
+  struct cache_entry_t *entry = NULL;
+
+  if (n < 0 || n >= cache->n_frames)
+    return;
+
+  pthread_mutex_lock(&cache->lock);
+  if (cache->frames[n]) {
+    /* another thread got there first */
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+  if (cache->n_entries < cache->max_entries) {
+    entry = calloc(1, sizeof(*entry));
+    if (entry)
+      cache->n_entries++;
+  } else {
+    /* reuse the buffer of the evicted frame */
+    entry = evict_entry(cache);
+  }
+  if (!entry) {
+    pthread_mutex_unlock(&cache->lock);
+    return;
+  }
+  entry->frame = n;
+  entry->ready = 0;
+  entry->refs = 1;
+  cache->frames[n] = entry;
+  push_entry(cache, entry);
+  pthread_mutex_unlock(&cache->lock);
+
+  if (!entry->buffer)
+    entry->buffer = malloc(cache->frame_size_px * sizeof(*entry->buffer));
+  if (entry->buffer)
+    memcpy(entry->buffer, buffer, cache->frame_size_px * sizeof(*buffer));
+
+  pthread_mutex_lock(&cache->lock);
+  entry->refs--;
+  entry->ready = entry->buffer != NULL;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void get_frame_cache_stats(struct frame_cache_t *cache, unsigned long *hits,
+                           unsigned long *misses) {
+  pthread_mutex_lock(&cache->lock);
+  *hits = cache->hits;
+  *misses = cache->misses;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void free_frame_cache(struct frame_cache_t *cache) {
+  struct cache_entry_t *entry = cache->head;
+  while (entry) {
+    struct cache_entry_t *next = entry->next;
+    free(entry->buffer);
+    free(entry);
+    entry = next;
+  }
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->frames);
+  free(cache);
+}
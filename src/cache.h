@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#ifndef NXS_XDS_CACHE_H
+#define NXS_XDS_CACHE_H
+
+#include <stddef.h>
+
+/* Decoded frames held in memory up to a byte budget, evicting the least
+ * recently used frame first, so a frame requested again is copied rather
+ * than read and decompressed a second time. Safe to use from many threads. */
+struct frame_cache_t;
+
+/* create a cache if enabled by the environment, otherwise *cache is set to
+ * NULL */
+int create_frame_cache(int n_frames, size_t frame_size_px,
+                       struct frame_cache_t **cache);
+
+/* copy frame n into buffer if cached. Returns 1 on a hit, otherwise 0 */
+int get_cached_frame(struct frame_cache_t *cache, int n, int *buffer);
+
+/* add a copy of frame n to the cache, evicting older frames as needed */
+void put_cached_frame(struct frame_cache_t *cache, int n, const int *buffer);
+
+void get_frame_cache_stats(struct frame_cache_t *cache, unsigned long *hits,
+                           unsigned long *misses);
+
+void free_frame_cache(struct frame_cache_t *cache);
+
+#endif /* NXS_XDS_CACHE_H */
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "chunk_cache.h"
+#include "env.h"
+#include "err.h"
+
+#define CHUNK_CACHE_DEFAULT_MB 256
+#define CHUNK_CACHE_MIN_ENTRIES 2
+#define CHUNK_CACHE_MAX_ENTRIES 64
+
+enum chunk_state_t { CHUNK_EMPTY, CHUNK_LOADING, CHUNK_READY };
+
+struct chunk_entry_t {
+  const void *owner;
+  unsigned long long index;
+  enum chunk_state_t state;
+  int refs;               /* callers reading the buffer */
+  unsigned long last_use; /* tick of the most recent acquire */
+  void *buffer;
+};
+
+struct chunk_cache_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct chunk_entry_t *entries;
+  int n_entries;
+  size_t chunk_bytes;
+  unsigned long tick;
+};
+
+int create_chunk_cache(size_t chunk_bytes, struct chunk_cache_t **cache) {
+  int retval = 0;
+  long budget_mb = get_env_long("DURIN_CHUNK_CACHE_MB", CHUNK_CACHE_DEFAULT_MB);
+  size_t n_entries;
+  struct chunk_cache_t *cc = NULL;
+
+  *cache = NULL;
+  if (budget_mb <= 0) {
+    ERROR_JUMP(-1, done, "Invalid chunk cache memory budget");
+  }
+  /* always hold enough chunks for a reader to move on to the next chunk
+   * while others finish the last */
+  n_entries = ((size_t)budget_mb << 20) / chunk_bytes;
+  if (n_entries < CHUNK_CACHE_MIN_ENTRIES)
+    n_entries = CHUNK_CACHE_MIN_ENTRIES;
+  if (n_entries > CHUNK_CACHE_MAX_ENTRIES)
+    n_entries = CHUNK_CACHE_MAX_ENTRIES;
+
+  cc = calloc(1, sizeof(*cc));
+  if (!cc) {
+    ERROR_JUMP(-1, done, "Unable to allocate chunk cache");
+  }
+  cc->entries = calloc(n_entries, sizeof(*cc->entries));
+  if (!cc->entries) {
+    free(cc);
+    ERROR_JUMP(-1, done, "Unable to allocate chunk cache");
+  }
+  pthread_mutex_init(&cc->lock, NULL);
+  pthread_cond_init(&cc->cond, NULL);
+  cc->n_entries = n_entries;
+  cc->chunk_bytes = chunk_bytes;
+  *cache = cc;
+
+done:
+  return retval;
+}
+
+static int find_entry(const struct chunk_cache_t *cache, const void *owner,
+                      unsigned long long index) {
+  int idx;
+  for (idx = 0; idx < cache->n_entries; idx++) {
+    const struct chunk_entry_t *entry = &cache->entries[idx];
+    if (entry->state != CHUNK_EMPTY && entry->owner == owner &&
+        entry->index == index)
+      return idx;
+  }
+  return -1;
+}
+
+/* an empty entry, or the least recently used one nobody is reading */
+static int claim_entry(const struct chunk_cache_t *cache) {
+  int idx, oldest = -1;
+  for (idx = 0; idx < cache->n_entries; idx++) {
+    const struct chunk_entry_t *entry = &cache->entries[idx];
+    if (entry->state == CHUNK_EMPTY)
+      return idx;
+    if (entry->state != CHUNK_READY || entry->refs > 0)
+      continue;
+    if (oldest < 0 || entry->last_use < cache->entries[oldest].last_use)
+      oldest = idx;
+  }
+  return oldest;
+}
+
+int acquire_chunk(struct chunk_cache_t *cache, const void *owner,
+                  unsigned long long index, chunk_load_func load, void *arg,
+                  const void **data) {
+  int retval = 0;
+  int idx, hit = 0, err = 0;
+  struct chunk_entry_t *entry;
+
+  pthread_mutex_lock(&cache->lock);
+  for (;;) {
+    idx = find_entry(cache, owner, index);
+    if (idx >= 0 && cache->entries[idx].state == CHUNK_READY) {
+      hit = 1;
+      break;
+    }
+    if (idx < 0) {
+      /* may be the ready entry of another chunk, which is replaced */
+      idx = claim_entry(cache);
+      if (idx >= 0)
+        break;
+    }
+    /* wait for the chunk to be loaded, or for an entry to come free */
+    pthread_cond_wait(&cache->cond, &cache->lock);
+  }
+  entry = &cache->entries[idx];
+  entry->refs++;
+  entry->last_use = ++cache->tick;
+  if (hit) {
+    pthread_mutex_unlock(&cache->lock);
+    *data = entry->buffer;
+    return idx;
+  }
+  entry->owner = owner;
+  entry->index = index;
+  entry->state = CHUNK_LOADING;
+  pthread_mutex_unlock(&cache->lock);
+
+  if (!entry->buffer)
+    entry->buffer = malloc(cache->chunk_bytes);
+  if (entry->buffer)
+    err = load(arg, entry->buffer);
+
+  pthread_mutex_lock(&cache->lock);
+  if (entry->buffer && err >= 0) {
+    entry->state = CHUNK_READY;
+  } else {
+    entry->state = CHUNK_EMPTY;
+    entry->refs--;
+  }
+  pthread_cond_broadcast(&cache->cond);
+  pthread_mutex_unlock(&cache->lock);
+
+  if (!entry->buffer) {
+    ERROR_JUMP(-1, done, "Unable to allocate chunk cache buffer");
+  }
+  if (err < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+  *data = entry->buffer;
+  retval = idx;
+
+done:
+  return retval;
+}
+
+void release_chunk(struct chunk_cache_t *cache, int handle) {
+  pthread_mutex_lock(&cache->lock);
+  cache->entries[handle].refs--;
+  pthread_cond_broadcast(&cache->cond);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void free_chunk_cache(struct chunk_cache_t *cache) {
+  int idx;
+  for (idx = 0; idx < cache->n_entries; idx++) {
+    free(cache->entries[idx].buffer);
+  }
+  pthread_cond_destroy(&cache->cond);
+  pthread_mutex_destroy(&cache->lock);
+  free(cache->entries);
+  free(cache);
+}
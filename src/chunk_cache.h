@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#ifndef NXS_XDS_CHUNK_CACHE_H
+#define NXS_XDS_CHUNK_CACHE_H
+
+#include <stddef.h>
+
+/* A few decoded chunks of datasets holding several frames per chunk, so each
+ * chunk is read and decoded once while its frames are requested rather than
+ * once per frame. A chunk being decoded by one thread is waited for, not
+ * decoded again, by any other thread asking for it. */
+struct chunk_cache_t;
+
+/* fill buffer with the decoded chunk described by arg */
+typedef int (*chunk_load_func)(void *arg, void *buffer);
+
+int create_chunk_cache(size_t chunk_bytes, struct chunk_cache_t **cache);
+
+/* find the chunk identified by owner and index, loading it on a miss. On
+ * success *data points to the decoded chunk until release_chunk is called
+ * with the returned handle, otherwise -1 is returned */
+int acquire_chunk(struct chunk_cache_t *cache, const void *owner,
+                  unsigned long long index, chunk_load_func load, void *arg,
+                  const void **data);
+
+void release_chunk(struct chunk_cache_t *cache, int handle);
+
+void free_chunk_cache(struct chunk_cache_t *cache);
+
+#endif /* NXS_XDS_CHUNK_CACHE_H */
@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "convert.h"
+#include "err.h"
+
+#define COPY_AND_MASK(in, out, size, mask)                                     \
+  {                                                                            \
+    int i;                                                                     \
+    if (mask) {                                                                \
+      for (i = 0; i < size; ++i) {                                             \
+        out[i] = in[i];                                                        \
+        if (mask[i] & MASK_IGNORE_BITS)                                        \
+          out[i] = -1;                                                         \
+        if (mask[i] & MASK_INVALID_BITS)                                       \
+          out[i] = -2;                                                         \
+      }                                                                        \
+    } else {                                                                   \
+      for (i = 0; i < size; i++) {                                             \
+        out[i] = in[i];                                                        \
+      }                                                                        \
+    }                                                                          \
+  }
+
+#define APPLY_MASK(buffer, mask, size)                                         \
+  {                                                                            \
+    int i;                                                                     \
+    if (mask) {                                                                \
+      for (i = 0; i < size; ++i) {                                             \
+        if (mask[i] & MASK_IGNORE_BITS)                                        \
+          buffer[i] = -1;                                                      \
+        if (mask[i] & MASK_INVALID_BITS)                                       \
+          buffer[i] = -2;                                                      \
+      }                                                                        \
+    }                                                                          \
+  }
+
+/*
+ * Vectorised kernels for the common data widths. Each handles as many whole
+ * vectors as fit in length and returns the number of pixels processed; the
+ * remainder is finished by the scalar macros above. The instruction set is
+ * selected at compile time, as in bitshuffle_core.c.
+ */
+#if defined(__AVX2__)
+
+#define VEC_WIDTH 8
+
+/* masked pixels become -1 (ignore) or -2 (invalid), which takes precedence */
+static inline __m256i mask_vec(__m256i value, const int *mask) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i m = _mm256_loadu_si256((const __m256i *)mask);
+  __m256i ignore = _mm256_and_si256(m, _mm256_set1_epi32(MASK_IGNORE_BITS));
+  __m256i invalid = _mm256_and_si256(m, _mm256_set1_epi32(MASK_INVALID_BITS));
+  __m256i keep = _mm256_cmpeq_epi32(ignore, zero);
+  __m256i valid = _mm256_cmpeq_epi32(invalid, zero);
+  value = _mm256_blendv_epi8(_mm256_set1_epi32(-1), value, keep);
+  return _mm256_blendv_epi8(_mm256_set1_epi32(-2), value, valid);
+}
+
+static inline __m256i load_int8(const signed char *in) {
+  return _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i *)in));
+}
+
+static inline __m256i load_int16(const short *in) {
+  return _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)in));
+}
+
+static inline __m256i load_int32(const int *in) {
+  return _mm256_loadu_si256((const __m256i *)in);
+}
+
+static inline void store_vec(int *out, __m256i value) {
+  _mm256_storeu_si256((__m256i *)out, value);
+}
+
+/* saturating sum of two pixels, or the lower of the two if either is
+ * masked (negative) */
+static inline __m256i sum_vec(__m256i a, __m256i b) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i low = _mm256_min_epi32(a, b);
+  __m256i sum = _mm256_add_epi32(a, b);
+  /* two non-negative ints only wrap into the sign bit */
+  sum = _mm256_blendv_epi8(sum, _mm256_set1_epi32(INT_MAX),
+                           _mm256_cmpgt_epi32(zero, sum));
+  return _mm256_blendv_epi8(sum, low, _mm256_cmpgt_epi32(zero, low));
+}
+
+#elif defined(__SSE2__)
+
+#define VEC_WIDTH 4
+
+/* masked pixels become -1 (ignore) or -2 (invalid), which takes precedence */
+static inline __m128i mask_vec(__m128i value, const int *mask) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i m = _mm_loadu_si128((const __m128i *)mask);
+  __m128i ignore = _mm_and_si128(m, _mm_set1_epi32(MASK_IGNORE_BITS));
+  __m128i invalid = _mm_and_si128(m, _mm_set1_epi32(MASK_INVALID_BITS));
+  __m128i keep = _mm_cmpeq_epi32(ignore, zero);
+  __m128i valid = _mm_cmpeq_epi32(invalid, zero);
+  /* no blend in SSE2: (keep & value) | ~keep gives -1 where not kept */
+  value = _mm_or_si128(_mm_and_si128(keep, value),
+                       _mm_andnot_si128(keep, _mm_set1_epi32(-1)));
+  return _mm_or_si128(_mm_and_si128(valid, value),
+                      _mm_andnot_si128(valid, _mm_set1_epi32(-2)));
+}
+
+static inline __m128i load_int8(const signed char *in) {
+  /* duplicate each byte into the top of a 32 bit lane then sign extend */
+  int packed;
+  __m128i x;
+  memcpy(&packed, in, sizeof(packed));
+  x = _mm_cvtsi32_si128(packed);
+  x = _mm_unpacklo_epi8(x, x);
+  x = _mm_unpacklo_epi16(x, x);
+  return _mm_srai_epi32(x, 24);
+}
+
+static inline __m128i load_int16(const short *in) {
+  __m128i x = _mm_loadl_epi64((const __m128i *)in);
+  return _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+}
+
+static inline __m128i load_int32(const int *in) {
+  return _mm_loadu_si128((const __m128i *)in);
+}
+
+static inline void store_vec(int *out, __m128i value) {
+  _mm_storeu_si128((__m128i *)out, value);
+}
+
+/* saturating sum of two pixels, or the lower of the two if either is
+ * masked (negative) */
+static inline __m128i sum_vec(__m128i a, __m128i b) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a_lower = _mm_cmplt_epi32(a, b);
+  __m128i low = _mm_or_si128(_mm_and_si128(a_lower, a),
+                             _mm_andnot_si128(a_lower, b));
+  __m128i sum = _mm_add_epi32(a, b);
+  /* two non-negative ints only wrap into the sign bit */
+  __m128i wrapped = _mm_cmplt_epi32(sum, zero);
+  __m128i masked = _mm_cmplt_epi32(low, zero);
+  sum = _mm_or_si128(_mm_and_si128(wrapped, _mm_set1_epi32(INT_MAX)),
+                     _mm_andnot_si128(wrapped, sum));
+  return _mm_or_si128(_mm_and_si128(masked, low),
+                      _mm_andnot_si128(masked, sum));
+}
+
+#endif
+
+#ifdef VEC_WIDTH
+
+#define VEC_COPY_AND_MASK(load, in, out, size, mask)                           \
+  {                                                                            \
+    if (mask) {                                                                \
+      for (i = 0; i + VEC_WIDTH <= size; i += VEC_WIDTH) {                     \
+        store_vec(out + i, mask_vec(load(in + i), mask + i));                  \
+      }                                                                        \
+    } else {                                                                   \
+      for (i = 0; i + VEC_WIDTH <= size; i += VEC_WIDTH) {                     \
+        store_vec(out + i, load(in + i));                                      \
+      }                                                                        \
+    }                                                                          \
+  }
+
+static int copy_and_mask_int8(const signed char *in, int *out, int size,
+                              const int *mask) {
+  int i;
+  VEC_COPY_AND_MASK(load_int8, in, out, size, mask);
+  return i;
+}
+
+static int copy_and_mask_int16(const short *in, int *out, int size,
+                               const int *mask) {
+  int i;
+  VEC_COPY_AND_MASK(load_int16, in, out, size, mask);
+  return i;
+}
+
+static int copy_and_mask_int32(const int *in, int *out, int size,
+                               const int *mask) {
+  int i;
+  VEC_COPY_AND_MASK(load_int32, in, out, size, mask);
+  return i;
+}
+
+static int apply_mask_int32(int *buffer, int size, const int *mask) {
+  int i;
+  for (i = 0; i + VEC_WIDTH <= size; i += VEC_WIDTH) {
+    store_vec(buffer + i, mask_vec(load_int32(buffer + i), mask + i));
+  }
+  return i;
+}
+
+static int accumulate_int32(int *sum, const int *in, int size) {
+  int i;
+  for (i = 0; i + VEC_WIDTH <= size; i += VEC_WIDTH) {
+    store_vec(sum + i, sum_vec(load_int32(sum + i), load_int32(in + i)));
+  }
+  return i;
+}
+
+#else
+
+static int copy_and_mask_int8(const signed char *in, int *out, int size,
+                              const int *mask) {
+  return 0;
+}
+
+static int copy_and_mask_int16(const short *in, int *out, int size,
+                               const int *mask) {
+  return 0;
+}
+
+static int copy_and_mask_int32(const int *in, int *out, int size,
+                               const int *mask) {
+  return 0;
+}
+
+static int apply_mask_int32(int *buffer, int size, const int *mask) {
+  return 0;
+}
+
+static int accumulate_int32(int *sum, const int *in, int size) { return 0; }
+
+#endif
+
+int convert_to_int_and_mask(const void *in_buffer, int d_width, int *out_buffer,
+                            int length, const int *mask) {
+  /* transfer data to output buffer, performing data conversion as required */
+  int retval = 0;
+  /* TODO: decide how conversion of data should work */
+  /* Should we sign extend? Neggia doesn't (casts from uint*), but may be more
+   * intuitive */
+  /* the vector kernels handle the bulk, the macros finish the remainder */
+  int done = 0;
+  const int *mask_rest = NULL;
+  if (d_width == sizeof(signed char)) {
+    const signed char *in = in_buffer;
+    done = copy_and_mask_int8(in, out_buffer, length, mask);
+    mask_rest = mask ? mask + done : NULL;
+    COPY_AND_MASK((in + done), (out_buffer + done), (length - done),
+                  (mask_rest));
+  } else if (d_width == sizeof(short)) {
+    const short *in = in_buffer;
+    done = copy_and_mask_int16(in, out_buffer, length, mask);
+    mask_rest = mask ? mask + done : NULL;
+    COPY_AND_MASK((in + done), (out_buffer + done), (length - done),
+                  (mask_rest));
+  } else if (d_width == sizeof(int)) {
+    const int *in = in_buffer;
+    done = copy_and_mask_int32(in, out_buffer, length, mask);
+    mask_rest = mask ? mask + done : NULL;
+    COPY_AND_MASK((in + done), (out_buffer + done), (length - done),
+                  (mask_rest));
+  } else if (d_width == sizeof(long int)) {
+    const long int *in = in_buffer;
+    COPY_AND_MASK(in, out_buffer, length, mask);
+  } else if (d_width == sizeof(long long int)) {
+    const long long int *in = in_buffer;
+    COPY_AND_MASK(in, out_buffer, length, mask);
+  } else {
+    char message[128];
+    sprintf(message, "Unsupported conversion of data width %d to %ld (int)",
+            d_width, sizeof(int));
+    ERROR_JUMP(-1, done, message);
+  }
+done:
+  return retval;
+}
+
+void apply_mask(int *buffer, const int *mask, int length) {
+  int done = 0;
+  if (mask) {
+    done = apply_mask_int32(buffer, length, mask);
+    APPLY_MASK((buffer + done), (mask + done), (length - done));
+  }
+}
+
+/* the value written for a pixel with the given mask bits, 0 if unmasked */
+static int masked_value(int bits) {
+  if (bits & MASK_INVALID_BITS)
+    return -2;
+  if (bits & MASK_IGNORE_BITS)
+    return -1;
+  return 0;
+}
+
+int build_pixel_mask(int *dense, int length, struct pixel_mask_t *mask) {
+  int retval = 0;
+  int i, n_runs = 0;
+  int value, last_value = 0;
+  struct mask_run_t *runs = NULL;
+
+  mask->dense = dense;
+  mask->runs = NULL;
+  mask->n_runs = 0;
+
+  /* count the runs of equal output value */
+  for (i = 0; i < length; i++) {
+    value = masked_value(dense[i]);
+    if (value && value != last_value)
+      n_runs++;
+    last_value = value;
+  }
+
+  /* keep the dense form unless the runs are much smaller */
+  if ((size_t)n_runs * sizeof(*runs) > (length * sizeof(*dense)) / 4) {
+    goto done;
+  }
+
+  runs = malloc((n_runs ? n_runs : 1) * sizeof(*runs));
+  if (!runs) {
+    ERROR_JUMP(-1, done, "Unable to allocate pixel mask runs");
+  }
+
+  n_runs = 0;
+  last_value = 0;
+  for (i = 0; i < length; i++) {
+    value = masked_value(dense[i]);
+    if (value) {
+      if (value == last_value) {
+        runs[n_runs - 1].length++;
+      } else {
+        runs[n_runs].start = i;
+        runs[n_runs].length = 1;
+        runs[n_runs].value = value;
+        n_runs++;
+      }
+    }
+    last_value = value;
+  }
+
+  free(dense);
+  mask->dense = NULL;
+  mask->runs = runs;
+  mask->n_runs = n_runs;
+
+done:
+  return retval;
+}
+
+void free_pixel_mask(struct pixel_mask_t *mask) {
+  free(mask->dense);
+  free(mask->runs);
+  mask->dense = NULL;
+  mask->runs = NULL;
+  mask->n_runs = 0;
+}
+
+void apply_pixel_mask(int *buffer, const struct pixel_mask_t *mask, int offset,
+                      int length) {
+  int lo, hi, end;
+  if (!mask)
+    return;
+  if (mask->dense) {
+    apply_mask(buffer, mask->dense + offset, length);
+    return;
+  }
+
+  /* find the first run ending after offset */
+  lo = 0;
+  hi = mask->n_runs;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (mask->runs[mid].start + mask->runs[mid].length <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  end = offset + length;
+  for (; lo < mask->n_runs && mask->runs[lo].start < end; lo++) {
+    const struct mask_run_t *run = &mask->runs[lo];
+    int start = run->start > offset ? run->start : offset;
+    int stop = run->start + run->length < end ? run->start + run->length : end;
+    int i;
+    for (i = start; i < stop; i++) {
+      buffer[i - offset] = run->value;
+    }
+  }
+}
+
+int convert_and_mask_pixels(const void *in_buffer, int d_width, int *out_buffer,
+                            int offset, int length,
+                            const struct pixel_mask_t *mask) {
+  int retval = 0;
+  if (mask && mask->dense) {
+    retval = convert_to_int_and_mask(in_buffer, d_width, out_buffer, length,
+                                     mask->dense + offset);
+  } else {
+    retval =
+        convert_to_int_and_mask(in_buffer, d_width, out_buffer, length, NULL);
+    if (retval == 0)
+      apply_pixel_mask(out_buffer, mask, offset, length);
+  }
+  return retval;
+}
+
+int convert_and_mask_region(const void *in_buffer, int d_width, int *out_buffer,
+                            int length, const struct pixel_region_t *region,
+                            const struct pixel_mask_t *mask) {
+  int row;
+  if (!region)
+    return convert_and_mask_pixels(in_buffer, d_width, out_buffer, 0, length,
+                                   mask);
+  for (row = region->y0; row < region->y1; row++) {
+    int offset = row * region->width + region->x0;
+    if (convert_and_mask_pixels((const char *)in_buffer + offset * d_width,
+                                d_width, out_buffer + offset, offset,
+                                region->x1 - region->x0, mask) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int region_overlaps(const struct pixel_region_t *region, size_t offset,
+                    size_t length) {
+  size_t width = region->width;
+  size_t first_row, last_row, row;
+  if (length == 0)
+    return 0;
+  first_row = offset / width;
+  last_row = (offset + length - 1) / width;
+  if (first_row < (size_t)region->y0)
+    first_row = region->y0;
+  if (last_row >= (size_t)region->y1)
+    last_row = region->y1 - 1;
+  for (row = first_row; row <= last_row; row++) {
+    /* columns of this row within the pixel range */
+    size_t start = row * width > offset ? 0 : offset - row * width;
+    size_t end = offset + length - row * width;
+    if (end > width)
+      end = width;
+    if (start < (size_t)region->x1 && end > (size_t)region->x0)
+      return 1;
+  }
+  return 0;
+}
+
+static inline int add_pixels(int a, int b) {
+  int low = a < b ? a : b;
+  if (low < 0)
+    return low;
+  return a > INT_MAX - b ? INT_MAX : a + b;
+}
+
+void accumulate_frame(int *sum, const int *in, int length) {
+  int i = accumulate_int32(sum, in, length);
+  for (; i < length; i++) {
+    sum[i] = add_pixels(sum[i], in[i]);
+  }
+}
+
+void bin_frame(int *in, int nx, int n, int out_nx, int out_ny, int *out) {
+  int row, col, k;
+  for (row = 0; row < out_ny; row++) {
+    int *base = in + (size_t)row * n * nx;
+    int *dest = out + (size_t)row * out_nx;
+    /* add the rows of each bin down into the first, a vector at a time */
+    for (k = 1; k < n; k++) {
+      accumulate_frame(base, base + (size_t)k * nx, out_nx * n);
+    }
+    for (col = 0; col < out_nx; col++) {
+      int value = base[col * n];
+      for (k = 1; k < n; k++) {
+        value = add_pixels(value, base[col * n + k]);
+      }
+      dest[col] = value;
+    }
+  }
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#ifndef NXS_XDS_CONVERT_H
+#define NXS_XDS_CONVERT_H
+
+#include <stddef.h>
+
+/* mask bits loosely based on what Neggia does and what NeXus says should be
+   done basically - anything in the low byte (& 0xFF) means "ignore this"
+   Neggia uses the value -2 if bit 1, 2 or 3 are set */
+#define MASK_IGNORE_BITS 0xFF
+#define MASK_INVALID_BITS 30
+
+/* a run of consecutive masked pixels sharing the same output value */
+struct mask_run_t {
+  int start;
+  int length;
+  int value;
+};
+
+/* The pixel mask in whichever form is cheaper - the dense per pixel mask
+ * bits, or a sorted list of masked runs when few pixels are masked. */
+struct pixel_mask_t {
+  int *dense;
+  struct mask_run_t *runs;
+  int n_runs;
+};
+
+/* the rectangle of pixels [x0, x1) in rows [y0, y1) of a frame width pixels
+ * wide. Readers given a region only need fill the pixels inside it */
+struct pixel_region_t {
+  int width;
+  int x0;
+  int x1;
+  int y0;
+  int y1;
+};
+
+/* non-zero if any of pixels [offset, offset + length) lies inside region */
+int region_overlaps(const struct pixel_region_t *region, size_t offset,
+                    size_t length);
+
+/* build the mask from dense mask bits, taking ownership of dense */
+int build_pixel_mask(int *dense, int length, struct pixel_mask_t *mask);
+
+void free_pixel_mask(struct pixel_mask_t *mask);
+
+/* widen pixels [offset, offset + length) to int and apply mask if not NULL;
+ * in and out point at the first pixel of the range */
+int convert_and_mask_pixels(const void *in_buffer, int d_width, int *out_buffer,
+                            int offset, int length,
+                            const struct pixel_mask_t *mask);
+
+/* as convert_and_mask_pixels for the whole of a frame of length pixels, or
+ * only the pixels inside region if not NULL. in and out hold the frame */
+int convert_and_mask_region(const void *in_buffer, int d_width, int *out_buffer,
+                            int length, const struct pixel_region_t *region,
+                            const struct pixel_mask_t *mask);
+
+void apply_pixel_mask(int *buffer, const struct pixel_mask_t *mask, int offset,
+                      int length);
+
+/* widen data of d_width bytes per pixel to int, applying mask if not NULL */
+int convert_to_int_and_mask(const void *in_buffer, int d_width, int *out_buffer,
+                            int length, const int *mask);
+
+void apply_mask(int *buffer, const int *mask, int length);
+
+/* add a frame of int pixels into sum, saturating at INT_MAX. A pixel masked
+ * (negative) in either stays masked, with -2 taking precedence over -1 */
+void accumulate_frame(int *sum, const int *in, int length);
+
+/* sum n x n bins of a frame nx pixels wide into out, out_nx by out_ny
+ * pixels, as for accumulate_frame. Pixels beyond the last whole bin are
+ * dropped and in is overwritten */
+void bin_frame(int *in, int nx, int n, int out_nx, int out_ny, int *out);
+
+#endif /* NXS_XDS_CONVERT_H */
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+/*
+ * Interface for reading frames from programs other than XDS. Frames count
+ * from 0, data is returned as masked int pixels as for XDS, and functions
+ * return a negative value on error after printing the error trace to stderr.
+ * It shares its state with the XDS interface, so only one file can be open
+ * at a time.
+ */
+
+#ifndef NXS_XDS_DURIN_H
+#define NXS_XDS_DURIN_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int durin_open(const char *filename);
+
+/* dimensions of the images returned, after any frame summation or binning
+ * set by DURIN_SUM_FRAMES or DURIN_BIN */
+int durin_get_dims(int *n_frames, int *ny, int *nx, int *data_width);
+
+/* pixel sizes of the images returned, in metres */
+int durin_get_pixel_size(double *x_size, double *y_size);
+
+/* read count consecutive frames into data, which must hold
+ * count * ny * nx ints - frames are decoded in parallel by up to
+ * DURIN_BATCH_THREADS threads */
+int durin_read_frames(int first_frame, int count, int *data);
+
+int durin_close();
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* NXS_XDS_DURIN_H */
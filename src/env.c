@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "env.h"
+
+long get_env_long(const char *name, long default_value) {
+  const char *value = getenv(name);
+  char *end = NULL;
+  long result;
+  if (!value || value[0] == '\0')
+    return default_value;
+  result = strtol(value, &end, 10);
+  if (*end != '\0') {
+    fprintf(stderr, "WARNING: Ignoring invalid value %.32s for %.64s\n", value,
+            name);
+    return default_value;
+  }
+  return result;
+}
+
+int get_env_longs(const char *name, int n, long *values) {
+  const char *value = getenv(name);
+  const char *next;
+  char *end = NULL;
+  int k;
+  if (!value || value[0] == '\0')
+    return 0;
+  next = value;
+  for (k = 0; k < n; k++) {
+    values[k] = strtol(next, &end, 10);
+    if (end == next || *end != (k < n - 1 ? ',' : '\0')) {
+      fprintf(stderr, "WARNING: Ignoring invalid value %.32s for %.64s\n",
+              value, name);
+      return -1;
+    }
+    next = end + 1;
+  }
+  return 1;
+}
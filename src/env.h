@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#ifndef NXS_XDS_ENV_H
+#define NXS_XDS_ENV_H
+
+/* Integer value of an environment variable, or default_value if it is unset,
+ * empty or not a number. Used for the optional tuning settings. */
+long get_env_long(const char *name, long default_value);
+
+/* Comma separated list of n integers in an environment variable, such as
+ * "10,20,30". Returns 1 if values were read, 0 if the variable is unset or
+ * empty and -1 if it is not a list of n integers. */
+int get_env_longs(const char *name, int n, long *values);
+
+#endif /* NXS_XDS_ENV_H */
@@ -3,46 +3,72 @@
  * Author: Charles Mita
  */
 
+#define _XOPEN_SOURCE 700
+
 #include <hdf5.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "err.h"
 
+/* Each thread has its own stack, so errors pushed by the reader and worker
+ * threads neither interleave with nor are cleared by those of another */
 struct error_stack_t {
-  char **files;
-  char **funcs;
-  int *lines;
-  int *errors;
-  char **messages;
+  char files[ERR_MAX_STACK_SIZE][ERR_MAX_FILENAME_LENGTH];
+  char funcs[ERR_MAX_STACK_SIZE][ERR_MAX_FUNCNAME_LENGTH];
+  int lines[ERR_MAX_STACK_SIZE];
+  int errors[ERR_MAX_STACK_SIZE];
+  char messages[ERR_MAX_STACK_SIZE][ERR_MAX_MESSAGE_LENGTH];
   int size;
 };
 
-static char files_buffer[ERR_MAX_FILENAME_LENGTH * ERR_MAX_STACK_SIZE] = {0};
-static char funcs_buffer[ERR_MAX_FUNCNAME_LENGTH * ERR_MAX_STACK_SIZE] = {0};
-static char messages_buffer[ERR_MAX_MESSAGE_LENGTH * ERR_MAX_STACK_SIZE] = {0};
+static pthread_key_t stack_key;
+static pthread_once_t stack_once = PTHREAD_ONCE_INIT;
+static int stack_key_valid = 0;
+
+static void create_stack_key() {
+  stack_key_valid = pthread_key_create(&stack_key, &free) == 0;
+}
+
+/* the stack of the calling thread, created on first use if create is set */
+static struct error_stack_t *get_error_stack(int create) {
+  struct error_stack_t *stack;
 
-static char *files[ERR_MAX_STACK_SIZE] = {0};
-static char *funcs[ERR_MAX_STACK_SIZE] = {0};
-static int lines[ERR_MAX_STACK_SIZE] = {0};
-static int errors[ERR_MAX_STACK_SIZE] = {0};
-static char *messages[ERR_MAX_STACK_SIZE] = {0};
+  pthread_once(&stack_once, &create_stack_key);
+  if (!stack_key_valid)
+    return NULL;
 
-static struct error_stack_t stack = {files, funcs, lines, errors, messages, 0};
+  stack = pthread_getspecific(stack_key);
+  if (!stack && create) {
+    stack = malloc(sizeof(*stack));
+    if (!stack)
+      return NULL;
+    stack->size = 0;
+    if (pthread_setspecific(stack_key, stack) != 0) {
+      free(stack);
+      return NULL;
+    }
+  }
+  return stack;
+}
 
 void push_error_stack(const char *file, const char *func, int line, int err,
                       const char *message) {
-  if (stack.size >= ERR_MAX_STACK_SIZE)
+  struct error_stack_t *stack = get_error_stack(1);
+  int idx;
+  if (!stack || stack->size >= ERR_MAX_STACK_SIZE)
     return; /* unfortunate */
-  int idx = stack.size;
+  idx = stack->size;
 
   /* subtract 1 to ensure room for null byte in buffer */
-  sprintf(stack.funcs[idx], "%.*s", ERR_MAX_FUNCNAME_LENGTH - 1, func);
-  sprintf(stack.files[idx], "%.*s", ERR_MAX_FILENAME_LENGTH - 1, file);
-  sprintf(stack.messages[idx], "%.*s", ERR_MAX_MESSAGE_LENGTH - 1, message);
-  stack.lines[idx] = line;
-  stack.errors[idx] = err;
+  sprintf(stack->funcs[idx], "%.*s", ERR_MAX_FUNCNAME_LENGTH - 1, func);
+  sprintf(stack->files[idx], "%.*s", ERR_MAX_FILENAME_LENGTH - 1, file);
+  sprintf(stack->messages[idx], "%.*s", ERR_MAX_MESSAGE_LENGTH - 1, message);
+  stack->lines[idx] = line;
+  stack->errors[idx] = err;
 
-  stack.size++;
+  stack->size++;
 }
 
 herr_t h5e_walk_callback(unsigned int n, const struct H5E_error2_t *err,
@@ -72,19 +98,22 @@ done:
 }
 
 void reset_error_stack() {
-  stack.size = 0;
+  struct error_stack_t *stack = get_error_stack(0);
+  if (stack)
+    stack->size = 0;
   H5Eclear2(H5E_DEFAULT); /* almost certainly unnecessary */
 }
 
 void dump_error_stack(FILE *out) {
-  int idx = stack.size;
+  struct error_stack_t *stack = get_error_stack(0);
+  int idx = stack ? stack->size : 0;
   if (idx > 0)
     fprintf(out, "Durin plugin error:\n");
   while (idx-- > 0) {
-    const char *file = stack.files[idx];
-    const char *func = stack.funcs[idx];
-    const char *message = stack.messages[idx];
-    const int line = stack.lines[idx];
+    const char *file = stack->files[idx];
+    const char *func = stack->funcs[idx];
+    const char *message = stack->messages[idx];
+    const int line = stack->lines[idx];
     if (message[0] != '\0') {
       fprintf(out, "\t%s - line %d in %s:\n\t\t%s\n", file, line, func,
               message);
@@ -106,12 +135,10 @@ done:
 
 int init_error_handling() {
   int retval = 0;
-  int idx = 0;
-  while (idx < ERR_MAX_STACK_SIZE) {
-    stack.files[idx] = files_buffer + (idx * ERR_MAX_FILENAME_LENGTH);
-    stack.funcs[idx] = funcs_buffer + (idx * ERR_MAX_FUNCNAME_LENGTH);
-    stack.messages[idx] = messages_buffer + (idx * ERR_MAX_MESSAGE_LENGTH);
-    idx++;
+  pthread_once(&stack_once, &create_stack_key);
+  if (!stack_key_valid) {
+    fprintf(stderr, "Durin plugin error: unable to create error stack key\n");
+    retval = -1;
   }
   return retval;
 }
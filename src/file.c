@@ -3,16 +3,41 @@
  * Author: Charles Mita
  */
 
+/* required for pread */
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
 #include <hdf5.h>
 #include <hdf5_hl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
+#include "convert.h"
+#include "env.h"
 #include "err.h"
 #include "file.h"
 #include "filters.h"
+#include "index.h"
+#include "scratch.h"
+
+#define TILE_MAX_THREADS 64
+/* each open data file uses a descriptor for HDF5 and one for direct reads */
+#define DEFAULT_MAX_OPEN_FILES 256
+/* worker processes reading the shapes of the data files when the master file
+ * is opened, each given at least this many files */
+#define DEFAULT_OPEN_PROCESSES 8
+#define OPEN_MIN_FILES_PER_PROCESS 4
+/* give up on workers which send nothing for this long */
+#define OPEN_TIMEOUT_MS 120000
+
+int build_block_chunk_table(struct opt_eiger_ds_desc_t *desc, int n);
 
 void clear_det_visit_objects(struct det_visit_objects_t *objects) {
   if (objects->nxdata) {
@@ -31,15 +56,77 @@ void free_ds_desc(struct ds_desc_t *desc) {
   free(desc);
 }
 
-void free_nxs_desc(struct ds_desc_t *desc) { free_ds_desc(desc); }
+void init_data_block(struct data_block_t *block) {
+  memset(block, 0, sizeof(*block));
+  block->chunks.fd = -1;
+}
+
+void clear_chunk_table(struct chunk_table_t *table) {
+  if (table->fd >= 0)
+    close(table->fd);
+  free(table->offsets);
+  free(table->sizes);
+  free(table->filter_masks);
+  memset(table, 0, sizeof(*table));
+  table->fd = -1;
+}
+
+void close_data_block(struct data_block_t *block) {
+  clear_chunk_table(&block->chunks);
+  if (block->t_id > 0)
+    H5Tclose(block->t_id);
+  if (block->s_id > 0)
+    H5Sclose(block->s_id);
+  if (block->ds_id > 0)
+    H5Dclose(block->ds_id);
+  init_data_block(block);
+}
+
+/* close a block but keep its chunk locations, which are used again if the
+ * block is reopened */
+void suspend_data_block(struct data_block_t *block) {
+  struct chunk_table_t table = block->chunks;
+  block->chunks.offsets = NULL;
+  block->chunks.sizes = NULL;
+  block->chunks.filter_masks = NULL;
+  close_data_block(block);
+  table.fd = -1;
+  block->chunks = table;
+}
+
+void free_nxs_desc(struct ds_desc_t *desc) {
+  struct nxs_ds_desc_t *nxs_desc = (struct nxs_ds_desc_t *)desc;
+  close_data_block(&nxs_desc->block);
+  free_ds_desc(desc);
+}
 
 void free_eiger_desc(struct ds_desc_t *desc) {
   struct eiger_ds_desc_t *e_desc = (struct eiger_ds_desc_t *)desc;
+  int n;
+  if (e_desc->blocks) {
+    for (n = 0; n < e_desc->n_data_blocks; n++) {
+      close_data_block(&e_desc->blocks[n]);
+    }
+    free(e_desc->blocks);
+  }
   free(e_desc->block_sizes);
+  free(e_desc->block_starts);
+  free(e_desc->block_readers);
+  free(e_desc->block_last_use);
+  if (e_desc->pooled_blocks)
+    pthread_mutex_destroy(&e_desc->block_lock);
+  close_data_index(e_desc->index);
   free_ds_desc(desc);
 }
 
-void free_opt_eiger_desc(struct ds_desc_t *desc) { free_eiger_desc(desc); }
+void free_opt_eiger_desc(struct ds_desc_t *desc) {
+  struct opt_eiger_ds_desc_t *o_eiger_desc = (struct opt_eiger_ds_desc_t *)desc;
+  if (o_eiger_desc->chunk_cache)
+    free_chunk_cache(o_eiger_desc->chunk_cache);
+  if (o_eiger_desc->tile_pool)
+    free_worker_pool(o_eiger_desc->tile_pool);
+  free_eiger_desc(desc);
+}
 
 double scale_from_units(const char *unit_string) {
   if (strcasecmp("m", unit_string) == 0 ||
@@ -65,80 +152,114 @@ double scale_from_units(const char *unit_string) {
   }
 }
 
-int get_nxs_dataset_dims(struct ds_desc_t *desc) {
-  hid_t g_id, ds_id, s_id, t_id;
+int open_data_block(hid_t g_id, const char *name, struct data_block_t *block) {
+  /* open the dataset with its type and space, which are kept until the
+   * descriptor is freed */
   int retval = 0;
   int ndims = 0;
-  int width = 0;
-  g_id = desc->data_g_id;
-  ;
 
-  ds_id = H5Dopen2(g_id, "data", H5P_DEFAULT);
-  if (ds_id <= 0) {
-    ERROR_JUMP(-1, done, "Unable to open 'data' dataset");
+  init_data_block(block);
+  sprintf(block->name, "%.15s", name);
+
+  block->ds_id = H5Dopen2(g_id, name, H5P_DEFAULT);
+  if (block->ds_id <= 0) {
+    char message[64];
+    sprintf(message, "Unable to open dataset %.32s", name);
+    ERROR_JUMP(-1, done, message);
   }
 
-  t_id = H5Dget_type(ds_id);
-  if (t_id <= 0) {
-    ERROR_JUMP(-1, close_dataset, "Error getting datatype");
+  block->t_id = H5Dget_type(block->ds_id);
+  if (block->t_id <= 0) {
+    ERROR_JUMP(-1, done, "Error getting datatype");
   }
 
-  width = H5Tget_size(t_id);
-  if (width <= 0) {
-    ERROR_JUMP(-1, close_type, "Error getting type size");
+  if (H5Tget_size(block->t_id) <= 0) {
+    ERROR_JUMP(-1, done, "Error getting type size");
   }
 
-  s_id = H5Dget_space(ds_id);
-  if (s_id <= 0) {
-    ERROR_JUMP(-1, close_dataset, "Error getting dataspace");
+  block->s_id = H5Dget_space(block->ds_id);
+  if (block->s_id <= 0) {
+    ERROR_JUMP(-1, done, "Error getting dataspace");
   }
 
-  ndims = H5Sget_simple_extent_ndims(s_id);
+  ndims = H5Sget_simple_extent_ndims(block->s_id);
   if (ndims != 3) {
     char message[64];
-    sprintf(message, "Dataset rank is %d, expected %d", ndims, 3);
-    ERROR_JUMP(-1, close_space, message);
+    sprintf(message, "Dataset %.16s has rank %d, expected %d", name, ndims, 3);
+    ERROR_JUMP(-1, done, message);
+  }
+
+done:
+  if (retval < 0)
+    close_data_block(block);
+  return retval;
+}
+
+int get_nxs_dataset_dims(struct ds_desc_t *desc) {
+  int retval = 0;
+  struct nxs_ds_desc_t *nxs_desc = (struct nxs_ds_desc_t *)desc;
+  struct data_block_t *block = &nxs_desc->block;
+
+  if (open_data_block(desc->data_g_id, "data", block) < 0) {
+    ERROR_JUMP(-1, done, "Unable to open 'data' dataset");
   }
 
-  if (H5Sget_simple_extent_dims(s_id, desc->dims, NULL) < 0) {
-    ERROR_JUMP(-1, close_space, "Error getting dataset dimensions");
+  if (H5Sget_simple_extent_dims(block->s_id, desc->dims, NULL) < 0) {
+    close_data_block(block);
+    ERROR_JUMP(-1, done, "Error getting dataset dimensions");
   }
 
-  desc->data_width = width;
+  desc->data_width = H5Tget_size(block->t_id);
+
+done:
+  return retval;
+}
+
+int get_chunked_nxs_dataset_dims(struct ds_desc_t *desc) {
+  /* the 'data' dataset as the only data block of an Eiger descriptor */
+  int retval = 0;
+  struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
+  struct data_block_t *block = NULL;
+
+  eiger_desc->blocks = malloc(sizeof(*eiger_desc->blocks));
+  eiger_desc->block_sizes = malloc(sizeof(*eiger_desc->block_sizes));
+  eiger_desc->block_starts = malloc(2 * sizeof(*eiger_desc->block_starts));
+  if (!eiger_desc->blocks || !eiger_desc->block_sizes ||
+      !eiger_desc->block_starts) {
+    ERROR_JUMP(-1, done, "Unable to allocate data block description");
+  }
+  block = eiger_desc->blocks;
+  if (open_data_block(desc->data_g_id, "data", block) < 0) {
+    ERROR_JUMP(-1, done, "Unable to open 'data' dataset");
+  }
+  eiger_desc->n_data_blocks = 1;
+
+  if (H5Sget_simple_extent_dims(block->s_id, desc->dims, NULL) < 0) {
+    ERROR_JUMP(-1, done, "Error getting dataset dimensions");
+  }
+  desc->data_width = H5Tget_size(block->t_id);
+  eiger_desc->block_sizes[0] = desc->dims[0];
+  eiger_desc->block_starts[0] = 0;
+  eiger_desc->block_starts[1] = desc->dims[0];
+  eiger_desc->uniform_block_size = desc->dims[0];
 
-close_space:
-  H5Sclose(s_id);
-close_type:
-  H5Tclose(t_id);
-close_dataset:
-  H5Dclose(ds_id);
 done:
   return retval;
 }
 
-int get_frame_simple(const struct ds_desc_t *desc, const char *name,
-                     const hsize_t *frame_idx, const hsize_t *frame_size,
-                     void *buffer) {
+int get_frame_simple(const struct ds_desc_t *desc,
+                     const struct data_block_t *block, const hsize_t *frame_idx,
+                     const hsize_t *frame_size, void *buffer) {
 
   int retval = 0;
   herr_t err = 0;
-  hid_t g_id, ds_id, s_id, ms_id, t_id;
+  hid_t s_id, ms_id;
 
-  g_id = desc->data_g_id;
-
-  ds_id = H5Dopen2(g_id, name, H5P_DEFAULT);
-  if (ds_id <= 0) {
-    char message[64];
-    sprintf(message, "Unable to open dataset %.32s", name);
-    ERROR_JUMP(-1, done, message);
-  }
-  s_id = H5Dget_space(ds_id);
+  /* the selection is made on a copy as the cached dataspace is shared
+   * between threads */
+  s_id = H5Scopy(block->s_id);
   if (s_id <= 0) {
-    ERROR_JUMP(-1, close_dataset, "Error getting dataspace");
-  }
-  t_id = H5Dget_type(ds_id);
-  if (t_id <= 0) {
-    ERROR_JUMP(-1, close_type, "Error retrieving datatype");
+    ERROR_JUMP(-1, done, "Error copying dataspace");
   }
   err = H5Sselect_hyperslab(s_id, H5S_SELECT_SET, frame_idx, NULL, frame_size,
                             NULL);
@@ -150,248 +271,1034 @@ int get_frame_simple(const struct ds_desc_t *desc, const char *name,
     ERROR_JUMP(-1, close_space, "Could not create dataspace");
   }
 
-  err = H5Dread(ds_id, t_id, ms_id, s_id, H5P_DEFAULT, buffer);
+  err = H5Dread(block->ds_id, block->t_id, ms_id, s_id, H5P_DEFAULT, buffer);
   if (err < 0) {
-    ERROR_JUMP(-1, close_mspace, "Error reading dataset");
+    char message[64];
+    sprintf(message, "Error reading dataset %.16s", block->name);
+    ERROR_JUMP(-1, close_mspace, message);
   }
 
 close_mspace:
   H5Sclose(ms_id);
 close_space:
   H5Sclose(s_id);
-close_type:
-  H5Tclose(t_id);
-close_dataset:
-  H5Dclose(ds_id);
 done:
   return retval;
 }
 
-int get_frame_from_chunk(const struct ds_desc_t *desc, const char *ds_name,
-                         const hsize_t *frame_idx, const hsize_t *frame_size,
-                         void *buffer) {
-
-  hid_t d_id = 0;
-  hsize_t c_offset[3] = {frame_idx[0], 0, 0};
-  uint32_t c_filter_mask = 0;
-  hsize_t c_bytes;
-  void *c_buffer = NULL;
-  const struct opt_eiger_ds_desc_t *o_eiger_desc =
-      (struct opt_eiger_ds_desc_t *)desc;
+int get_chunk_size_hdf5(const struct data_block_t *block,
+                        const hsize_t *c_offset, hsize_t *c_bytes) {
   int retval = 0;
+  if (H5Dget_chunk_storage_size(block->ds_id, c_offset, c_bytes) < 0) {
+    char message[96];
+    sprintf(message, "Error reading chunk size from %.32s for frame %llu",
+            block->name, c_offset[0]);
+    ERROR_JUMP(-1, done, message);
+  }
+done:
+  return retval;
+}
 
-  if (frame_idx[1] != 0 || frame_idx[2] != 0) {
-    char message[64];
+int read_chunk_hdf5(const struct data_block_t *block, const hsize_t *c_offset,
+                    const hsize_t c_bytes, void *buffer,
+                    unsigned int *filter_mask) {
+  int retval = 0;
+  uint32_t c_filter_mask = 0;
+  if (H5DOread_chunk(block->ds_id, H5P_DEFAULT, c_offset, &c_filter_mask,
+                     buffer) < 0) {
+    char message[128];
     sprintf(message,
-            "Require frame selection starts at [n, 0, 0], not [n, %llu, %llu]",
-            frame_idx[1], frame_idx[2]);
+            "Error reading chunk %llu from dataset %.32s - size %llu bytes",
+            c_offset[0], block->name, c_bytes);
     ERROR_JUMP(-1, done, message);
   }
+  *filter_mask = c_filter_mask;
+done:
+  return retval;
+}
 
-  d_id = H5Dopen(desc->data_g_id, ds_name, H5P_DEFAULT);
-  if (d_id < 0) {
-    char message[64];
-    sprintf(message, "Error opening dataset %.32s", ds_name);
+/* position in the chunk table of the chunk at c_offset */
+hsize_t chunk_table_index(const struct chunk_table_t *table,
+                          const hsize_t *c_offset) {
+  return (c_offset[0] / table->chunk_dims[0]) * table->tiles_per_frame +
+         (c_offset[1] / table->chunk_dims[1]) * table->tile_columns +
+         c_offset[2] / table->chunk_dims[2];
+}
+
+int get_chunk_size_direct(const struct data_block_t *block,
+                          const hsize_t *c_offset, hsize_t *c_bytes) {
+  int retval = 0;
+  const struct chunk_table_t *table = &block->chunks;
+  hsize_t c_index;
+  /* blocks opened after a failed table build are read through HDF5 */
+  if (!table->offsets)
+    return get_chunk_size_hdf5(block, c_offset, c_bytes);
+  c_index = chunk_table_index(table, c_offset);
+  if (c_index >= table->n_chunks) {
+    char message[128];
+    sprintf(message, "Frame %llu is beyond the %llu chunks of dataset %.32s",
+            c_offset[0], table->n_chunks, block->name);
     ERROR_JUMP(-1, done, message);
   }
+  *c_bytes = table->sizes[c_index];
+done:
+  return retval;
+}
 
-  if (H5Dget_chunk_storage_size(d_id, c_offset, &c_bytes) < 0) {
-    char message[96];
-    sprintf(message, "Error reading chunk size from %.32s for frame %llu",
-            ds_name, frame_idx[0]);
-    ERROR_JUMP(-1, done, message);
+int read_chunk_direct(const struct data_block_t *block, const hsize_t *c_offset,
+                      const hsize_t c_bytes, void *buffer,
+                      unsigned int *filter_mask) {
+  int retval = 0;
+  const struct chunk_table_t *table = &block->chunks;
+  hsize_t c_index;
+  size_t remaining = c_bytes;
+  off_t offset;
+  char *dest = buffer;
+  if (!table->offsets)
+    return read_chunk_hdf5(block, c_offset, c_bytes, buffer, filter_mask);
+  c_index = chunk_table_index(table, c_offset);
+  offset = table->offsets[c_index];
+  while (remaining > 0) {
+    ssize_t count = pread(table->fd, dest, remaining, offset);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0) {
+      char message[160];
+      sprintf(message,
+              "Error reading chunk %llu of %.32s at offset %lld: %.64s",
+              c_index, block->name, (long long)offset,
+              count < 0 ? strerror(errno) : "unexpected end of file");
+      ERROR_JUMP(-1, done, message);
+    }
+    remaining -= count;
+    offset += count;
+    dest += count;
+  }
+  *filter_mask = table->filter_masks[c_index];
+done:
+  return retval;
+}
+
+int read_frame_chunk(const struct opt_eiger_ds_desc_t *o_eiger_desc,
+                     const struct data_block_t *block,
+                     const hsize_t *frame_idx, const size_t out_size,
+                     void *raw_buffer, void **c_buffer, hsize_t *c_bytes,
+                     unsigned int *filter_mask) {
+  /* read the chunk starting at frame_idx - unfiltered chunks are read
+   * straight into raw_buffer if one is given, anything else into a scratch
+   * buffer */
+  int retval = 0;
+
+  if (o_eiger_desc->chunk_size_func(block, frame_idx, c_bytes) < 0) {
+    ERROR_JUMP(-1, done, "");
   }
-  if (c_bytes == 0) {
+  if (*c_bytes == 0) {
     char message[96];
     sprintf(message, "Target chunk %llu has zero size for dataset %.32s",
-            frame_idx[0], ds_name);
+            frame_idx[0], block->name);
     ERROR_JUMP(-1, done, message);
   }
 
-  if (o_eiger_desc->bs_applied) {
-    c_buffer = malloc(c_bytes);
-    if (!c_buffer) {
-      char message[128];
+  if (o_eiger_desc->pipeline.n_filters > 0 || !raw_buffer) {
+    *c_buffer = get_scratch_buffer(SCRATCH_CHUNK, *c_bytes);
+    if (!*c_buffer) {
+      char message[160];
       sprintf(message,
               "Unable to allocate chunk buffer for dataset %.32s - frame %llu, "
               "size %llu bytes",
-              ds_name, frame_idx[0], c_bytes);
+              block->name, frame_idx[0], *c_bytes);
       ERROR_JUMP(-1, done, message);
     }
   } else {
-    c_buffer = buffer;
+    if (*c_bytes != out_size) {
+      char message[128];
+      sprintf(message,
+              "Unfiltered chunk %llu in %.32s is %llu bytes, expected %lu",
+              frame_idx[0], block->name, *c_bytes, out_size);
+      ERROR_JUMP(-1, done, message);
+    }
+    *c_buffer = raw_buffer;
   }
 
-  if (H5DOread_chunk(d_id, H5P_DEFAULT, c_offset, &c_filter_mask, c_buffer) <
-      0) {
+  if (o_eiger_desc->chunk_read_func(block, frame_idx, *c_bytes, *c_buffer,
+                                    filter_mask) < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+
+  if (!pipeline_applied(&o_eiger_desc->pipeline, *filter_mask) &&
+      *c_bytes != out_size) {
     char message[128];
     sprintf(message,
-            "Error reading chunk %llu from dataset %.32s - size %llu bytes",
-            frame_idx[0], ds_name, c_bytes);
+            "Unfiltered chunk %llu in %.32s is %llu bytes, expected %lu",
+            frame_idx[0], block->name, *c_bytes, out_size);
     ERROR_JUMP(-1, done, message);
   }
 
-  if (o_eiger_desc->bs_applied) {
-    if (bslz4_decompress(o_eiger_desc->bs_params, c_bytes, c_buffer,
-                         desc->data_width * frame_size[1] * frame_size[2],
-                         buffer) < 0) {
+done:
+  return retval;
+}
+
+int get_frame_from_chunk(const struct ds_desc_t *desc,
+                         const struct data_block_t *block,
+                         const hsize_t *frame_idx, const hsize_t *frame_size,
+                         void *buffer) {
+
+  hsize_t c_bytes;
+  void *c_buffer = NULL;
+  unsigned int filter_mask = 0;
+  size_t out_size =
+      desc->data_width * frame_size[0] * frame_size[1] * frame_size[2];
+  const struct opt_eiger_ds_desc_t *o_eiger_desc =
+      (struct opt_eiger_ds_desc_t *)desc;
+  int retval = 0;
+
+  if (read_frame_chunk(o_eiger_desc, block, frame_idx, out_size, buffer,
+                       &c_buffer, &c_bytes, &filter_mask) < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+
+  if (pipeline_applied(&o_eiger_desc->pipeline, filter_mask)) {
+    if (decode_chunk(&o_eiger_desc->pipeline, filter_mask, desc->data_width,
+                     c_bytes, c_buffer, out_size, buffer) < 0) {
       char message[128];
-      sprintf(message,
-              "Error processing chunk %llu from %.32s with bitshuffle_lz4",
-              frame_idx[0], ds_name);
+      sprintf(message, "Error decoding chunk %llu from %.32s", frame_idx[0],
+              block->name);
       ERROR_JUMP(-1, done, message);
     }
+  } else if (c_buffer != buffer) {
+    memcpy(buffer, c_buffer, out_size);
   }
 
 done:
-  if (c_buffer && (c_buffer != buffer))
-    free(c_buffer);
-  if (d_id)
-    H5Dclose(d_id);
   return retval;
 }
 
-int get_nxs_frame(const struct ds_desc_t *desc, const int n, void *buffer) {
-  /* detector data are the two inner most indices */
-  /* TODO: handle ndims > 3 and select appropriately */
+int get_frame_from_chunk_int(const struct ds_desc_t *desc,
+                             const struct data_block_t *block,
+                             const hsize_t *frame_idx,
+                             const hsize_t *frame_size, int *buffer,
+                             const struct pixel_mask_t *mask,
+                             const struct pixel_region_t *region) {
+
+  hsize_t c_bytes;
+  void *c_buffer = NULL;
+  unsigned int filter_mask = 0;
+  size_t n_pixels = frame_size[1] * frame_size[2];
+  size_t out_size = desc->data_width * n_pixels;
+  const struct opt_eiger_ds_desc_t *o_eiger_desc =
+      (struct opt_eiger_ds_desc_t *)desc;
   int retval = 0;
-  hsize_t frame_idx[3] = {n, 0, 0};
-  hsize_t frame_size[3] = {1, desc->dims[1], desc->dims[2]};
-  if (n < 0 || n >= desc->dims[0]) {
-    char message[64];
-    sprintf(message, "Selected frame %d is out of range valid range [0, %d]", n,
-            (int)desc->dims[0] - 1);
-    ERROR_JUMP(-1, done, message);
+
+  if (read_frame_chunk(o_eiger_desc, block, frame_idx, out_size, NULL,
+                       &c_buffer, &c_bytes, &filter_mask) < 0) {
+    ERROR_JUMP(-1, done, "");
   }
-  retval = get_frame_simple(desc, "data", frame_idx, frame_size, buffer);
-  if (retval < 0) {
-    ERROR_JUMP(retval, done, "");
+
+  if (pipeline_applied(&o_eiger_desc->pipeline, filter_mask)) {
+    if (decode_chunk_to_int(&o_eiger_desc->pipeline, filter_mask,
+                            desc->data_width, c_bytes, c_buffer, out_size,
+                            buffer, mask, region) < 0) {
+      char message[128];
+      sprintf(message, "Error decoding chunk %llu from %.32s", frame_idx[0],
+              block->name);
+      ERROR_JUMP(-1, done, message);
+    }
+  } else {
+    if (convert_and_mask_region(c_buffer, desc->data_width, buffer, n_pixels,
+                                region, mask) < 0) {
+      ERROR_JUMP(-1, done, "");
+    }
   }
+
 done:
   return retval;
 }
 
-int get_dectris_eiger_frame(const struct ds_desc_t *desc, int n, void *buffer) {
+/* a chunk of several frames to be decoded into the chunk cache */
+struct chunk_load_args_t {
+  const struct ds_desc_t *desc;
+  const struct data_block_t *block;
+  hsize_t chunk_idx[3];
+  hsize_t chunk_size[3];
+};
+
+int load_chunk(void *arg, void *buffer) {
+  struct chunk_load_args_t *args = arg;
+  return get_frame_from_chunk(args->desc, args->block, args->chunk_idx,
+                              args->chunk_size, buffer);
+}
 
+/* decoded chunk holding a frame from the chunk cache, and the offset of the
+ * frame in it */
+int acquire_frame_chunk(const struct ds_desc_t *desc,
+                        const struct data_block_t *block,
+                        const hsize_t *frame_idx, const hsize_t *frame_size,
+                        const char **frame_data) {
   int retval = 0;
-  int block, frame_count, idx;
-  struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
-  char data_name[16] = {0};
-  hsize_t frame_idx[3] = {0, 0, 0};
-  hsize_t frame_size[3] = {1, desc->dims[1], desc->dims[2]};
-
-  if (n < 0 || n >= desc->dims[0]) {
-    char message[64];
-    sprintf(message, "Selected frame %d is out of range valid range [0, %d]", n,
-            (int)desc->dims[0] - 1);
-    ERROR_JUMP(-1, done, message);
-  }
-
-  /* determine the relevant data block */
-  frame_count = 0;
-  block = 0;
-  while ((frame_count += eiger_desc->block_sizes[block]) <= n)
-    block++;
-  idx = n - (frame_count -
-             eiger_desc->block_sizes[block]); /* index in current block */
-  frame_idx[0] = idx;
-  sprintf(data_name, "data_%06d", block + 1);
-  retval =
-      eiger_desc->frame_func(desc, data_name, frame_idx, frame_size, buffer);
+  const struct opt_eiger_ds_desc_t *o_eiger_desc =
+      (struct opt_eiger_ds_desc_t *)desc;
+  hsize_t n_frames = o_eiger_desc->frames_per_chunk;
+  size_t frame_bytes = desc->data_width * frame_size[1] * frame_size[2];
+  const void *chunk_data;
+  struct chunk_load_args_t args;
+
+  args.desc = desc;
+  args.block = block;
+  args.chunk_idx[0] = frame_idx[0] - frame_idx[0] % n_frames;
+  args.chunk_idx[1] = 0;
+  args.chunk_idx[2] = 0;
+  args.chunk_size[0] = n_frames;
+  args.chunk_size[1] = frame_size[1];
+  args.chunk_size[2] = frame_size[2];
+
+  retval = acquire_chunk(o_eiger_desc->chunk_cache, block,
+                         args.chunk_idx[0] / n_frames, &load_chunk, &args,
+                         &chunk_data);
   if (retval < 0) {
-    ERROR_JUMP(retval, done, "");
+    ERROR_JUMP(-1, done, "");
   }
+  *frame_data = (const char *)chunk_data +
+                (frame_idx[0] - args.chunk_idx[0]) * frame_bytes;
 done:
   return retval;
 }
 
-int get_dectris_eiger_dataset_dims(struct ds_desc_t *desc) {
+int get_frame_from_cached_chunk(const struct ds_desc_t *desc,
+                                const struct data_block_t *block,
+                                const hsize_t *frame_idx,
+                                const hsize_t *frame_size, void *buffer) {
   int retval = 0;
-  int n_datas = 0;
-  int n = 0;
-  int data_width = 0;
-  int ndims = 3;
-  char ds_name[16] = {0}; /* 12 chars in "data_xxxxxx\0" */
-  int *frame_counts = NULL;
-  hsize_t dims[3] = {0};
-  struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
-
-  /* datasets are "data_%06d % n" - need to determine how many of these there
-   * are and what the ranges are */
+  int handle;
+  const char *frame_data;
+  const struct opt_eiger_ds_desc_t *o_eiger_desc =
+      (struct opt_eiger_ds_desc_t *)desc;
 
-  sprintf(ds_name, "data_%06d", n_datas + 1);
-  while (H5Lexists(desc->data_g_id, ds_name, H5P_DEFAULT) > 0) {
-    sprintf(ds_name, "data_%06d", ++n_datas + 1);
+  handle =
+      acquire_frame_chunk(desc, block, frame_idx, frame_size, &frame_data);
+  if (handle < 0) {
+    ERROR_JUMP(-1, done, "");
   }
+  memcpy(buffer, frame_data, desc->data_width * frame_size[1] * frame_size[2]);
+  release_chunk(o_eiger_desc->chunk_cache, handle);
+done:
+  return retval;
+}
 
-  frame_counts = malloc(n_datas * sizeof(*frame_counts));
+int get_frame_from_cached_chunk_int(const struct ds_desc_t *desc,
+                                    const struct data_block_t *block,
+                                    const hsize_t *frame_idx,
+                                    const hsize_t *frame_size, int *buffer,
+                                    const struct pixel_mask_t *mask,
+                                    const struct pixel_region_t *region) {
+  int retval = 0;
+  int handle;
+  const char *frame_data;
+  const struct opt_eiger_ds_desc_t *o_eiger_desc =
+      (struct opt_eiger_ds_desc_t *)desc;
 
-  for (n = 0; n < n_datas; n++) {
-    hid_t ds_id, t_id, s_id;
-    hsize_t block_dims[3] = {0};
-    sprintf(ds_name, "data_%06d", n + 1);
-    ds_id = H5Dopen2(desc->data_g_id, ds_name, H5P_DEFAULT);
-    if (ds_id < 0) {
-      char message[64];
-      sprintf(message, "Unable to open dataset %.16s", ds_name);
-      ERROR_JUMP(-1, loop_end, message);
-    }
-    t_id = H5Dget_type(ds_id);
-    if (t_id < 0) {
-      ERROR_JUMP(-1, close_dataset, "Unable to get datatype")
-    }
-    s_id = H5Dget_space(ds_id);
-    if (s_id < 0) {
-      ERROR_JUMP(-1, close_type, "Unable to get dataspace");
-    }
+  handle =
+      acquire_frame_chunk(desc, block, frame_idx, frame_size, &frame_data);
+  if (handle < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+  retval = convert_and_mask_region(frame_data, desc->data_width, buffer,
+                                   frame_size[1] * frame_size[2], region, mask);
+  release_chunk(o_eiger_desc->chunk_cache, handle);
+done:
+  return retval;
+}
 
-    data_width = H5Tget_size(t_id);
-    if (data_width <= 0) {
-      ERROR_JUMP(-1, close_space, "Unable to get type size");
-    }
+/* a frame assembled from separately decoded tiles */
+struct tile_read_args_t {
+  const struct ds_desc_t *desc;
+  const struct data_block_t *block;
+  hsize_t frame;
+  void *buffer;
+  int *int_buffer;
+  const struct pixel_mask_t *mask;
+  const struct pixel_region_t *region;
+};
+
+/* read and decode one tile, copying the part inside the frame (and the
+ * region, if any) into the output, converted to int if required */
+int read_tile(void *arg, int n) {
+  int retval = 0;
+  const struct tile_read_args_t *args = arg;
+  const struct ds_desc_t *desc = args->desc;
+  const struct opt_eiger_ds_desc_t *o_eiger_desc =
+      (struct opt_eiger_ds_desc_t *)desc;
+  const hsize_t *tile_size = o_eiger_desc->tile_size;
+  hsize_t n_columns = (desc->dims[2] + tile_size[1] - 1) / tile_size[1];
+  hsize_t c_offset[3];
+  hsize_t rows, columns, row, first_row = 0, first_column = 0;
+  hsize_t c_bytes;
+  size_t width = desc->data_width;
+  size_t tile_bytes = width * tile_size[0] * tile_size[1];
+  unsigned int filter_mask = 0;
+  void *c_buffer = NULL;
+  const char *tile;
+
+  c_offset[0] = args->frame;
+  c_offset[1] = n / n_columns * tile_size[0];
+  c_offset[2] = n % n_columns * tile_size[1];
+  /* tiles on the far edges may extend beyond the frame */
+  rows = desc->dims[1] - c_offset[1];
+  if (rows > tile_size[0])
+    rows = tile_size[0];
+  columns = desc->dims[2] - c_offset[2];
+  if (columns > tile_size[1])
+    columns = tile_size[1];
+  if (args->region) {
+    const struct pixel_region_t *region = args->region;
+    /* tiles outside the region are not read at all */
+    if (c_offset[1] >= region->y1 || c_offset[1] + rows <= region->y0 ||
+        c_offset[2] >= region->x1 || c_offset[2] + columns <= region->x0)
+      goto done;
+    if (c_offset[1] < region->y0)
+      first_row = region->y0 - c_offset[1];
+    if (c_offset[1] + rows > region->y1)
+      rows = region->y1 - c_offset[1];
+    if (c_offset[2] < region->x0)
+      first_column = region->x0 - c_offset[2];
+    if (c_offset[2] + columns > region->x1)
+      columns = region->x1 - c_offset[2];
+  }
 
-    ndims = H5Sget_simple_extent_ndims(s_id);
-    if (ndims != 3) {
-      char message[64];
-      sprintf(message, "Dataset %.16s has rank %d, expected %d", ds_name, ndims,
-              3);
-      ERROR_JUMP(-1, close_space, message);
+  if (read_frame_chunk(o_eiger_desc, args->block, c_offset, tile_bytes, NULL,
+                       &c_buffer, &c_bytes, &filter_mask) < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+  tile = c_buffer;
+  if (pipeline_applied(&o_eiger_desc->pipeline, filter_mask)) {
+    void *decoded = get_scratch_buffer(SCRATCH_TILE, tile_bytes);
+    if (!decoded) {
+      ERROR_JUMP(-1, done, "Unable to allocate tile buffer");
     }
-    if (H5Sget_simple_extent_dims(s_id, block_dims, NULL) < 0) {
-      ERROR_JUMP(-1, close_space, "Unable to read dataset dimensions");
+    if (decode_chunk(&o_eiger_desc->pipeline, filter_mask, width, c_bytes,
+                     c_buffer, tile_bytes, decoded) < 0) {
+      char message[128];
+      sprintf(message, "Error decoding tile [%llu, %llu, %llu] from %.32s",
+              c_offset[0], c_offset[1], c_offset[2], args->block->name);
+      ERROR_JUMP(-1, done, message);
     }
-
-    dims[1] = block_dims[1];
-    dims[2] = block_dims[2];
-
-    dims[0] += block_dims[0];
-    frame_counts[n] = block_dims[0];
-
-  close_space:
-    H5Sclose(s_id);
-  close_type:
-    H5Tclose(t_id);
-  close_dataset:
-    H5Dclose(ds_id);
-  loop_end:
-    if (retval < 0)
-      break;
+    tile = decoded;
   }
 
-  if (retval < 0) {
-    free(frame_counts);
-  } else {
-    memcpy(desc->dims, dims, 3 * sizeof(*dims));
-    desc->data_width = data_width;
-    eiger_desc->n_data_blocks = n_datas;
-    eiger_desc->block_sizes = frame_counts;
+  for (row = first_row; row < rows; row++) {
+    size_t px =
+        (c_offset[1] + row) * desc->dims[2] + c_offset[2] + first_column;
+    const char *src = tile + (row * tile_size[1] + first_column) * width;
+    if (args->int_buffer) {
+      if (convert_and_mask_pixels(src, width, args->int_buffer + px, px,
+                                  columns - first_column, args->mask) < 0) {
+        ERROR_JUMP(-1, done, "");
+      }
+    } else {
+      memcpy((char *)args->buffer + px * width, src,
+             (columns - first_column) * width);
+    }
   }
+
+done:
   return retval;
 }
 
-int read_pixel_info(hid_t g_id, const char *path, double *size) {
-  /*
-   * NXdetector allows pixel size to be an array (for varied pixel size),
+int read_tiles(const struct ds_desc_t *desc, const struct data_block_t *block,
+               const hsize_t *frame_idx, void *buffer, int *int_buffer,
+               const struct pixel_mask_t *mask,
+               const struct pixel_region_t *region) {
+  int retval = 0;
+  const struct opt_eiger_ds_desc_t *o_eiger_desc =
+      (struct opt_eiger_ds_desc_t *)desc;
+  const hsize_t *tile_size = o_eiger_desc->tile_size;
+  int n_tiles = ((desc->dims[1] + tile_size[0] - 1) / tile_size[0]) *
+                ((desc->dims[2] + tile_size[1] - 1) / tile_size[1]);
+  struct tile_read_args_t args;
+  int n = 0;
+
+  args.desc = desc;
+  args.block = block;
+  args.frame = frame_idx[0];
+  args.buffer = buffer;
+  args.int_buffer = int_buffer;
+  args.mask = mask;
+  args.region = region;
+
+  if (o_eiger_desc->tile_pool) {
+    retval = run_worker_tasks(o_eiger_desc->tile_pool, n_tiles, &read_tile,
+                              &args, &n);
+  } else {
+    for (n = 0; n < n_tiles; n++) {
+      if ((retval = read_tile(&args, n)) < 0)
+        break;
+    }
+  }
+  if (retval < 0) {
+    char message[96];
+    sprintf(message, "Error reading tile %d of frame %llu from %.32s", n,
+            frame_idx[0], block->name);
+    ERROR_JUMP(-1, done, message);
+  }
+done:
+  return retval;
+}
+
+int get_frame_from_tiles(const struct ds_desc_t *desc,
+                         const struct data_block_t *block,
+                         const hsize_t *frame_idx, const hsize_t *frame_size,
+                         void *buffer) {
+  return read_tiles(desc, block, frame_idx, buffer, NULL, NULL, NULL);
+}
+
+int get_nxs_frame(const struct ds_desc_t *desc, const int n, void *buffer) {
+  /* detector data are the two inner most indices */
+  /* TODO: handle ndims > 3 and select appropriately */
+  int retval = 0;
+  const struct nxs_ds_desc_t *nxs_desc = (struct nxs_ds_desc_t *)desc;
+  hsize_t frame_idx[3] = {n, 0, 0};
+  hsize_t frame_size[3] = {1, desc->dims[1], desc->dims[2]};
+  if (n < 0 || n >= desc->dims[0]) {
+    char message[64];
+    sprintf(message, "Selected frame %d is out of range valid range [0, %d]", n,
+            (int)desc->dims[0] - 1);
+    ERROR_JUMP(-1, done, message);
+  }
+  retval =
+      get_frame_simple(desc, &nxs_desc->block, frame_idx, frame_size, buffer);
+  if (retval < 0) {
+    ERROR_JUMP(retval, done, "");
+  }
+done:
+  return retval;
+}
+
+/* close the least recently used open block with no readers, if any. Called
+ * with block_lock held */
+void evict_eiger_block(struct eiger_ds_desc_t *eiger_desc) {
+  int n, oldest = -1;
+  for (n = 0; n < eiger_desc->n_data_blocks; n++) {
+    if (eiger_desc->blocks[n].ds_id > 0 && eiger_desc->block_readers[n] == 0 &&
+        (oldest < 0 || eiger_desc->block_last_use[n] <
+                           eiger_desc->block_last_use[oldest])) {
+      oldest = n;
+    }
+  }
+  if (oldest >= 0) {
+    suspend_data_block(&eiger_desc->blocks[oldest]);
+    eiger_desc->n_open_blocks--;
+  }
+}
+
+/* open data block n if it is closed, checking it holds the frames expected
+ * of it, and hold it open until release_eiger_block */
+int acquire_eiger_block(const struct ds_desc_t *desc, int n) {
+  int retval = 0;
+  struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
+  struct data_block_t *block = &eiger_desc->blocks[n];
+  struct chunk_table_t chunks;
+  hsize_t block_dims[3] = {0};
+  char ds_name[32] = {0};
+
+  if (!eiger_desc->pooled_blocks)
+    return 0;
+  pthread_mutex_lock(&eiger_desc->block_lock);
+  if (block->ds_id > 0)
+    goto acquired;
+
+  /* the pool may go over its limit while every open block is being read */
+  if (eiger_desc->n_open_blocks >= eiger_desc->max_open_blocks)
+    evict_eiger_block(eiger_desc);
+  sprintf(ds_name, "data_%06d", n + 1);
+  /* keep any chunk locations from an earlier opening of the block */
+  chunks = block->chunks;
+  if (open_data_block(desc->data_g_id, ds_name, block) < 0) {
+    clear_chunk_table(&chunks);
+    ERROR_JUMP(-1, unlock, "");
+  }
+  block->chunks = chunks;
+  if (H5Sget_simple_extent_dims(block->s_id, block_dims, NULL) < 0 ||
+      block_dims[0] != eiger_desc->block_sizes[n] ||
+      block_dims[1] != desc->dims[1] || block_dims[2] != desc->dims[2] ||
+      H5Tget_size(block->t_id) != desc->data_width) {
+    char message[160];
+    sprintf(message,
+            "Dataset %.16s holds %llu frames of %llu x %llu pixels, expected "
+            "%d frames of %llu x %llu pixels of %d bytes",
+            ds_name, block_dims[0], block_dims[2], block_dims[1],
+            eiger_desc->block_sizes[n], desc->dims[2], desc->dims[1],
+            desc->data_width);
+    close_data_block(block);
+    ERROR_JUMP(-1, unlock, message);
+  }
+
+  if (desc->free_desc == &free_opt_eiger_desc &&
+      ((struct opt_eiger_ds_desc_t *)desc)->chunk_size_func ==
+          &get_chunk_size_direct &&
+      build_block_chunk_table((struct opt_eiger_ds_desc_t *)desc, n) < 0) {
+    fprintf(stderr, "WARNING: Could not set up direct chunk reads for %s - "
+                    "falling back to HDF5 chunk reads\n",
+            ds_name);
+    dump_error_stack(stderr);
+    reset_error_stack();
+  }
+  eiger_desc->n_open_blocks++;
+
+acquired:
+  eiger_desc->block_readers[n]++;
+  eiger_desc->block_last_use[n] = ++eiger_desc->block_clock;
+unlock:
+  pthread_mutex_unlock(&eiger_desc->block_lock);
+  return retval;
+}
+
+void release_eiger_block(const struct ds_desc_t *desc, int n) {
+  struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
+  if (!eiger_desc->pooled_blocks)
+    return;
+  pthread_mutex_lock(&eiger_desc->block_lock);
+  eiger_desc->block_readers[n]--;
+  pthread_mutex_unlock(&eiger_desc->block_lock);
+}
+
+int locate_eiger_frame(const struct ds_desc_t *desc, const int n, int *block,
+                       hsize_t *frame_idx) {
+  int retval = 0;
+  int lo, hi;
+  const struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
+
+  if (n < 0 || n >= desc->dims[0]) {
+    char message[64];
+    sprintf(message, "Selected frame %d is out of range valid range [0, %d]", n,
+            (int)desc->dims[0] - 1);
+    ERROR_JUMP(-1, done, message);
+  }
+
+  /* determine the relevant data block - Eiger data files normally hold the
+   * same number of frames, apart from the last */
+  if (eiger_desc->uniform_block_size > 0) {
+    *block = n / eiger_desc->uniform_block_size;
+    if (*block >= eiger_desc->n_data_blocks)
+      *block = eiger_desc->n_data_blocks - 1;
+  } else {
+    /* last block starting at or before n */
+    lo = 0;
+    hi = eiger_desc->n_data_blocks - 1;
+    while (lo < hi) {
+      int mid = hi - (hi - lo) / 2;
+      if (eiger_desc->block_starts[mid] <= n)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    *block = lo;
+  }
+  /* index in current block */
+  if (acquire_eiger_block(desc, *block) < 0) {
+    char message[64];
+    sprintf(message, "Unable to read frame %d", n);
+    ERROR_JUMP(-1, done, message);
+  }
+  frame_idx[0] = n - eiger_desc->block_starts[*block] +
+                 eiger_desc->blocks[*block].first_frame;
+  frame_idx[1] = 0;
+  frame_idx[2] = 0;
+done:
+  return retval;
+}
+
+int get_dectris_eiger_frame(const struct ds_desc_t *desc, int n, void *buffer) {
+
+  int retval = 0;
+  int block;
+  struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
+  hsize_t frame_idx[3] = {0, 0, 0};
+  hsize_t frame_size[3] = {1, desc->dims[1], desc->dims[2]};
+
+  if (locate_eiger_frame(desc, n, &block, frame_idx) < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+  retval = eiger_desc->frame_func(desc, &eiger_desc->blocks[block], frame_idx,
+                                  frame_size, buffer);
+  release_eiger_block(desc, block);
+  if (retval < 0) {
+    ERROR_JUMP(retval, done, "");
+  }
+done:
+  return retval;
+}
+
+int get_opt_eiger_frame_int(const struct ds_desc_t *desc, int n, int *buffer,
+                            const struct pixel_mask_t *mask,
+                            const struct pixel_region_t *region) {
+
+  int retval = 0;
+  int block;
+  struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
+  struct opt_eiger_ds_desc_t *o_eiger_desc = (struct opt_eiger_ds_desc_t *)desc;
+  hsize_t frame_idx[3] = {0, 0, 0};
+  hsize_t frame_size[3] = {1, desc->dims[1], desc->dims[2]};
+
+  if (locate_eiger_frame(desc, n, &block, frame_idx) < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+  if (o_eiger_desc->chunk_cache) {
+    retval = get_frame_from_cached_chunk_int(desc, &eiger_desc->blocks[block],
+                                             frame_idx, frame_size, buffer,
+                                             mask, region);
+  } else if (o_eiger_desc->base.frame_func == &get_frame_from_tiles) {
+    retval = read_tiles(desc, &eiger_desc->blocks[block], frame_idx, NULL,
+                        buffer, mask, region);
+  } else {
+    retval = get_frame_from_chunk_int(desc, &eiger_desc->blocks[block],
+                                      frame_idx, frame_size, buffer, mask,
+                                      region);
+  }
+  release_eiger_block(desc, block);
+  if (retval < 0) {
+    ERROR_JUMP(retval, done, "");
+  }
+done:
+  return retval;
+}
+
+/* total number of frames recorded in the master file by an Eiger detector,
+ * or -1 if not recorded (not an error) */
+long long get_eiger_frame_total(const struct ds_desc_t *desc) {
+  const char *names[2] = {"detectorSpecific/nimages",
+                          "detectorSpecific/ntrigger"};
+  long long values[2] = {0};
+  int n;
+  if (H5Lexists(desc->det_g_id, "detectorSpecific", H5P_DEFAULT) <= 0)
+    return -1;
+  for (n = 0; n < 2; n++) {
+    hid_t ds_id;
+    herr_t err;
+    if (H5Lexists(desc->det_g_id, names[n], H5P_DEFAULT) <= 0)
+      return -1;
+    ds_id = H5Dopen2(desc->det_g_id, names[n], H5P_DEFAULT);
+    if (ds_id < 0)
+      return -1;
+    err = H5Dread(ds_id, H5T_NATIVE_LLONG, H5S_ALL, H5S_ALL, H5P_DEFAULT,
+                  &values[n]);
+    H5Dclose(ds_id);
+    if (err < 0 || values[n] < 1)
+      return -1;
+  }
+  return values[0] * values[1];
+}
+
+/* the file holding the target of external link name in g_id, resolved
+ * against the directory of the master file as HDF5 does by default, or
+ * NULL if it is not an external link */
+char *get_external_link_file(hid_t g_id, const char *name,
+                             const char *master_path) {
+  H5L_info_t info;
+  char *value = NULL;
+  char *path = NULL;
+  const char *file_name, *object_name, *slash;
+  unsigned flags;
+
+  if (H5Lget_info(g_id, name, &info, H5P_DEFAULT) < 0 ||
+      info.type != H5L_TYPE_EXTERNAL)
+    goto done;
+  value = malloc(info.u.val_size);
+  if (!value ||
+      H5Lget_val(g_id, name, value, info.u.val_size, H5P_DEFAULT) < 0 ||
+      H5Lunpack_elink_val(value, info.u.val_size, &flags, &file_name,
+                          &object_name) < 0)
+    goto done;
+  path = malloc(strlen(master_path) + strlen(file_name) + 2);
+  if (!path)
+    goto done;
+  slash = strrchr(master_path, '/');
+  if (file_name[0] == '/' || !slash) {
+    strcpy(path, file_name);
+  } else {
+    memcpy(path, master_path, slash - master_path + 1);
+    strcpy(path + (slash - master_path) + 1, file_name);
+  }
+done:
+  free(value);
+  return path;
+}
+
+/* name of the file holding g_id, as it was opened */
+char *get_master_path(hid_t g_id) {
+  char *path;
+  ssize_t name_len = H5Fget_name(g_id, NULL, 0);
+  if (name_len <= 0)
+    return NULL;
+  path = malloc(name_len + 1);
+  if (path)
+    H5Fget_name(g_id, path, name_len + 1);
+  return path;
+}
+
+/* the number of data_%06d links in g_id, counting up from data_000001 */
+int count_data_blocks(hid_t g_id) {
+  char ds_name[16] = {0}; /* 12 chars in "data_xxxxxx\0" */
+  int n = 0;
+  sprintf(ds_name, "data_%06d", n + 1);
+  while (H5Lexists(g_id, ds_name, H5P_DEFAULT) > 0) {
+    sprintf(ds_name, "data_%06d", ++n + 1);
+  }
+  return n;
+}
+
+/* the shape of one data_%06d dataset as sent by a worker process, with
+ * data_width 0 if it could not be read. Smaller than PIPE_BUF, so each is
+ * written whole and the workers can share a pipe */
+struct block_shape_t {
+  int n;
+  int data_width;
+  unsigned long long dims[3];
+};
+
+/* in a worker process, send the shape of every n_workers'th data block from
+ * first down fd */
+static void send_block_shapes(hid_t g_id, int n_datas, int first,
+                              int n_workers, int fd) {
+  int n;
+  for (n = first; n < n_datas; n += n_workers) {
+    struct block_shape_t shape = {n, 0, {0}};
+    struct data_block_t block;
+    hsize_t dims[3] = {0};
+    char ds_name[32];
+    sprintf(ds_name, "data_%06d", n + 1);
+    if (open_data_block(g_id, ds_name, &block) == 0) {
+      if (H5Sget_simple_extent_dims(block.s_id, dims, NULL) == 3) {
+        shape.data_width = H5Tget_size(block.t_id);
+        shape.dims[0] = dims[0];
+        shape.dims[1] = dims[1];
+        shape.dims[2] = dims[2];
+      }
+      close_data_block(&block);
+    }
+    if (write(fd, &shape, sizeof(shape)) != sizeof(shape))
+      return;
+  }
+}
+
+/* read the shapes of the n_datas data blocks in n_workers forked processes.
+ * Each has its own copy of the HDF5 library, so the data files are opened
+ * side by side rather than one at a time behind the library lock. shapes[n]
+ * is filled as block n arrives, in any order, and blocks which could not be
+ * read are left with data_width 0. Returns the number of blocks read */
+static int read_block_shapes(hid_t g_id, int n_datas, int n_workers,
+                             struct block_shape_t *shapes) {
+  struct block_shape_t shape;
+  pid_t *pids = malloc(n_workers * sizeof(*pids));
+  int fds[2];
+  int w, n_started = 0, n_read = 0;
+
+  if (!pids || pipe(fds) < 0) {
+    free(pids);
+    return 0;
+  }
+  /* nothing buffered in this process may be written again by a worker */
+  fflush(NULL);
+  for (w = 0; w < n_workers; w++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      send_block_shapes(g_id, n_datas, w, n_workers, fds[1]);
+      _exit(0);
+    }
+    if (pid < 0)
+      break;
+    pids[n_started++] = pid;
+  }
+  close(fds[1]);
+
+  /* the pipe ends once every worker has exited */
+  for (;;) {
+    struct pollfd pfd = {fds[0], POLLIN, 0};
+    int ready = poll(&pfd, 1, OPEN_TIMEOUT_MS);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0 || read(fds[0], &shape, sizeof(shape)) != sizeof(shape))
+      break;
+    if (shape.n >= 0 && shape.n < n_datas && shape.data_width > 0 &&
+        shapes[shape.n].data_width == 0) {
+      shapes[shape.n] = shape;
+      n_read++;
+    }
+  }
+  close(fds[0]);
+  for (w = 0; w < n_started; w++) {
+    /* a worker still waiting on a file after the timeout is abandoned */
+    kill(pids[w], SIGKILL);
+    while (waitpid(pids[w], NULL, 0) < 0 && errno == EINTR)
+      ;
+  }
+  free(pids);
+  return n_read;
+}
+
+int get_dectris_eiger_dataset_dims(struct ds_desc_t *desc) {
+  int retval = 0;
+  int n_datas = 0;
+  int n = 0;
+  int data_width = 0;
+  char ds_name[16] = {0}; /* 12 chars in "data_xxxxxx\0" */
+  int *frame_counts = NULL;
+  int *frame_starts = NULL;
+  int uniform_size;
+  int lazy = 0;
+  int n_open = 0;
+  long max_open = get_env_long("DURIN_MAX_OPEN_FILES", DEFAULT_MAX_OPEN_FILES);
+  long n_workers = get_env_long("DURIN_OPEN_PROCESSES", DEFAULT_OPEN_PROCESSES);
+  long long n_expected;
+  struct block_shape_t *shapes = NULL;
+  struct data_block_t *blocks = NULL;
+  hsize_t dims[3] = {0};
+  struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
+  const struct data_index_t *index = eiger_desc->index;
+
+  /* datasets are "data_%06d % n" - need to determine how many of these there
+   * are and what the ranges are */
+  n_datas = count_data_blocks(desc->data_g_id);
+
+  frame_counts = malloc(n_datas * sizeof(*frame_counts));
+  frame_starts = malloc((n_datas + 1) * sizeof(*frame_starts));
+  blocks = malloc(n_datas * sizeof(*blocks));
+  eiger_desc->block_readers = calloc(n_datas, sizeof(int));
+  eiger_desc->block_last_use = calloc(n_datas, sizeof(unsigned long));
+  if (!frame_counts || !frame_starts || !blocks ||
+      !eiger_desc->block_readers || !eiger_desc->block_last_use) {
+    ERROR_JUMP(-1, done, "Unable to allocate data block descriptions");
+  }
+  for (n = 0; n < n_datas; n++) {
+    init_data_block(&blocks[n]);
+  }
+  if (max_open < 1)
+    max_open = 1;
+
+  /* Eiger data files hold the same number of frames apart from the last, so
+   * if the first and last agree with the total in the master file the others
+   * are left to be opened when first read, rather than opening every file */
+  n_expected = !index && n_datas > 2 ? get_eiger_frame_total(desc) : -1;
+  if (n_expected > 0) {
+    hsize_t first_dims[3] = {0}, last_dims[3] = {0};
+    sprintf(ds_name, "data_%06d", n_datas);
+    if (open_data_block(desc->data_g_id, "data_000001", &blocks[0]) < 0 ||
+        open_data_block(desc->data_g_id, ds_name, &blocks[n_datas - 1]) < 0 ||
+        H5Sget_simple_extent_dims(blocks[0].s_id, first_dims, NULL) < 0 ||
+        H5Sget_simple_extent_dims(blocks[n_datas - 1].s_id, last_dims, NULL) <
+            0) {
+      ERROR_JUMP(-1, done, "");
+    }
+    lazy = last_dims[0] <= first_dims[0] &&
+           n_expected == (n_datas - 1) * first_dims[0] + last_dims[0];
+  }
+
+  /* otherwise every data file must be opened for its frame count, which
+   * worker processes do in parallel. The blocks they read are opened again
+   * here only when first read */
+  if (n_workers > n_datas / OPEN_MIN_FILES_PER_PROCESS)
+    n_workers = n_datas / OPEN_MIN_FILES_PER_PROCESS;
+  if (!index && !lazy && n_workers > 1) {
+    shapes = calloc(n_datas, sizeof(*shapes));
+    if (shapes)
+      read_block_shapes(desc->data_g_id, n_datas, n_workers, shapes);
+  }
+
+  for (n = 0; n < n_datas; n++) {
+    hsize_t block_dims[3] = {0};
+    sprintf(ds_name, "data_%06d", n + 1);
+    /* an index gives the frame counts of every block */
+    if (index || (lazy && n > 0 && n < n_datas - 1)) {
+      sprintf(blocks[n].name, "%.15s", ds_name);
+      frame_starts[n] = dims[0];
+      frame_counts[n] = index ? index->blocks[n].n_frames : frame_counts[0];
+      dims[0] += frame_counts[n];
+      continue;
+    }
+    if (shapes && shapes[n].data_width > 0 && blocks[n].ds_id <= 0) {
+      sprintf(blocks[n].name, "%.15s", ds_name);
+      data_width = shapes[n].data_width;
+      dims[1] = shapes[n].dims[1];
+      dims[2] = shapes[n].dims[2];
+      frame_starts[n] = dims[0];
+      frame_counts[n] = shapes[n].dims[0];
+      dims[0] += frame_counts[n];
+      continue;
+    }
+    if (blocks[n].ds_id <= 0 &&
+        open_data_block(desc->data_g_id, ds_name, &blocks[n]) < 0) {
+      ERROR_JUMP(-1, done, "");
+    }
+
+    data_width = H5Tget_size(blocks[n].t_id);
+    if (H5Sget_simple_extent_dims(blocks[n].s_id, block_dims, NULL) < 0) {
+      ERROR_JUMP(-1, done, "Unable to read dataset dimensions");
+    }
+
+    dims[1] = block_dims[1];
+    dims[2] = block_dims[2];
+
+    frame_starts[n] = dims[0];
+    dims[0] += block_dims[0];
+    frame_counts[n] = block_dims[0];
+
+    /* blocks beyond the open file limit are opened again when read */
+    if (n_open < max_open)
+      n_open++;
+    else
+      close_data_block(&blocks[n]);
+  }
+  frame_starts[n_datas] = dims[0];
+  if (index) {
+    dims[1] = index->header->dims[1];
+    dims[2] = index->header->dims[2];
+    data_width = index->header->data_width;
+  }
+
+  uniform_size = n_datas > 0 ? frame_counts[0] : 0;
+  for (n = 1; n < n_datas - 1; n++) {
+    if (frame_counts[n] != uniform_size) {
+      uniform_size = 0;
+      break;
+    }
+  }
+  /* a larger last block cannot be reached by division */
+  if (n_datas > 1 && frame_counts[n_datas - 1] > uniform_size)
+    uniform_size = 0;
+
+done:
+  free(shapes);
+  if (retval < 0) {
+    if (blocks) {
+      for (n = 0; n < n_datas; n++) {
+        close_data_block(&blocks[n]);
+      }
+    }
+    free(blocks);
+    free(frame_counts);
+    free(frame_starts);
+    free(eiger_desc->block_readers);
+    free(eiger_desc->block_last_use);
+    eiger_desc->block_readers = NULL;
+    eiger_desc->block_last_use = NULL;
+  } else {
+    memcpy(desc->dims, dims, 3 * sizeof(*dims));
+    desc->data_width = data_width;
+    eiger_desc->n_data_blocks = n_datas;
+    eiger_desc->block_sizes = frame_counts;
+    eiger_desc->block_starts = frame_starts;
+    eiger_desc->uniform_block_size = uniform_size;
+    eiger_desc->blocks = blocks;
+    eiger_desc->pooled_blocks = 1;
+    eiger_desc->max_open_blocks = max_open;
+    eiger_desc->n_open_blocks = n_open;
+    pthread_mutex_init(&eiger_desc->block_lock, NULL);
+  }
+  return retval;
+}
+
+int read_pixel_info(hid_t g_id, const char *path, double *size) {
+  /*
+   * NXdetector allows pixel size to be an array (for varied pixel size),
    * however XDS only allows for a single value.
    * TODO: handle array case (return first value maybe?)
    */
@@ -578,19 +1485,31 @@ int get_null_pixel_mask(const struct ds_desc_t *desc, int *buffer) {
   return 0;
 }
 
-herr_t det_visit_callback(hid_t root_id, const char *name,
-                          const H5O_info_t *info, void *op_data) {
-  struct det_visit_objects_t *output_data = op_data;
+int get_indexed_pixel_mask(const struct ds_desc_t *desc, int *buffer) {
+  int retval = 0;
+  const struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
+  if (read_index_mask(eiger_desc->index, buffer,
+                      desc->dims[1] * desc->dims[2]) < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+done:
+  return retval;
+}
+
+/* keep the group at name if it is the first NXdata or NXdetector found */
+int check_nx_class(hid_t root_id, const char *name,
+                   struct det_visit_objects_t *output_data) {
   hid_t g_id;
-  herr_t retval = 0;
-  if (info->type != H5O_TYPE_GROUP)
-    return 0;
+  int retval = 0;
   g_id = H5Oopen(root_id, name, H5P_DEFAULT);
   if (g_id < 0) {
     char message[256];
     sprintf(message, "H5OVisit callback: Unable to open group %.128s", name);
     ERROR_JUMP(-1, done, message);
   }
+  if (H5Iget_type(g_id) != H5I_GROUP) {
+    goto close_group;
+  }
 
   /* check for an "NX_class" attribute */
   {
@@ -661,10 +1580,11 @@ herr_t det_visit_callback(hid_t root_id, const char *name,
     /* test for NXdata or NXdetector */
     {
       char *nxclass = str_size > 0 ? (char *)buffer : *((char **)buffer);
-      if (strcmp("NXdata", nxclass) == 0) {
+      if (strcmp("NXdata", nxclass) == 0 && !output_data->nxdata) {
         hid_t out_id = H5Gopen(root_id, name, H5P_DEFAULT);
         output_data->nxdata = out_id;
-      } else if (strcmp("NXdetector", nxclass) == 0) {
+      } else if (strcmp("NXdetector", nxclass) == 0 &&
+                 !output_data->nxdetector) {
         hid_t out_id = H5Gopen(root_id, name, H5P_DEFAULT);
         output_data->nxdetector = out_id;
       }
@@ -689,7 +1609,7 @@ herr_t det_visit_callback(hid_t root_id, const char *name,
   }
 
 close_group:
-  if (H5Gclose(g_id) < 0) {
+  if (H5Oclose(g_id) < 0) {
     /* TODO: error trace */
     retval = -1;
   }
@@ -697,17 +1617,52 @@ done:
   return retval;
 }
 
+herr_t det_visit_callback(hid_t root_id, const char *name,
+                          const H5O_info_t *info, void *op_data) {
+  struct det_visit_objects_t *output_data = op_data;
+  if (info->type != H5O_TYPE_GROUP)
+    return 0;
+  if (check_nx_class(root_id, name, output_data) < 0)
+    return -1;
+  /* a positive value stops the traversal */
+  return output_data->nxdata && output_data->nxdetector;
+}
+
+/* check the groups where Eiger and NeXus files normally keep the data and
+ * detector, which usually saves visiting every object in the file */
+int probe_standard_locations(hid_t fid,
+                             struct det_visit_objects_t *output_data) {
+  int retval = 0;
+  if (H5Lexists(fid, "entry", H5P_DEFAULT) <= 0 ||
+      H5Oexists_by_name(fid, "entry", H5P_DEFAULT) <= 0)
+    goto done;
+  if (H5Lexists(fid, "entry/data", H5P_DEFAULT) > 0 &&
+      H5Oexists_by_name(fid, "entry/data", H5P_DEFAULT) > 0) {
+    if (check_nx_class(fid, "entry/data", output_data) < 0) {
+      ERROR_JUMP(-1, done, "");
+    }
+  }
+  if (H5Lexists(fid, "entry/instrument", H5P_DEFAULT) > 0 &&
+      H5Lexists(fid, "entry/instrument/detector", H5P_DEFAULT) > 0 &&
+      H5Oexists_by_name(fid, "entry/instrument/detector", H5P_DEFAULT) > 0) {
+    if (check_nx_class(fid, "entry/instrument/detector", output_data) < 0) {
+      ERROR_JUMP(-1, done, "");
+    }
+  }
+done:
+  return retval;
+}
+
 int check_for_chunk_read(hid_t g_id, const char *ds_name,
                          struct opt_eiger_ds_desc_t *desc) {
 
   int retval = 0;
-  int n_filters;
+  int n, n_filters;
   hsize_t cdims[3];
   hid_t ds_id, dcpl, s_id;
   unsigned int filter_flags, filter_config;
   char filter_name[16];
   size_t name_len = 16;
-  size_t cd_nelems = BS_H5_N_PARAMS;
   hsize_t dims[3];
   H5Z_filter_t filter;
 
@@ -744,45 +1699,58 @@ int check_for_chunk_read(hid_t g_id, const char *ds_name,
     ERROR_JUMP(-1, done, "Error getting dataset creation property list");
   }
 
-  /* check the chunk layout matches the layout we expect of
-   * [1, frame_size_y, frame_size_x] (1 frame == 1 chunk) */
+  /* check the chunk layout matches the layouts we expect of
+   * [n, frame_size_y, frame_size_x] (whole frames in each chunk) or
+   * [1, tile_size_y, tile_size_x] (tiles of a single frame) */
   int cndims = H5Pget_chunk(dcpl, 3, cdims);
   if (cndims != 3) {
     goto done;
   }
-  if (cdims[0] != 1 || cdims[1] != dims[1] || cdims[2] != dims[2]) {
+  if (cdims[0] < 1 || cdims[1] > dims[1] || cdims[2] > dims[2]) {
+    goto done;
+  }
+  if (cdims[0] > 1 && (cdims[1] != dims[1] || cdims[2] != dims[2])) {
     goto done;
   }
 
-  /* check for potential filters - only the bitshuffle filter is supported */
+  /* check for potential filters - only filters the plugin can decode itself
+   * are supported */
   n_filters = H5Pget_nfilters(dcpl);
   if (n_filters < 0) {
     ERROR_JUMP(-1, done, "Error retrieving number of filters on dataset");
-  } else if (n_filters > 1) {
+  } else if (n_filters > CHUNK_MAX_FILTERS) {
     goto done;
   }
 
-  if (n_filters == 1) {
-    filter = H5Pget_filter2(dcpl, 0, &filter_flags, &cd_nelems, desc->bs_params,
-                            name_len, filter_name, &filter_config);
+  memset(&desc->pipeline, 0, sizeof(desc->pipeline));
+  for (n = 0; n < n_filters; n++) {
+    struct chunk_filter_t *c_filter = &desc->pipeline.filters[n];
+    size_t cd_nelems = CHUNK_MAX_FILTER_PARAMS;
+    filter = H5Pget_filter2(dcpl, n, &filter_flags, &cd_nelems,
+                            c_filter->params, name_len, filter_name,
+                            &filter_config);
     if (filter < 0) {
       ERROR_JUMP(-1, done, "Error retrieving filter information");
     }
-    if (filter != BS_H5_FILTER_ID) {
-      goto done;
-    }
-    if (cd_nelems > BS_H5_N_PARAMS) {
+    if (cd_nelems > CHUNK_MAX_FILTER_PARAMS ||
+        (filter == BS_H5_FILTER_ID && cd_nelems > BS_H5_MAX_PARAMS)) {
       char message[128];
       sprintf(message,
-              "More than expected number of parameters to bitshuffle filter - "
-              "expected %d, was %lu",
-              BS_H5_N_PARAMS, cd_nelems);
+              "More than expected number of parameters to filter %d - "
+              "was %lu",
+              (int)filter, cd_nelems);
       ERROR_JUMP(-1, done, message);
     }
-    desc->bs_applied = 1;
-  } else {
-    desc->bs_applied = 0;
+    c_filter->id = filter;
+    c_filter->n_params = cd_nelems;
+    if (!is_supported_filter(c_filter)) {
+      goto done;
+    }
   }
+  desc->pipeline.n_filters = n_filters;
+  desc->frames_per_chunk = cdims[0];
+  desc->tile_size[0] = cdims[1];
+  desc->tile_size[1] = cdims[2];
 
   retval = 1;
 
@@ -796,11 +1764,668 @@ done:
   return retval;
 }
 
-int create_dataset_descriptor(struct ds_desc_t **desc,
-                              struct det_visit_objects_t *visit_result) {
+int is_virtual_dataset(hid_t g_id, const char *ds_name) {
   int retval = 0;
-  hid_t g_id, ds_id;
-  int (*pxl_func)(const struct ds_desc_t *, double *, double *);
+  hid_t ds_id = 0, dcpl = 0;
+
+  ds_id = H5Dopen2(g_id, ds_name, H5P_DEFAULT);
+  if (ds_id < 0) {
+    char message[64];
+    sprintf(message, "Error opening dataset %.32s", ds_name);
+    ERROR_JUMP(-1, done, message);
+  }
+  dcpl = H5Dget_create_plist(ds_id);
+  if (dcpl < 0) {
+    ERROR_JUMP(-1, done, "Error getting dataset creation property list");
+  }
+  retval = H5Pget_layout(dcpl) == H5D_VIRTUAL;
+
+done:
+  if (dcpl > 0)
+    H5Pclose(dcpl);
+  if (ds_id > 0)
+    H5Dclose(ds_id);
+  return retval;
+}
+
+int get_frame_range(hid_t s_id, const hsize_t *dims, hsize_t *first,
+                    hsize_t *count) {
+  /* a selection qualifies if it is whole frames [first, first + count) */
+  int retval = 0;
+  hsize_t start[3], end[3], extent[3];
+  hssize_t n_points;
+
+  if (H5Sget_simple_extent_ndims(s_id) != 3 ||
+      H5Sget_simple_extent_dims(s_id, extent, NULL) < 0 ||
+      H5Sget_select_bounds(s_id, start, end) < 0) {
+    ERROR_JUMP(-1, done, "Virtual dataset mapping is not a 3D selection");
+  }
+  n_points = H5Sget_select_npoints(s_id);
+  if (extent[1] != dims[1] || extent[2] != dims[2] || start[1] != 0 ||
+      start[2] != 0 || end[1] + 1 != dims[1] || end[2] + 1 != dims[2] ||
+      n_points != (hssize_t)((end[0] - start[0] + 1) * dims[1] * dims[2])) {
+    ERROR_JUMP(-1, done, "Virtual dataset mapping is not whole frames");
+  }
+  *first = start[0];
+  *count = end[0] - start[0] + 1;
+
+done:
+  return retval;
+}
+
+int get_source_frames(hid_t dcpl, size_t map, struct data_block_t *block,
+                      const hsize_t *dims, hsize_t *count) {
+  /* the frames of an open source dataset selected by a mapping */
+  int retval = 0;
+  hid_t src_space = 0;
+  hsize_t src_dims[3];
+
+  if (H5Sget_simple_extent_dims(block->s_id, src_dims, NULL) < 0) {
+    ERROR_JUMP(-1, done, "Error getting source dataset dimensions");
+  }
+  if (src_dims[1] != dims[1] || src_dims[2] != dims[2]) {
+    ERROR_JUMP(-1, done, "Source frame size differs from the virtual dataset");
+  }
+
+  src_space = H5Pget_virtual_srcspace(dcpl, map);
+  if (src_space < 0) {
+    ERROR_JUMP(-1, done, "Error reading virtual dataset mapping");
+  }
+  /* the extent of an H5S_ALL source is not known until the source is read */
+  if (H5Sget_select_type(src_space) == H5S_SEL_ALL) {
+    block->first_frame = 0;
+    *count = src_dims[0];
+  } else if (get_frame_range(src_space, src_dims, &block->first_frame, count) <
+             0) {
+    ERROR_JUMP(-1, done, "");
+  }
+
+done:
+  if (src_space > 0)
+    H5Sclose(src_space);
+  return retval;
+}
+
+hid_t open_vds_source_file(hid_t ds_id, const char *file_name) {
+  /* relative source file names are resolved against the directory of the
+   * file holding the virtual dataset, as HDF5 does by default */
+  int retval = 0;
+  hid_t f_id = 0;
+  hid_t src_f_id = -1;
+  ssize_t name_len;
+  char *path = NULL;
+  const char *slash;
+
+  f_id = H5Iget_file_id(ds_id);
+  if (f_id < 0) {
+    ERROR_JUMP(-1, done, "Error retrieving file containing dataset");
+  }
+  if (strcmp(file_name, ".") == 0) {
+    src_f_id = f_id;
+    f_id = 0;
+    goto done;
+  }
+
+  name_len = H5Fget_name(f_id, NULL, 0);
+  if (name_len <= 0) {
+    ERROR_JUMP(-1, done, "Error retrieving file name");
+  }
+  path = malloc(name_len + strlen(file_name) + 2);
+  if (!path) {
+    ERROR_JUMP(-1, done, "Unable to allocate file name buffer");
+  }
+  H5Fget_name(f_id, path, name_len + 1);
+  slash = strrchr(path, '/');
+  if (file_name[0] == '/' || !slash) {
+    strcpy(path, file_name);
+  } else {
+    strcpy(path + (slash - path) + 1, file_name);
+  }
+
+  src_f_id = H5Fopen(path, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (src_f_id < 0) {
+    char message[256];
+    sprintf(message, "Unable to open virtual dataset source %.200s", path);
+    ERROR_JUMP(-1, done, message);
+  }
+
+done:
+  free(path);
+  if (f_id > 0)
+    H5Fclose(f_id);
+  return retval < 0 ? -1 : src_f_id;
+}
+
+int get_vds_dataset_dims(struct ds_desc_t *desc) {
+  /* Map a virtual dataset made of whole frames from each source dataset onto
+   * data blocks, one per source, so frames are read from the source chunks
+   * exactly as for an Eiger master file with data_%06d links */
+  int retval = 0;
+  int n, m, n_maps = 0;
+  size_t count = 0;
+  hid_t ds_id = 0, s_id = 0, t_id = 0, dcpl = 0;
+  hsize_t dims[3] = {0};
+  hsize_t *v_first = NULL;
+  int *order = NULL;
+  int *frame_counts = NULL;
+  int *frame_starts = NULL;
+  int uniform_size;
+  struct filter_pipeline_t pipeline;
+  hsize_t frames_per_chunk = 0, tile_size[2] = {0};
+  struct data_block_t *blocks = NULL;
+  struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
+  struct opt_eiger_ds_desc_t *o_eiger_desc = (struct opt_eiger_ds_desc_t *)desc;
+
+  ds_id = H5Dopen2(desc->data_g_id, "data", H5P_DEFAULT);
+  if (ds_id < 0) {
+    ERROR_JUMP(-1, done, "Unable to open 'data' dataset");
+  }
+  s_id = H5Dget_space(ds_id);
+  t_id = H5Dget_type(ds_id);
+  dcpl = H5Dget_create_plist(ds_id);
+  if (s_id < 0 || t_id < 0 || dcpl < 0) {
+    ERROR_JUMP(-1, done, "Error reading virtual dataset properties");
+  }
+  if (H5Sget_simple_extent_ndims(s_id) != 3 ||
+      H5Sget_simple_extent_dims(s_id, dims, NULL) < 0) {
+    ERROR_JUMP(-1, done, "Virtual dataset is not 3 dimensional");
+  }
+  if (H5Pget_virtual_count(dcpl, &count) < 0 || count == 0) {
+    ERROR_JUMP(-1, done, "Error reading virtual dataset mappings");
+  }
+  n_maps = count;
+
+  v_first = malloc(n_maps * sizeof(*v_first));
+  order = calloc(n_maps, sizeof(*order));
+  frame_counts = malloc(n_maps * sizeof(*frame_counts));
+  frame_starts = malloc((n_maps + 1) * sizeof(*frame_starts));
+  blocks = malloc(n_maps * sizeof(*blocks));
+  if (!v_first || !order || !frame_counts || !frame_starts || !blocks) {
+    ERROR_JUMP(-1, done, "Unable to allocate data block descriptions");
+  }
+  for (n = 0; n < n_maps; n++) {
+    init_data_block(&blocks[n]);
+  }
+
+  /* order the mappings by their first frame in the virtual dataset */
+  for (n = 0; n < n_maps; n++) {
+    hsize_t v_count;
+    hid_t v_space = H5Pget_virtual_vspace(dcpl, n);
+    if (v_space < 0) {
+      ERROR_JUMP(-1, done, "Error reading virtual dataset mapping");
+    }
+    retval = get_frame_range(v_space, dims, &v_first[n], &v_count);
+    H5Sclose(v_space);
+    if (retval < 0) {
+      ERROR_JUMP(-1, done, "");
+    }
+    frame_counts[n] = v_count;
+    for (m = n; m > 0 && v_first[order[m - 1]] > v_first[n]; m--)
+      order[m] = order[m - 1];
+    order[m] = n;
+  }
+
+  /* each frame of the virtual dataset must come from exactly one source */
+  frame_starts[0] = 0;
+  for (n = 0; n < n_maps; n++) {
+    if (v_first[order[n]] != (hsize_t)frame_starts[n]) {
+      ERROR_JUMP(-1, done, "Virtual dataset mappings are not contiguous");
+    }
+    frame_starts[n + 1] = frame_starts[n] + frame_counts[order[n]];
+  }
+  if ((hsize_t)frame_starts[n_maps] != dims[0]) {
+    ERROR_JUMP(-1, done, "Virtual dataset mappings do not cover every frame");
+  }
+
+  for (n = 0; n < n_maps; n++) {
+    int map = order[n];
+    hid_t src_f_id = 0;
+    hsize_t src_count = 0;
+    char *file_name = NULL, *dset_name = NULL;
+    ssize_t file_len = H5Pget_virtual_filename(dcpl, map, NULL, 0);
+    ssize_t dset_len = H5Pget_virtual_dsetname(dcpl, map, NULL, 0);
+
+    if (file_len > 0 && dset_len > 0) {
+      file_name = malloc(file_len + 1);
+      dset_name = malloc(dset_len + 1);
+    }
+    if (!file_name || !dset_name) {
+      free(file_name);
+      free(dset_name);
+      ERROR_JUMP(-1, done, "Error reading virtual dataset source names");
+    }
+    H5Pget_virtual_filename(dcpl, map, file_name, file_len + 1);
+    H5Pget_virtual_dsetname(dcpl, map, dset_name, dset_len + 1);
+
+    src_f_id = open_vds_source_file(ds_id, file_name);
+    retval = src_f_id < 0 ? -1 : 0;
+    if (retval == 0)
+      retval = open_data_block(src_f_id, dset_name, &blocks[n]);
+    if (retval == 0)
+      retval = get_source_frames(dcpl, map, &blocks[n], dims, &src_count);
+    if (retval == 0 && src_count != (hsize_t)frame_counts[map]) {
+      retval = -1;
+      push_error_stack(__file__, __func__, __line__, retval,
+                       "Source and virtual frame counts differ");
+    }
+    if (retval == 0 && H5Tequal(blocks[n].t_id, t_id) <= 0) {
+      retval = -1;
+      push_error_stack(__file__, __func__, __line__, retval,
+                       "Source data type differs from the virtual dataset");
+    }
+    /* name the block after its file for messages */
+    sprintf(blocks[n].name, "%.15s",
+            strrchr(file_name, '/') ? strrchr(file_name, '/') + 1 : file_name);
+
+    /* the file stays open until the dataset is closed. Every source must
+     * be chunked and filtered as the first, as one layout is kept for all */
+    if (retval == 0 &&
+        check_for_chunk_read(src_f_id, dset_name, o_eiger_desc) != 1) {
+      retval = -1;
+      push_error_stack(__file__, __func__, __line__, retval,
+                       "Virtual dataset source chunks do not hold whole "
+                       "frames or tiles with filters durin can decode");
+    }
+    if (retval == 0 && n == 0) {
+      pipeline = o_eiger_desc->pipeline;
+      frames_per_chunk = o_eiger_desc->frames_per_chunk;
+      tile_size[0] = o_eiger_desc->tile_size[0];
+      tile_size[1] = o_eiger_desc->tile_size[1];
+    } else if (retval == 0 &&
+               (!same_pipeline(&o_eiger_desc->pipeline, &pipeline) ||
+                o_eiger_desc->frames_per_chunk != frames_per_chunk ||
+                o_eiger_desc->tile_size[0] != tile_size[0] ||
+                o_eiger_desc->tile_size[1] != tile_size[1])) {
+      retval = -1;
+      push_error_stack(__file__, __func__, __line__, retval,
+                       "Virtual dataset source is not chunked or filtered "
+                       "the same as the first source");
+    }
+    if (src_f_id > 0)
+      H5Fclose(src_f_id);
+    if (retval < 0) {
+      char message[192];
+      sprintf(message, "Unable to use virtual dataset source %.64s:%.64s",
+              file_name, dset_name);
+      free(file_name);
+      free(dset_name);
+      ERROR_JUMP(-1, done, message);
+    }
+    free(file_name);
+    free(dset_name);
+  }
+
+  uniform_size = frame_counts[order[0]];
+  for (n = 1; n < n_maps - 1; n++) {
+    if (frame_counts[order[n]] != uniform_size) {
+      uniform_size = 0;
+      break;
+    }
+  }
+  if (n_maps > 1 && frame_counts[order[n_maps - 1]] > uniform_size)
+    uniform_size = 0;
+  for (n = 0; n < n_maps; n++) {
+    frame_counts[n] = frame_starts[n + 1] - frame_starts[n];
+  }
+
+done:
+  if (retval < 0) {
+    if (blocks) {
+      for (n = 0; n < n_maps; n++) {
+        close_data_block(&blocks[n]);
+      }
+    }
+    free(blocks);
+    free(frame_counts);
+    free(frame_starts);
+  } else {
+    memcpy(desc->dims, dims, 3 * sizeof(*dims));
+    desc->data_width = H5Tget_size(t_id);
+    eiger_desc->n_data_blocks = n_maps;
+    eiger_desc->block_sizes = frame_counts;
+    eiger_desc->block_starts = frame_starts;
+    eiger_desc->uniform_block_size = uniform_size;
+    eiger_desc->blocks = blocks;
+  }
+  free(order);
+  free(v_first);
+  if (dcpl > 0)
+    H5Pclose(dcpl);
+  if (t_id > 0)
+    H5Tclose(t_id);
+  if (s_id > 0)
+    H5Sclose(s_id);
+  if (ds_id > 0)
+    H5Dclose(ds_id);
+  return retval;
+}
+
+int use_direct_chunk_read() {
+  const char *value = getenv("DURIN_DIRECT_CHUNK_READ");
+  return value && value[0] != '\0' && strcmp(value, "0") != 0;
+}
+
+#if H5_VERSION_GE(1, 10, 5)
+/* fill the chunk table, already sized for the dataset, with the location of
+ * each chunk in the order of chunk_table_index */
+int query_chunk_table(hid_t ds_id, const char *ds_name, hsize_t userblock,
+                      struct chunk_table_t *table) {
+  int retval = 0;
+  const hsize_t *cdims = table->chunk_dims;
+  hsize_t n;
+
+  for (n = 0; n < table->n_chunks; n++) {
+    hsize_t tile = n % table->tiles_per_frame;
+    hsize_t c_offset[3] = {n / table->tiles_per_frame * cdims[0],
+                           tile / table->tile_columns * cdims[1],
+                           tile % table->tile_columns * cdims[2]};
+    haddr_t address;
+    if (H5Dget_chunk_info_by_coord(ds_id, c_offset, &table->filter_masks[n],
+                                   &address, &table->sizes[n]) < 0) {
+      char message[96];
+      sprintf(message, "Error reading chunk info for frame %llu of %.32s",
+              c_offset[0], ds_name);
+      ERROR_JUMP(-1, done, message);
+    }
+    if (address == HADDR_UNDEF) {
+      /* unallocated - reported as a zero sized chunk when read */
+      table->sizes[n] = 0;
+      address = 0;
+    }
+    table->offsets[n] = address + userblock;
+  }
+done:
+  return retval;
+}
+
+int build_chunk_table(struct data_block_t *block, const hsize_t *dims,
+                      const hsize_t *chunk_dims,
+                      const struct data_index_t *index, int index_block) {
+  /* record where each chunk of the dataset lives in its file, so frames can
+   * be read without going through the HDF5 library */
+  int retval = 0;
+  hid_t ds_id = block->ds_id;
+  hid_t f_id = 0, fcpl = 0, fapl = 0, dcpl = 0;
+  const char *ds_name = block->name;
+  struct chunk_table_t *table = &block->chunks;
+  hsize_t cdims[3];
+  hsize_t userblock = 0;
+  hsize_t n_chunks, n_rows;
+  ssize_t name_len;
+  char *file_name = NULL;
+
+  dcpl = H5Dget_create_plist(ds_id);
+  if (dcpl < 0) {
+    ERROR_JUMP(-1, done, "Error getting dataset creation property list");
+  }
+  if (H5Pget_chunk(dcpl, 3, cdims) != 3 || cdims[0] != chunk_dims[0] ||
+      cdims[1] != chunk_dims[1] || cdims[2] != chunk_dims[2]) {
+    char message[96];
+    sprintf(message, "Dataset %.32s is not chunked like the first data block",
+            ds_name);
+    ERROR_JUMP(-1, done, message);
+  }
+
+  f_id = H5Iget_file_id(ds_id);
+  if (f_id < 0) {
+    ERROR_JUMP(-1, done, "Error retrieving file containing dataset");
+  }
+  fapl = H5Fget_access_plist(f_id);
+  if (fapl < 0) {
+    ERROR_JUMP(-1, done, "Error getting file access property list");
+  }
+  if (H5Pget_driver(fapl) != H5FD_SEC2) {
+    ERROR_JUMP(-1, done, "Direct chunk reads require the sec2 file driver");
+  }
+  /* chunk addresses are relative to the end of any user block */
+  fcpl = H5Fget_create_plist(f_id);
+  if (fcpl < 0 || H5Pget_userblock(fcpl, &userblock) < 0) {
+    ERROR_JUMP(-1, done, "Error reading file user block size");
+  }
+
+  name_len = H5Fget_name(f_id, NULL, 0);
+  if (name_len <= 0) {
+    ERROR_JUMP(-1, done, "Error retrieving file name");
+  }
+  file_name = malloc(name_len + 1);
+  if (!file_name) {
+    ERROR_JUMP(-1, done, "Unable to allocate file name buffer");
+  }
+  H5Fget_name(f_id, file_name, name_len + 1);
+
+  /* a block opened again keeps the table it had */
+  if (table->offsets)
+    goto open_file;
+  n_rows = (dims[1] + cdims[1] - 1) / cdims[1];
+  table->tile_columns = (dims[2] + cdims[2] - 1) / cdims[2];
+  table->tiles_per_frame = n_rows * table->tile_columns;
+  n_chunks = (dims[0] + cdims[0] - 1) / cdims[0] * table->tiles_per_frame;
+  table->n_chunks = n_chunks;
+  memcpy(table->chunk_dims, cdims, sizeof(cdims));
+  table->offsets = malloc(n_chunks * sizeof(*table->offsets));
+  table->sizes = malloc(n_chunks * sizeof(*table->sizes));
+  table->filter_masks = malloc(n_chunks * sizeof(*table->filter_masks));
+  if (!table->offsets || !table->sizes || !table->filter_masks) {
+    ERROR_JUMP(-1, done, "Unable to allocate chunk table");
+  }
+
+  /* chunk locations from the sidecar index if it has them, otherwise from
+   * the HDF5 library */
+  if ((!index || !read_index_chunk_table(index, index_block, table)) &&
+      query_chunk_table(ds_id, ds_name, userblock, table) < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+
+open_file:
+  table->fd = open(file_name, O_RDONLY);
+  if (table->fd < 0) {
+    char message[256];
+    sprintf(message, "Unable to open %.128s: %.64s", file_name,
+            strerror(errno));
+    ERROR_JUMP(-1, done, message);
+  }
+
+done:
+  free(file_name);
+  if (fcpl > 0)
+    H5Pclose(fcpl);
+  if (fapl > 0)
+    H5Pclose(fapl);
+  if (f_id > 0)
+    H5Fclose(f_id);
+  if (dcpl > 0)
+    H5Pclose(dcpl);
+  if (retval < 0)
+    clear_chunk_table(table);
+  return retval;
+}
+
+int build_block_chunk_table(struct opt_eiger_ds_desc_t *desc, int n) {
+  const struct ds_desc_t *base = (struct ds_desc_t *)desc;
+  struct eiger_ds_desc_t *eiger_desc = &desc->base;
+  hsize_t chunk_dims[3] = {desc->frames_per_chunk, desc->tile_size[0],
+                           desc->tile_size[1]};
+  hsize_t dims[3] = {eiger_desc->blocks[n].first_frame +
+                         eiger_desc->block_sizes[n],
+                     base->dims[1], base->dims[2]};
+  return build_chunk_table(&eiger_desc->blocks[n], dims, chunk_dims,
+                           eiger_desc->index, n);
+}
+
+int build_chunk_tables(struct opt_eiger_ds_desc_t *desc) {
+  int retval = 0;
+  int n;
+  struct eiger_ds_desc_t *eiger_desc = &desc->base;
+
+  /* blocks not yet opened get their tables when they are */
+  for (n = 0; n < eiger_desc->n_data_blocks; n++) {
+    if (eiger_desc->blocks[n].ds_id > 0 &&
+        build_block_chunk_table(desc, n) < 0) {
+      ERROR_JUMP(-1, done, "");
+    }
+  }
+
+  desc->chunk_size_func = &get_chunk_size_direct;
+  desc->chunk_read_func = &read_chunk_direct;
+
+done:
+  if (retval < 0) {
+    for (n = 0; n < eiger_desc->n_data_blocks; n++) {
+      clear_chunk_table(&eiger_desc->blocks[n].chunks);
+    }
+  }
+  return retval;
+}
+#else
+int build_block_chunk_table(struct opt_eiger_ds_desc_t *desc, int n) {
+  int retval = 0;
+  ERROR_JUMP(-1, done, "Direct chunk reads require HDF5 1.10.5 or later");
+done:
+  return retval;
+}
+
+int build_chunk_tables(struct opt_eiger_ds_desc_t *desc) {
+  int retval = 0;
+  ERROR_JUMP(-1, done, "Direct chunk reads require HDF5 1.10.5 or later");
+done:
+  return retval;
+}
+#endif
+
+/* the sidecar index of the data_%06d datasets in g_id, if there is one
+ * and no data file has changed since it was written */
+struct data_index_t *open_eiger_index(hid_t g_id) {
+  struct data_index_t *index = NULL;
+  char *master_path = get_master_path(g_id);
+  char ds_name[32];
+  unsigned long long n_frames = 0;
+  int n;
+
+  if (!master_path || open_data_index(master_path, &index) <= 0)
+    goto done;
+  /* the frame counts are used for every link, so a link added or removed
+   * since the index was written makes it unusable */
+  if (count_data_blocks(g_id) != index->header->n_blocks) {
+    close_data_index(index);
+    index = NULL;
+    goto done;
+  }
+  for (n = 0; n < index->header->n_blocks; n++) {
+    const struct index_block_t *block = &index->blocks[n];
+    long long mtime[2];
+    char *path;
+    int stale;
+    sprintf(ds_name, "data_%06d", n + 1);
+    path = get_external_link_file(g_id, ds_name, master_path);
+    stale = get_file_mtime(path, mtime) < 0 || mtime[0] != block->mtime[0] ||
+            mtime[1] != block->mtime[1];
+    free(path);
+    if (stale)
+      break;
+    n_frames += block->n_frames;
+  }
+  if (n < index->header->n_blocks || n_frames != index->header->dims[0]) {
+    close_data_index(index);
+    index = NULL;
+  }
+done:
+  reset_error_stack();
+  free(master_path);
+  return index;
+}
+
+int save_detector_index(const struct ds_desc_t *desc, const int *mask) {
+  int retval = 0;
+  struct eiger_ds_desc_t *eiger_desc = (struct eiger_ds_desc_t *)desc;
+  const struct data_index_t *index = eiger_desc->index;
+  struct data_index_t *saved = NULL;
+  struct index_header_t header;
+  struct index_block_t *blocks = NULL;
+  int *index_mask = NULL;
+  char *master_path = NULL;
+  char ds_name[32];
+  int n, stale;
+
+  if (!getenv("DURIN_INDEX_DIR") ||
+      (desc->free_desc != &free_eiger_desc &&
+       desc->free_desc != &free_opt_eiger_desc) ||
+      !eiger_desc->pooled_blocks)
+    return 0;
+
+  /* an index is saved again once it is missing chunk tables now known,
+   * keeping its mask if none is given */
+  pthread_mutex_lock(&eiger_desc->block_lock);
+  stale = !index;
+  for (n = 0; !stale && n < eiger_desc->n_data_blocks; n++) {
+    stale = eiger_desc->blocks[n].chunks.offsets && !index->blocks[n].n_chunks;
+  }
+  if (!stale)
+    goto unlock;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.dims, desc->dims, sizeof(header.dims));
+  header.data_width = desc->data_width;
+  header.n_blocks = eiger_desc->n_data_blocks;
+  header.chunk_read = desc->free_desc == &free_opt_eiger_desc;
+  if (header.chunk_read) {
+    const struct opt_eiger_ds_desc_t *o_eiger_desc =
+        (struct opt_eiger_ds_desc_t *)desc;
+    header.pipeline = o_eiger_desc->pipeline;
+    header.frames_per_chunk = o_eiger_desc->frames_per_chunk;
+    header.tile_size[0] = o_eiger_desc->tile_size[0];
+    header.tile_size[1] = o_eiger_desc->tile_size[1];
+  }
+
+  master_path = get_master_path(desc->data_g_id);
+  blocks = calloc(eiger_desc->n_data_blocks, sizeof(*blocks));
+  if (!master_path || !blocks) {
+    ERROR_JUMP(-1, unlock, "Unable to allocate index description");
+  }
+  if (!mask && index && index->header->has_mask) {
+    size_t length = desc->dims[1] * desc->dims[2];
+    index_mask = malloc(length * sizeof(*index_mask));
+    if (!index_mask || read_index_mask(index, index_mask, length) < 0) {
+      ERROR_JUMP(-1, unlock, "");
+    }
+    mask = index_mask;
+  }
+  for (n = 0; n < eiger_desc->n_data_blocks; n++) {
+    char *path;
+    int err;
+    sprintf(ds_name, "data_%06d", n + 1);
+    path = get_external_link_file(desc->data_g_id, ds_name, master_path);
+    err = get_file_mtime(path, blocks[n].mtime);
+    free(path);
+    if (err < 0) {
+      char message[64];
+      sprintf(message, "Unable to read the file holding %.16s", ds_name);
+      ERROR_JUMP(-1, unlock, message);
+    }
+    blocks[n].n_frames = eiger_desc->block_sizes[n];
+  }
+  if (write_data_index(master_path, &header, blocks, eiger_desc->blocks,
+                       mask, index) < 0) {
+    ERROR_JUMP(-1, unlock, "");
+  }
+  /* chunk tables built from here on are compared with the saved index */
+  if (open_data_index(master_path, &saved) > 0) {
+    close_data_index(eiger_desc->index);
+    eiger_desc->index = saved;
+  }
+
+unlock:
+  pthread_mutex_unlock(&eiger_desc->block_lock);
+  free(index_mask);
+  free(blocks);
+  free(master_path);
+  return retval;
+}
+
+int create_dataset_descriptor(struct ds_desc_t **desc,
+                              struct det_visit_objects_t *visit_result) {
+  int retval = 0;
+  hid_t g_id, ds_id;
+  int (*pxl_func)(const struct ds_desc_t *, double *, double *);
   int (*pxl_mask_func)(const struct ds_desc_t *, int *);
   int (*ds_prop_func)(struct ds_desc_t *);
   int (*frame_func)(const struct ds_desc_t *, int, void *);
@@ -862,11 +2487,20 @@ int create_dataset_descriptor(struct ds_desc_t **desc,
     ERROR_JUMP(-1, done, "Could not locate detector dataset");
   }
 
+  /* a virtual dataset may be read from the chunks of its sources */
+  if (ds_prop_func == &get_nxs_dataset_dims &&
+      is_virtual_dataset(ds_id, "data") > 0) {
+    ds_prop_func = &get_vds_dataset_dims;
+    frame_func = &get_dectris_eiger_frame;
+  }
+  reset_error_stack();
+
   if (ds_prop_func == &get_dectris_eiger_dataset_dims) {
 
     /* setup the "extra info" structs */
     struct eiger_ds_desc_t *eiger_desc;
     struct opt_eiger_ds_desc_t *o_eiger_desc;
+    struct data_index_t *index;
 
     eiger_desc = malloc(sizeof(*eiger_desc));
     if (!eiger_desc) {
@@ -881,10 +2515,26 @@ int create_dataset_descriptor(struct ds_desc_t **desc,
       ERROR_JUMP(-1, done,
                  "Memory error creating data description for optimised Eiger");
     }
+    memset(o_eiger_desc, 0, sizeof(*o_eiger_desc));
     o_eiger_desc->base.frame_func = &get_frame_from_chunk;
-
-    /* check if we can perform the optimised chunk read */
-    retval = check_for_chunk_read(ds_id, "data_000001", o_eiger_desc);
+    o_eiger_desc->chunk_size_func = &get_chunk_size_hdf5;
+    o_eiger_desc->chunk_read_func = &read_chunk_hdf5;
+
+    /* a sidecar index from an earlier open describes the chunks and the
+     * data files without opening them */
+    index = open_eiger_index(ds_id);
+    if (index) {
+      retval = index->header->chunk_read;
+      o_eiger_desc->pipeline = index->header->pipeline;
+      o_eiger_desc->frames_per_chunk = index->header->frames_per_chunk;
+      o_eiger_desc->tile_size[0] = index->header->tile_size[0];
+      o_eiger_desc->tile_size[1] = index->header->tile_size[1];
+      if (index->header->has_mask)
+        pxl_mask_func = &get_indexed_pixel_mask;
+    } else {
+      /* check if we can perform the optimised chunk read */
+      retval = check_for_chunk_read(ds_id, "data_000001", o_eiger_desc);
+    }
     if (retval < 0) {
       free(o_eiger_desc);
       free(eiger_desc);
@@ -892,17 +2542,63 @@ int create_dataset_descriptor(struct ds_desc_t **desc,
     }
     if (retval) {
       free(eiger_desc);
+      o_eiger_desc->base.index = index;
       *(struct opt_eiger_ds_desc_t **)desc = o_eiger_desc;
       free_func = &free_opt_eiger_desc;
     } else {
       free(o_eiger_desc);
+      eiger_desc->index = index;
       *(struct eiger_ds_desc_t **)desc = eiger_desc;
       free_func = &free_eiger_desc;
     }
 
+  } else if (ds_prop_func == &get_vds_dataset_dims) {
+    struct opt_eiger_ds_desc_t *o_eiger_desc = malloc(sizeof(*o_eiger_desc));
+    if (!o_eiger_desc) {
+      ERROR_JUMP(-1, done,
+                 "Memory error creating data description for virtual dataset");
+    }
+    memset(o_eiger_desc, 0, sizeof(*o_eiger_desc));
+    o_eiger_desc->base.frame_func = &get_frame_from_chunk;
+    o_eiger_desc->chunk_size_func = &get_chunk_size_hdf5;
+    o_eiger_desc->chunk_read_func = &read_chunk_hdf5;
+    *(struct opt_eiger_ds_desc_t **)desc = o_eiger_desc;
+    free_func = &free_opt_eiger_desc;
+
   } else {
-    *desc = malloc(sizeof(struct nxs_ds_desc_t));
-    free_func = &free_nxs_desc;
+    struct nxs_ds_desc_t *nxs_desc;
+    struct opt_eiger_ds_desc_t *o_eiger_desc;
+
+    /* a single chunked dataset is read as one data block if its chunks can
+     * be decoded by the plugin */
+    o_eiger_desc = malloc(sizeof(*o_eiger_desc));
+    if (!o_eiger_desc) {
+      ERROR_JUMP(-1, done, "Memory error creating data description");
+    }
+    memset(o_eiger_desc, 0, sizeof(*o_eiger_desc));
+    retval = check_for_chunk_read(ds_id, "data", o_eiger_desc);
+    if (retval < 0) {
+      free(o_eiger_desc);
+      ERROR_JUMP(-1, done, "");
+    }
+    if (retval) {
+      o_eiger_desc->base.frame_func = &get_frame_from_chunk;
+      o_eiger_desc->chunk_size_func = &get_chunk_size_hdf5;
+      o_eiger_desc->chunk_read_func = &read_chunk_hdf5;
+      *(struct opt_eiger_ds_desc_t **)desc = o_eiger_desc;
+      free_func = &free_opt_eiger_desc;
+      ds_prop_func = &get_chunked_nxs_dataset_dims;
+      frame_func = &get_dectris_eiger_frame;
+    } else {
+      free(o_eiger_desc);
+      nxs_desc = malloc(sizeof(*nxs_desc));
+      if (!nxs_desc) {
+        ERROR_JUMP(-1, done, "Memory error creating data description");
+      }
+      init_data_block(&nxs_desc->block);
+      *(struct nxs_ds_desc_t **)desc = nxs_desc;
+      free_func = &free_nxs_desc;
+    }
   }
 
   output = *((struct ds_desc_t **)desc);
@@ -911,9 +2607,98 @@ int create_dataset_descriptor(struct ds_desc_t **desc,
   output->get_pixel_properties = pxl_func;
   output->get_pixel_mask = pxl_mask_func;
   output->get_data_frame = frame_func;
+  output->get_data_frame_int = NULL;
   output->free_desc = free_func;
 
-  ds_prop_func(output);
+  retval = ds_prop_func(output);
+  if (retval < 0 && ds_prop_func != &get_vds_dataset_dims) {
+    output->free_desc(output);
+    *desc = NULL;
+    ERROR_JUMP(-1, done, "Could not determine the dataset dimensions");
+  }
+  if (retval < 0) {
+    /* read through the HDF5 virtual dataset machinery instead */
+    struct nxs_ds_desc_t *nxs_desc = malloc(sizeof(*nxs_desc));
+    fprintf(stderr, "WARNING: Could not read virtual dataset from its source "
+                    "chunks - falling back to HDF5 reads\n");
+    dump_error_stack(stderr);
+    reset_error_stack();
+    if (!nxs_desc) {
+      free(output);
+      *desc = NULL;
+      ERROR_JUMP(-1, done, "Memory error creating data description");
+    }
+    init_data_block(&nxs_desc->block);
+    nxs_desc->base = *output;
+    free(output);
+    output = &nxs_desc->base;
+    *desc = output;
+    output->get_data_frame = &get_nxs_frame;
+    output->free_desc = free_func = &free_nxs_desc;
+    retval = get_nxs_dataset_dims(output);
+    if (retval < 0) {
+      output->free_desc(output);
+      *desc = NULL;
+      ERROR_JUMP(-1, done, "Could not determine the dataset dimensions");
+    }
+  }
+
+  /* chunks can be decoded straight into the int output buffer */
+  if (free_func == &free_opt_eiger_desc &&
+      (output->data_width == 1 || output->data_width == 2 ||
+       output->data_width == sizeof(int))) {
+    output->get_data_frame_int = &get_opt_eiger_frame_int;
+  }
+
+  if (free_func == &free_opt_eiger_desc && use_direct_chunk_read()) {
+    if (build_chunk_tables((struct opt_eiger_ds_desc_t *)output) < 0) {
+      fprintf(stderr, "WARNING: Could not set up direct chunk reads - falling "
+                      "back to HDF5 chunk reads\n");
+      dump_error_stack(stderr);
+      reset_error_stack();
+    }
+  }
+
+  /* chunks of several frames are decoded once and kept while their frames
+   * are read */
+  if (free_func == &free_opt_eiger_desc &&
+      ((struct opt_eiger_ds_desc_t *)output)->frames_per_chunk > 1) {
+    struct opt_eiger_ds_desc_t *o_eiger_desc =
+        (struct opt_eiger_ds_desc_t *)output;
+    size_t chunk_bytes = o_eiger_desc->frames_per_chunk * output->dims[1] *
+                         output->dims[2] * output->data_width;
+    if (create_chunk_cache(chunk_bytes, &o_eiger_desc->chunk_cache) < 0) {
+      ERROR_JUMP(-1, done, "");
+    }
+    o_eiger_desc->base.frame_func = &get_frame_from_cached_chunk;
+  }
+
+  /* frames split over several chunks are assembled from their tiles, which
+   * are decoded in parallel while only one thread is reading */
+  if (free_func == &free_opt_eiger_desc &&
+      (((struct opt_eiger_ds_desc_t *)output)->tile_size[0] < output->dims[1] ||
+       ((struct opt_eiger_ds_desc_t *)output)->tile_size[1] <
+           output->dims[2])) {
+    struct opt_eiger_ds_desc_t *o_eiger_desc =
+        (struct opt_eiger_ds_desc_t *)output;
+    const hsize_t *tile_size = o_eiger_desc->tile_size;
+    long n_tiles = ((output->dims[1] + tile_size[0] - 1) / tile_size[0]) *
+                   ((output->dims[2] + tile_size[1] - 1) / tile_size[1]);
+    long n_threads =
+        get_env_long("DURIN_TILE_THREADS", sysconf(_SC_NPROCESSORS_ONLN));
+    if (n_threads > n_tiles)
+      n_threads = n_tiles;
+    if (n_threads > TILE_MAX_THREADS)
+      n_threads = TILE_MAX_THREADS;
+    o_eiger_desc->base.frame_func = &get_frame_from_tiles;
+    if (n_threads > 1 &&
+        create_worker_pool(n_threads - 1, &o_eiger_desc->tile_pool) < 0) {
+      fprintf(stderr, "WARNING: Could not start tile decoding threads - "
+                      "tiles will be decoded serially\n");
+      dump_error_stack(stderr);
+      reset_error_stack();
+    }
+  }
 
 done:
   return retval;
@@ -924,8 +2709,11 @@ int get_detector_info(const hid_t fid, struct ds_desc_t **desc) {
   int retval = 0;
   herr_t err = 0;
   struct det_visit_objects_t objects = {0};
-  err =
-      H5Ovisit(fid, H5_INDEX_NAME, H5_ITER_INC, &det_visit_callback, &objects);
+  err = probe_standard_locations(fid, &objects);
+  if (err == 0 && !(objects.nxdata && objects.nxdetector)) {
+    err = H5Ovisit(fid, H5_INDEX_NAME, H5_ITER_INC, &det_visit_callback,
+                   &objects);
+  }
   if (err < 0) {
     clear_det_visit_objects(&objects);
     ERROR_JUMP(-1, done, "Error during H5Ovisit callback");
@@ -6,9 +6,12 @@
 #ifndef NXS_XDS_FILE_H
 #define NXS_XDS_FILE_H
 
+#include "chunk_cache.h"
 #include "err.h"
 #include "filters.h"
+#include "workers.h"
 #include <hdf5.h>
+#include <pthread.h>
 
 struct ds_desc_t {
   hid_t det_g_id;
@@ -18,29 +21,98 @@ struct ds_desc_t {
   int (*get_pixel_properties)(const struct ds_desc_t *, double *, double *);
   int (*get_pixel_mask)(const struct ds_desc_t *, int *);
   int (*get_data_frame)(const struct ds_desc_t *, const int, void *);
+  /* optional - read a frame converted to int and masked in a single pass,
+   * filling only the pixels inside the region if one is given */
+  int (*get_data_frame_int)(const struct ds_desc_t *, const int, int *,
+                            const struct pixel_mask_t *,
+                            const struct pixel_region_t *);
   void (*free_desc)(struct ds_desc_t *);
 };
 
+/* file locations of the chunks of one data block, for reading with pread */
+struct chunk_table_t {
+  int fd;
+  hsize_t n_chunks;
+  hsize_t chunk_dims[3];
+  /* chunks covering each frame, stored row by row */
+  hsize_t tiles_per_frame;
+  hsize_t tile_columns;
+  haddr_t *offsets;
+  hsize_t *sizes;
+  unsigned int *filter_masks;
+};
+
+/* a dataset holding a contiguous range of frames, kept open between reads */
+struct data_block_t {
+  char name[16];
+  hid_t ds_id;
+  hid_t s_id;
+  hid_t t_id;
+  /* index in the dataset of the first frame used - non-zero only for the
+   * source datasets of a virtual dataset */
+  hsize_t first_frame;
+  struct chunk_table_t chunks;
+};
+
 struct nxs_ds_desc_t {
   struct ds_desc_t base;
+  struct data_block_t block;
 };
 
+struct data_index_t;
+
 struct eiger_ds_desc_t {
   struct ds_desc_t base;
   int n_data_blocks;
   int *block_sizes;
-  int (*frame_func)(const struct ds_desc_t *, const char *, const hsize_t *,
-                    const hsize_t *, void *);
+  /* index of the first frame of each block, with the total frame count last */
+  int *block_starts;
+  /* size of every block but the last if they are all equal, otherwise 0 */
+  int uniform_block_size;
+  struct data_block_t *blocks;
+  /* non-zero if the blocks are the data_%06d datasets of an Eiger master
+   * file, which are opened when first read. At most max_open_blocks are kept
+   * open, closing the least recently used block with no readers first. The
+   * fields below are guarded by block_lock */
+  int pooled_blocks;
+  int max_open_blocks;
+  int n_open_blocks;
+  int *block_readers;
+  unsigned long *block_last_use;
+  unsigned long block_clock;
+  pthread_mutex_t block_lock;
+  /* the sidecar index read or saved for the collection, if any */
+  struct data_index_t *index;
+  int (*frame_func)(const struct ds_desc_t *, const struct data_block_t *,
+                    const hsize_t *, const hsize_t *, void *);
 };
 
 struct opt_eiger_ds_desc_t {
   struct eiger_ds_desc_t base;
-  int bs_applied;
-  unsigned int bs_params[BS_H5_N_PARAMS];
+  struct filter_pipeline_t pipeline;
+  /* frames held by each chunk - chunks of several frames are decoded once
+   * into the chunk cache and the frames copied out from there */
+  hsize_t frames_per_chunk;
+  struct chunk_cache_t *chunk_cache;
+  /* frames too large for one chunk are split into tiles of tile_size rows
+   * and columns, read and decoded separately, otherwise tile_size is the
+   * size of a frame */
+  hsize_t tile_size[2];
+  struct worker_pool_t *tile_pool;
+  int (*chunk_size_func)(const struct data_block_t *, const hsize_t *,
+                         hsize_t *);
+  int (*chunk_read_func)(const struct data_block_t *, const hsize_t *,
+                         const hsize_t, void *, unsigned int *);
 };
 
 int get_detector_info(const hid_t fid, struct ds_desc_t **desc);
 
+/* save the layout of an Eiger data collection and its dense mask bits to the
+ * sidecar index, if DURIN_INDEX_DIR is set and the index in use is missing
+ * or lacks chunk tables now known. With a NULL mask any mask already in the
+ * index is kept */
+int save_detector_index(const struct ds_desc_t *desc, const int *mask);
+
 struct det_visit_objects_t {
   hid_t nxdata;
   hid_t nxdetector;
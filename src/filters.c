@@ -3,55 +3,793 @@
  * Author: Charles Mita
  */
 
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <zlib.h>
 
 #include "bitshuffle.h"
+#include "convert.h"
 #include "err.h"
 #include "filters.h"
+#include "lz4.h"
+#include "scratch.h"
+
+#ifdef DURIN_WITH_ZSTD
+#include <zstd.h>
+#endif
 
 /* Required prototypes from bitshuffle.c but not included in header */
 uint64_t bshuf_read_uint64_BE(const void *buffer);
 uint32_t bshuf_read_uint32_BE(const void *buffer);
 
+/* The two stages of the bit untranspose from bitshuffle_core.c, called
+ * directly so the intermediate buffer can be reused between blocks */
+#if defined(__AVX2__) && defined(__SSE2__)
+int64_t bshuf_trans_byte_bitrow_AVX(const void *in, void *out,
+                                    const size_t size, const size_t elem_size);
+int64_t bshuf_shuffle_bit_eightelem_AVX(const void *in, void *out,
+                                        const size_t size,
+                                        const size_t elem_size);
+#define TRANS_BYTE_BITROW bshuf_trans_byte_bitrow_AVX
+#define SHUFFLE_BIT_EIGHTELEM bshuf_shuffle_bit_eightelem_AVX
+#elif defined(__SSE2__)
+int64_t bshuf_trans_byte_bitrow_SSE(const void *in, void *out,
+                                    const size_t size, const size_t elem_size);
+int64_t bshuf_shuffle_bit_eightelem_SSE(const void *in, void *out,
+                                        const size_t size,
+                                        const size_t elem_size);
+#define TRANS_BYTE_BITROW bshuf_trans_byte_bitrow_SSE
+#define SHUFFLE_BIT_EIGHTELEM bshuf_shuffle_bit_eightelem_SSE
+#else
+int64_t bshuf_trans_byte_bitrow_scal(const void *in, void *out,
+                                     const size_t size, const size_t elem_size);
+int64_t bshuf_shuffle_bit_eightelem_scal(const void *in, void *out,
+                                         const size_t size,
+                                         const size_t elem_size);
+#define TRANS_BYTE_BITROW bshuf_trans_byte_bitrow_scal
+#define SHUFFLE_BIT_EIGHTELEM bshuf_shuffle_bit_eightelem_scal
+#endif
+
+/* bitshuffle processes blocks in multiples of 8 elements */
+#define BS_BLOCKED_MULT 8
+
+int bit_untranspose(const void *in, void *out, size_t size, size_t elem_size) {
+  int retval = 0;
+  void *tmp = get_scratch_buffer(SCRATCH_BLOCK_TMP, size * elem_size);
+  if (!tmp) {
+    ERROR_JUMP(-1, done, "Unable to allocate bit untranspose buffer");
+  }
+  if (TRANS_BYTE_BITROW(in, tmp, size, elem_size) < 0 ||
+      SHUFFLE_BIT_EIGHTELEM(tmp, out, size, elem_size) < 0) {
+    ERROR_JUMP(-1, done, "Error performing bit unshuffle");
+  }
+done:
+  return retval;
+}
+
+/*
+ * Decode the blocks following the header, if any, of a bitshuffle chunk.
+ * Mirrors bshuf_blocked_wrap_fun: full blocks, then a final block rounded
+ * down to a multiple of 8 elements, then any remaining bytes copied as is.
+ * If int_out is given each block is untransposed into a scratch buffer and
+ * widened (and masked) into int_out while it is still in cache, otherwise
+ * blocks are untransposed straight into out. Blocks of int_out wholly outside
+ * region, if given, are stepped over using their compressed sizes and left
+ * unfilled.
+ */
+int bslz4_decode_blocks(int compression, const char *in, size_t in_size,
+                        char *out, int *int_out,
+                        const struct pixel_mask_t *mask,
+                        const struct pixel_region_t *region, size_t size,
+                        size_t elem_size, size_t block_size) {
+  int retval = 0;
+  size_t done_elems = 0;
+  size_t leftover;
+  const char *in_end = in + in_size;
+  char *block_out = out;
+
+  if (int_out) {
+    block_out =
+        get_scratch_buffer(SCRATCH_BLOCK_OUT, block_size * elem_size);
+    if (!block_out) {
+      ERROR_JUMP(-1, done, "Unable to allocate block buffer");
+    }
+  }
+
+  while (done_elems + BS_BLOCKED_MULT <= size) {
+    size_t n_elems = size - done_elems;
+    size_t n_bytes;
+    int skip;
+    if (n_elems > block_size)
+      n_elems = block_size;
+    n_elems -= n_elems % BS_BLOCKED_MULT;
+    n_bytes = n_elems * elem_size;
+    skip = int_out && region && !region_overlaps(region, done_elems, n_elems);
+
+    if (compression) {
+      uint32_t c_bytes;
+      char *block;
+      if (in + 4 > in_end) {
+        ERROR_JUMP(-1, done, "Bitshuffle chunk is truncated");
+      }
+      c_bytes = bshuf_read_uint32_BE(in);
+      in += 4;
+      if (c_bytes > (size_t)(in_end - in)) {
+        ERROR_JUMP(-1, done, "Bitshuffle chunk is truncated");
+      }
+      if (skip) {
+        in += c_bytes;
+        done_elems += n_elems;
+        continue;
+      }
+      block = get_scratch_buffer(SCRATCH_BLOCK, n_bytes);
+      if (!block) {
+        ERROR_JUMP(-1, done, "Unable to allocate block buffer");
+      }
+      if (compression == BS_H5_PARAM_LZ4_COMPRESS) {
+        if (LZ4_decompress_safe(in, block, c_bytes, n_bytes) !=
+            (int)n_bytes) {
+          ERROR_JUMP(-1, done, "Error performing lz4 decompression");
+        }
+      } else {
+#ifdef DURIN_WITH_ZSTD
+        size_t z_bytes = ZSTD_decompress(block, n_bytes, in, c_bytes);
+        if (ZSTD_isError(z_bytes) || z_bytes != n_bytes) {
+          ERROR_JUMP(-1, done, "Error performing zstd decompression");
+        }
+#else
+        ERROR_JUMP(-1, done, "Built without zstd support");
+#endif
+      }
+      in += c_bytes;
+      if (bit_untranspose(block, block_out, n_elems, elem_size) < 0) {
+        ERROR_JUMP(-1, done, "");
+      }
+    } else {
+      if (n_bytes > (size_t)(in_end - in)) {
+        ERROR_JUMP(-1, done, "Bitshuffle chunk is truncated");
+      }
+      if (skip) {
+        in += n_bytes;
+        done_elems += n_elems;
+        continue;
+      }
+      if (bit_untranspose(in, block_out, n_elems, elem_size) < 0) {
+        ERROR_JUMP(-1, done, "");
+      }
+      in += n_bytes;
+    }
+
+    if (int_out) {
+      if (convert_and_mask_pixels(block_out, elem_size, int_out + done_elems,
+                                  done_elems, n_elems, mask) < 0) {
+        ERROR_JUMP(-1, done, "");
+      }
+    } else {
+      block_out += n_bytes;
+    }
+    done_elems += n_elems;
+  }
+
+  leftover = (size - done_elems) * elem_size;
+  if (leftover > (size_t)(in_end - in)) {
+    ERROR_JUMP(-1, done, "Bitshuffle chunk is truncated");
+  }
+  if (int_out) {
+    if (convert_and_mask_pixels(in, elem_size, int_out + done_elems,
+                                done_elems, size - done_elems, mask) < 0) {
+      ERROR_JUMP(-1, done, "");
+    }
+  } else {
+    memcpy(block_out, in, leftover);
+  }
+
+done:
+  return retval;
+}
+
+/* the compression of a bitshuffle chunk, 0 if the filter has none */
+static int bitshuffle_compression(const struct chunk_filter_t *filter) {
+  return filter->n_params > 4 ? filter->params[4] : 0;
+}
+
+/*
+ * Find the compression, the block size in elements and the size of the
+ * header of a bitshuffle chunk. Compressed chunks begin with the frame size
+ * and block size, but the filter writes uncompressed chunks without a header
+ * and takes their block size from its parameters.
+ */
+int bslz4_read_header(const struct chunk_filter_t *filter, size_t in_size,
+                      const void *in_buffer, size_t out_size,
+                      int *compression, size_t *block_size,
+                      size_t *header_size) {
+  int retval = 0;
+  size_t elem_size, u_bytes;
+
+  elem_size = filter->params[2];
+  *compression = bitshuffle_compression(filter);
+  if (*compression == 0) {
+    *header_size = 0;
+    *block_size = filter->n_params > 3 ? filter->params[3] : 0;
+    if (*block_size == 0)
+      *block_size = bshuf_default_block_size(elem_size);
+    if (out_size % elem_size) {
+      ERROR_JUMP(-1, done, "Bitshuffle chunk is not a whole number of "
+                           "elements");
+    }
+  } else {
+    *header_size = 12;
+    if (in_size < 12) {
+      ERROR_JUMP(-1, done, "Bitshuffle chunk is smaller than its header");
+    }
+    u_bytes = bshuf_read_uint64_BE(in_buffer);
+
+    if (u_bytes != out_size) {
+      char message[64];
+      sprintf(message, "Decompressed chunk is %lu bytes, expected %lu",
+              u_bytes, out_size);
+      ERROR_JUMP(-1, done, message);
+    }
+    *block_size =
+        bshuf_read_uint32_BE((const char *)in_buffer + 8) / elem_size;
+  }
+
+  if (!*block_size || *block_size % BS_BLOCKED_MULT) {
+    char message[64];
+    sprintf(message, "Invalid bitshuffle block size %lu", *block_size);
+    ERROR_JUMP(-1, done, message);
+  }
+
+done:
+  return retval;
+}
+
 /*
  * Derived from the h5 filter code from the bitshuffle project (not included
  * here)
  */
-int bslz4_decompress(const unsigned int *bs_params, size_t in_size,
+int bslz4_decompress(const struct chunk_filter_t *filter, size_t in_size,
                      void *in_buffer, size_t out_size, void *out_buffer) {
 
   int retval = 0;
-  size_t size, elem_size, block_size, u_bytes;
+  size_t elem_size = filter->params[2];
+  size_t block_size, header_size;
+  int compression;
+
+  if (bslz4_read_header(filter, in_size, in_buffer, out_size, &compression,
+                        &block_size, &header_size) < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+
+  if (bslz4_decode_blocks(compression, (const char *)in_buffer + header_size,
+                          in_size - header_size, out_buffer, NULL, NULL, NULL,
+                          out_size / elem_size, elem_size, block_size) < 0) {
+    ERROR_JUMP(-1, done, "Error performing bitshuffle decompression");
+  }
+
+done:
+  return retval;
+}
+
+int bslz4_decompress_to_int(const struct chunk_filter_t *filter,
+                            size_t in_size, void *in_buffer, size_t out_size,
+                            int *out_buffer, const struct pixel_mask_t *mask,
+                            const struct pixel_region_t *region) {
+
+  int retval = 0;
+  size_t elem_size = filter->params[2];
+  size_t block_size, header_size;
+  int compression;
+
+  if (bslz4_read_header(filter, in_size, in_buffer, out_size, &compression,
+                        &block_size, &header_size) < 0) {
+    ERROR_JUMP(-1, done, "");
+  }
+
+  if (bslz4_decode_blocks(compression, (const char *)in_buffer + header_size,
+                          in_size - header_size, NULL, out_buffer, mask,
+                          region, out_size / elem_size, elem_size,
+                          block_size) < 0) {
+    ERROR_JUMP(-1, done, "Error performing bitshuffle decompression");
+  }
+
+done:
+  return retval;
+}
+
+int deflate_decompress(size_t in_size, const void *in_buffer, size_t out_size,
+                       void *out_buffer) {
+  int retval = 0;
+  uLongf dest_len = out_size;
+  int err = uncompress(out_buffer, &dest_len, in_buffer, in_size);
+  if (err != Z_OK || dest_len != out_size) {
+    char message[96];
+    sprintf(message, "Error inflating chunk - zlib error %d, %lu of %lu bytes",
+            err, (unsigned long)dest_len, out_size);
+    ERROR_JUMP(-1, done, message);
+  }
+done:
+  return retval;
+}
+
+/* reverse of the HDF5 shuffle filter - byte k of every element is stored
+ * together, with any trailing partial element left at the end */
+int byte_unshuffle(size_t elem_size, size_t in_size, const void *in_buffer,
+                   size_t out_size, void *out_buffer) {
+  int retval = 0;
+  const unsigned char *in = in_buffer;
+  unsigned char *out = out_buffer;
+  size_t n_elems, i, k;
 
-  elem_size = bs_params[2];
-  u_bytes = bshuf_read_uint64_BE(in_buffer);
+  if (in_size != out_size) {
+    char message[64];
+    sprintf(message, "Shuffled chunk is %lu bytes, expected %lu", in_size,
+            out_size);
+    ERROR_JUMP(-1, done, message);
+  }
+  if (elem_size <= 1) {
+    memcpy(out, in, out_size);
+    goto done;
+  }
+
+  n_elems = out_size / elem_size;
+  if (elem_size == 2) {
+    for (i = 0; i < n_elems; i++) {
+      out[2 * i] = in[i];
+      out[2 * i + 1] = in[n_elems + i];
+    }
+  } else if (elem_size == 4) {
+    for (i = 0; i < n_elems; i++) {
+      out[4 * i] = in[i];
+      out[4 * i + 1] = in[n_elems + i];
+      out[4 * i + 2] = in[2 * n_elems + i];
+      out[4 * i + 3] = in[3 * n_elems + i];
+    }
+  } else {
+    for (k = 0; k < elem_size; k++) {
+      for (i = 0; i < n_elems; i++) {
+        out[i * elem_size + k] = in[k * n_elems + i];
+      }
+    }
+  }
+  memcpy(out + n_elems * elem_size, in + n_elems * elem_size,
+         out_size - n_elems * elem_size);
+
+done:
+  return retval;
+}
+
+/*
+ * Chunks from the HDF5 LZ4 filter (32004) hold the decompressed size as a
+ * big endian 64 bit integer and the block size as a big endian 32 bit
+ * integer, followed by each block as a 32 bit compressed size and the data.
+ * Blocks which did not compress are stored as is.
+ */
+int lz4_decompress(size_t in_size, const void *in_buffer, size_t out_size,
+                   void *out_buffer) {
+  int retval = 0;
+  const char *in = in_buffer;
+  const char *in_end = in + in_size;
+  char *out = out_buffer;
+  size_t u_bytes, block_size, done_bytes = 0;
 
+  if (in_size < 12) {
+    ERROR_JUMP(-1, done, "LZ4 chunk is smaller than its header");
+  }
+  u_bytes = bshuf_read_uint64_BE(in);
+  block_size = bshuf_read_uint32_BE(in + 8);
+  in += 12;
   if (u_bytes != out_size) {
     char message[64];
     sprintf(message, "Decompressed chunk is %lu bytes, expected %lu", u_bytes,
             out_size);
     ERROR_JUMP(-1, done, message);
   }
+  if (block_size == 0) {
+    ERROR_JUMP(-1, done, "Invalid LZ4 block size 0");
+  }
 
-  block_size = bshuf_read_uint32_BE((const char *)in_buffer + 8) / elem_size;
-  if (!block_size) {
-    ERROR_JUMP(-1, done, "Read block bitshuffle lz4 block size as 0");
+  while (done_bytes < out_size) {
+    size_t n_bytes = out_size - done_bytes;
+    uint32_t c_bytes;
+    if (n_bytes > block_size)
+      n_bytes = block_size;
+    if (in + 4 > in_end) {
+      ERROR_JUMP(-1, done, "LZ4 chunk is truncated");
+    }
+    c_bytes = bshuf_read_uint32_BE(in);
+    in += 4;
+    if (c_bytes > (size_t)(in_end - in)) {
+      ERROR_JUMP(-1, done, "LZ4 chunk is truncated");
+    }
+    if (c_bytes == n_bytes) {
+      memcpy(out, in, n_bytes);
+    } else if (LZ4_decompress_safe(in, out, c_bytes, n_bytes) !=
+               (int)n_bytes) {
+      ERROR_JUMP(-1, done, "Error performing lz4 decompression");
+    }
+    in += c_bytes;
+    out += n_bytes;
+    done_bytes += n_bytes;
   }
-  /* skip over header */
-  in_buffer += 12;
-  size = u_bytes / elem_size;
 
-  if (bs_params[4] == BS_H5_PARAM_LZ4_COMPRESS) {
-    if (bshuf_decompress_lz4(in_buffer, out_buffer, size, elem_size,
-                             block_size) < 0) {
-      ERROR_JUMP(-1, done, "Error performing bitshuffle_lz4 decompression");
+done:
+  return retval;
+}
+
+/* Blosc chunk header flags and the compressor formats stored in its top
+ * three bits */
+#define BLOSC_HEADER_SIZE 16
+#define BLOSC_MAX_VERSION 2
+#define BLOSC_DOSHUFFLE 0x1
+#define BLOSC_MEMCPYED 0x2
+#define BLOSC_DOBITSHUFFLE 0x4
+#define BLOSC_DONT_SPLIT 0x10
+#define BLOSC_LZ4_FORMAT 1
+#define BLOSC_ZLIB_FORMAT 3
+#define BLOSC_ZSTD_FORMAT 4
+#define BLOSC_MAX_SPLITS 16
+#define BLOSC_MIN_BUFFERSIZE 128
+
+static uint32_t read_uint32_LE(const void *buffer) {
+  const unsigned char *b = buffer;
+  return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 |
+         (uint32_t)b[3] << 24;
+}
+
+/* decompress one stream of a blosc block - streams which did not compress
+ * are stored as is */
+int blosc_decompress_stream(int format, const char *in, size_t c_bytes,
+                            char *out, size_t n_bytes) {
+  int retval = 0;
+  if (c_bytes == n_bytes) {
+    memcpy(out, in, n_bytes);
+    goto done;
+  }
+  switch (format) {
+  case BLOSC_LZ4_FORMAT:
+    if (LZ4_decompress_safe(in, out, c_bytes, n_bytes) != (int)n_bytes) {
+      ERROR_JUMP(-1, done, "Error performing lz4 decompression");
     }
-  } else {
-    if (bshuf_bitunshuffle(in_buffer, out_buffer, size, elem_size, block_size) <
-        0) {
-      ERROR_JUMP(-1, done, "Error performing bit unshuffle");
+    break;
+  case BLOSC_ZLIB_FORMAT: {
+    uLongf dest_len = n_bytes;
+    if (uncompress((Bytef *)out, &dest_len, (const Bytef *)in, c_bytes) !=
+            Z_OK ||
+        dest_len != n_bytes) {
+      ERROR_JUMP(-1, done, "Error inflating blosc block");
+    }
+    break;
+  }
+#ifdef DURIN_WITH_ZSTD
+  case BLOSC_ZSTD_FORMAT: {
+    size_t z_bytes = ZSTD_decompress(out, n_bytes, in, c_bytes);
+    if (ZSTD_isError(z_bytes) || z_bytes != n_bytes) {
+      ERROR_JUMP(-1, done, "Error performing zstd decompression");
+    }
+    break;
+  }
+#endif
+  default: {
+    char message[64];
+    sprintf(message, "Unsupported blosc compressor format %d", format);
+    ERROR_JUMP(-1, done, message);
+  }
+  }
+done:
+  return retval;
+}
+
+/*
+ * Chunks from the HDF5 Blosc filter (32001) are a single Blosc (version 1)
+ * buffer: a 16 byte header of version, compressor version, flags, type size
+ * and the little endian sizes of the data, the blocks and the whole buffer,
+ * followed by the offset of each block. Each block is split into one stream
+ * per byte of the type unless the header says otherwise, and is byte or bit
+ * shuffled as a whole before compression.
+ */
+int blosc_decompress(size_t in_size, const void *in_buffer, size_t out_size,
+                     void *out_buffer) {
+  int retval = 0;
+  const char *in = in_buffer;
+  char *out = out_buffer;
+  int version, flags, format;
+  size_t type_size, n_bytes, block_size, c_bytes, n_blocks, b;
+  int shuffle, bitshuffle;
+  char *block = NULL;
+
+  if (in_size < BLOSC_HEADER_SIZE) {
+    ERROR_JUMP(-1, done, "Blosc chunk is smaller than its header");
+  }
+  version = (unsigned char)in[0];
+  flags = (unsigned char)in[2];
+  type_size = (unsigned char)in[3];
+  n_bytes = read_uint32_LE(in + 4);
+  block_size = read_uint32_LE(in + 8);
+  c_bytes = read_uint32_LE(in + 12);
+  format = flags >> 5;
+
+  if (version > BLOSC_MAX_VERSION) {
+    char message[64];
+    sprintf(message, "Unsupported blosc format version %d", version);
+    ERROR_JUMP(-1, done, message);
+  }
+  if (n_bytes != out_size) {
+    char message[64];
+    sprintf(message, "Decompressed chunk is %lu bytes, expected %lu", n_bytes,
+            out_size);
+    ERROR_JUMP(-1, done, message);
+  }
+  if (c_bytes > in_size || type_size == 0) {
+    ERROR_JUMP(-1, done, "Invalid blosc chunk header");
+  }
+
+  if (flags & BLOSC_MEMCPYED) {
+    if (c_bytes < BLOSC_HEADER_SIZE + n_bytes) {
+      ERROR_JUMP(-1, done, "Blosc chunk is truncated");
+    }
+    memcpy(out, in + BLOSC_HEADER_SIZE, n_bytes);
+    goto done;
+  }
+  if (n_bytes == 0)
+    goto done;
+  if (block_size == 0) {
+    ERROR_JUMP(-1, done, "Invalid blosc block size 0");
+  }
+
+  n_blocks = (n_bytes + block_size - 1) / block_size;
+  if (BLOSC_HEADER_SIZE + 4 * n_blocks > c_bytes) {
+    ERROR_JUMP(-1, done, "Blosc chunk is truncated");
+  }
+  shuffle = (flags & BLOSC_DOSHUFFLE) && type_size > 1;
+  bitshuffle = (flags & BLOSC_DOBITSHUFFLE) && block_size >= type_size;
+  if (shuffle || bitshuffle) {
+    block = get_scratch_buffer(SCRATCH_BLOCK, block_size);
+    if (!block) {
+      ERROR_JUMP(-1, done, "Unable to allocate block buffer");
+    }
+  }
+
+  for (b = 0; b < n_blocks; b++) {
+    size_t b_bytes = block_size;
+    int leftover_block = 0;
+    size_t n_splits = 1, s, split_bytes;
+    size_t offset = read_uint32_LE(in + BLOSC_HEADER_SIZE + 4 * b);
+    char *block_out = out + b * block_size;
+    char *dest;
+
+    if (b == n_blocks - 1 && n_bytes % block_size) {
+      b_bytes = n_bytes % block_size;
+      leftover_block = 1;
+    }
+    if (!(flags & BLOSC_DONT_SPLIT) && type_size <= BLOSC_MAX_SPLITS &&
+        block_size / type_size >= BLOSC_MIN_BUFFERSIZE && !leftover_block)
+      n_splits = type_size;
+    split_bytes = b_bytes / n_splits;
+    dest = block ? block : block_out;
+
+    for (s = 0; s < n_splits; s++) {
+      size_t stream_bytes;
+      if (offset + 4 > c_bytes) {
+        ERROR_JUMP(-1, done, "Blosc chunk is truncated");
+      }
+      stream_bytes = read_uint32_LE(in + offset);
+      offset += 4;
+      if (stream_bytes > c_bytes - offset) {
+        ERROR_JUMP(-1, done, "Blosc chunk is truncated");
+      }
+      if (blosc_decompress_stream(format, in + offset, stream_bytes,
+                                  dest + s * split_bytes, split_bytes) < 0) {
+        ERROR_JUMP(-1, done, "");
+      }
+      offset += stream_bytes;
+    }
+
+    if (shuffle) {
+      if (byte_unshuffle(type_size, b_bytes, block, b_bytes, block_out) < 0) {
+        ERROR_JUMP(-1, done, "");
+      }
+    } else if (bitshuffle) {
+      /* blosc only bitshuffles blocks of a multiple of 8 elements */
+      size_t n_elems = b_bytes / type_size;
+      if (n_elems % BS_BLOCKED_MULT == 0) {
+        if (bit_untranspose(block, block_out, n_elems, type_size) < 0) {
+          ERROR_JUMP(-1, done, "");
+        }
+        memcpy(block_out + n_elems * type_size,
+               block + n_elems * type_size, b_bytes - n_elems * type_size);
+      } else {
+        memcpy(block_out, block, b_bytes);
+      }
+    }
+  }
+
+done:
+  return retval;
+}
+
+int is_supported_filter(const struct chunk_filter_t *filter) {
+  switch (filter->id) {
+  case BS_H5_FILTER_ID:
+    /* parameters are version, element size, block size and compression */
+    if (filter->n_params < 3)
+      return 0;
+    switch (bitshuffle_compression(filter)) {
+    case 0:
+      /* uncompressed chunks have no header giving their block size */
+      return filter->n_params < 4 ||
+             filter->params[3] % BS_BLOCKED_MULT == 0;
+    case BS_H5_PARAM_LZ4_COMPRESS:
+      return 1;
+#ifdef DURIN_WITH_ZSTD
+    case BS_H5_PARAM_ZSTD_COMPRESS:
+      return 1;
+#endif
+    default:
+      return 0;
+    }
+  case DEFLATE_H5_FILTER_ID:
+  case SHUFFLE_H5_FILTER_ID:
+  case LZ4_H5_FILTER_ID:
+    return 1;
+  case BLOSC_H5_FILTER_ID:
+    /* the compressor is only recorded in each chunk, but the parameters
+     * give the one used when the dataset was written */
+    if (filter->n_params <= BLOSC_H5_PARAM_COMPRESSOR)
+      return 0;
+    if (filter->params[BLOSC_H5_PARAM_LEVEL] == 0)
+      return 1;
+    switch (filter->params[BLOSC_H5_PARAM_COMPRESSOR]) {
+    case BLOSC_H5_LZ4:
+    case BLOSC_H5_LZ4HC:
+    case BLOSC_H5_ZLIB:
+      return 1;
+#ifdef DURIN_WITH_ZSTD
+    case BLOSC_H5_ZSTD:
+      return 1;
+#endif
+    default:
+      return 0;
+    }
+  default:
+    return 0;
+  }
+}
+
+int same_pipeline(const struct filter_pipeline_t *a,
+                  const struct filter_pipeline_t *b) {
+  int n;
+  if (a->n_filters != b->n_filters)
+    return 0;
+  for (n = 0; n < a->n_filters; n++) {
+    const struct chunk_filter_t *fa = &a->filters[n];
+    const struct chunk_filter_t *fb = &b->filters[n];
+    if (fa->id != fb->id || fa->n_params != fb->n_params ||
+        memcmp(fa->params, fb->params, fa->n_params * sizeof(*fa->params)))
+      return 0;
+  }
+  return 1;
+}
+
+int pipeline_applied(const struct filter_pipeline_t *pipeline,
+                     unsigned int filter_mask) {
+  int n;
+  /* bit n of the filter mask is set if filter n was skipped */
+  for (n = 0; n < pipeline->n_filters; n++) {
+    if (!(filter_mask & (1u << n)))
+      return 1;
+  }
+  return 0;
+}
+
+int decode_filter(const struct chunk_filter_t *filter, size_t elem_size,
+                  size_t in_size, void *in_buffer, size_t out_size,
+                  void *out_buffer) {
+  int retval = 0;
+  switch (filter->id) {
+  case BS_H5_FILTER_ID:
+    retval =
+        bslz4_decompress(filter, in_size, in_buffer, out_size, out_buffer);
+    break;
+  case DEFLATE_H5_FILTER_ID:
+    retval = deflate_decompress(in_size, in_buffer, out_size, out_buffer);
+    break;
+  case LZ4_H5_FILTER_ID:
+    retval = lz4_decompress(in_size, in_buffer, out_size, out_buffer);
+    break;
+  case BLOSC_H5_FILTER_ID:
+    retval = blosc_decompress(in_size, in_buffer, out_size, out_buffer);
+    break;
+  case SHUFFLE_H5_FILTER_ID:
+    if (filter->n_params > 0)
+      elem_size = filter->params[0];
+    retval =
+        byte_unshuffle(elem_size, in_size, in_buffer, out_size, out_buffer);
+    break;
+  default: {
+    char message[64];
+    sprintf(message, "Unsupported filter %d", filter->id);
+    ERROR_JUMP(-1, done, message);
+  }
+  }
+done:
+  return retval;
+}
+
+int decode_chunk(const struct filter_pipeline_t *pipeline,
+                 unsigned int filter_mask, size_t elem_size, size_t in_size,
+                 void *in_buffer, size_t out_size, void *out_buffer) {
+  int retval = 0;
+  int n, last = -1;
+  void *in = in_buffer;
+  size_t in_bytes = in_size;
+  int stage = 0;
+
+  for (n = 0; n < pipeline->n_filters; n++) {
+    if (!(filter_mask & (1u << n))) {
+      last = n;
+      break;
+    }
+  }
+  if (last < 0) {
+    ERROR_JUMP(-1, done, "No filters to decode");
+  }
+
+  /* filters are undone in reverse order, every stage but the final one
+   * writing to alternating scratch buffers */
+  for (n = pipeline->n_filters - 1; n >= 0; n--) {
+    void *out;
+    if (filter_mask & (1u << n))
+      continue;
+    if (n == last) {
+      out = out_buffer;
+    } else {
+      out = get_scratch_buffer(stage++ % 2 ? SCRATCH_STAGE_B : SCRATCH_STAGE_A,
+                               out_size);
+      if (!out) {
+        ERROR_JUMP(-1, done, "Unable to allocate filter buffer");
+      }
     }
+    if (decode_filter(&pipeline->filters[n], elem_size, in_bytes, in,
+                      out_size, out) < 0) {
+      ERROR_JUMP(-1, done, "");
+    }
+    in = out;
+    in_bytes = out_size;
+  }
+
+done:
+  return retval;
+}
+
+int decode_chunk_to_int(const struct filter_pipeline_t *pipeline,
+                        unsigned int filter_mask, size_t elem_size,
+                        size_t in_size, void *in_buffer, size_t out_size,
+                        int *out_buffer, const struct pixel_mask_t *mask,
+                        const struct pixel_region_t *region) {
+  int retval = 0;
+  void *decoded;
+
+  /* bitshuffle alone is decoded a block at a time straight into the output */
+  if (pipeline->n_filters == 1 &&
+      pipeline->filters[0].id == BS_H5_FILTER_ID) {
+    retval = bslz4_decompress_to_int(&pipeline->filters[0], in_size,
+                                     in_buffer, out_size, out_buffer, mask,
+                                     region);
+    goto done;
+  }
+
+  decoded = get_scratch_buffer(SCRATCH_DECODED, out_size);
+  if (!decoded) {
+    ERROR_JUMP(-1, done, "Unable to allocate decoded chunk buffer");
+  }
+  if (decode_chunk(pipeline, filter_mask, elem_size, in_size, in_buffer,
+                   out_size, decoded) < 0) {
+    ERROR_JUMP(-1, done, "");
   }
+  retval = convert_and_mask_region(decoded, elem_size, out_buffer,
+                                   out_size / elem_size, region, mask);
 
 done:
   return retval;
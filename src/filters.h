@@ -6,11 +6,80 @@
 #ifndef NXS_XDS_FILTER_H
 #define NXS_XDS_FILTER_H
 
+#include <stddef.h>
+
+#include "convert.h"
+
 #define BS_H5_N_PARAMS 5
+/* the compression level follows the standard parameters for zstd */
+#define BS_H5_MAX_PARAMS 6
 #define BS_H5_FILTER_ID 32008
 #define BS_H5_PARAM_LZ4_COMPRESS 2
+#define BS_H5_PARAM_ZSTD_COMPRESS 3
+
+#define DEFLATE_H5_FILTER_ID 1
+#define SHUFFLE_H5_FILTER_ID 2
+#define LZ4_H5_FILTER_ID 32004
+#define BLOSC_H5_FILTER_ID 32001
+/* compressor codes in the parameters of the HDF5 Blosc filter */
+#define BLOSC_H5_PARAM_LEVEL 4
+#define BLOSC_H5_PARAM_COMPRESSOR 6
+#define BLOSC_H5_LZ4 1
+#define BLOSC_H5_LZ4HC 2
+#define BLOSC_H5_ZLIB 4
+#define BLOSC_H5_ZSTD 5
+
+#define CHUNK_MAX_FILTERS 4
+#define CHUNK_MAX_FILTER_PARAMS 8
+
+/* one filter of the HDF5 pipeline of a dataset */
+struct chunk_filter_t {
+  int id;
+  size_t n_params;
+  unsigned int params[CHUNK_MAX_FILTER_PARAMS];
+};
+
+/* filters in the order they were applied when the chunks were written */
+struct filter_pipeline_t {
+  int n_filters;
+  struct chunk_filter_t filters[CHUNK_MAX_FILTERS];
+};
 
-int bslz4_decompress(const unsigned int *bs_params, size_t in_size,
+/* non-zero if chunks with this filter can be decoded by the plugin */
+int is_supported_filter(const struct chunk_filter_t *filter);
+
+/* non-zero if both pipelines have the same filters with the same parameters */
+int same_pipeline(const struct filter_pipeline_t *a,
+                  const struct filter_pipeline_t *b);
+
+/* non-zero if any filter was applied to a chunk with the given filter mask */
+int pipeline_applied(const struct filter_pipeline_t *pipeline,
+                     unsigned int filter_mask);
+
+/* undo the filters applied to a chunk, producing out_size bytes of elements
+ * elem_size bytes wide */
+int decode_chunk(const struct filter_pipeline_t *pipeline,
+                 unsigned int filter_mask, size_t elem_size, size_t in_size,
+                 void *in_buffer, size_t out_size, void *out_buffer);
+
+/* decode a chunk then widen to int and mask, fusing the steps where the
+ * filters allow. If region is not NULL the chunk is a frame and only the
+ * pixels inside region are filled */
+int decode_chunk_to_int(const struct filter_pipeline_t *pipeline,
+                        unsigned int filter_mask, size_t elem_size,
+                        size_t in_size, void *in_buffer, size_t out_size,
+                        int *out_buffer, const struct pixel_mask_t *mask,
+                        const struct pixel_region_t *region);
+
+/* undo the bitshuffle filter, with or without compression */
+int bslz4_decompress(const struct chunk_filter_t *filter, size_t in_size,
                      void *in_buffer, size_t out_size, void *out_buffer);
 
+/* decompress, widen to int and mask one block at a time, avoiding writing
+ * the decompressed frame to memory. Blocks outside region are not decoded */
+int bslz4_decompress_to_int(const struct chunk_filter_t *filter,
+                            size_t in_size, void *in_buffer, size_t out_size,
+                            int *out_buffer, const struct pixel_mask_t *mask,
+                            const struct pixel_region_t *region);
+
 #endif /* NXS_XDS_FILTER_H */
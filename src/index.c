@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+/* required for pwrite, mkstemp and realpath */
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "err.h"
+#include "index.h"
+
+#define INDEX_MAGIC "DURINIDX"
+#define INDEX_VERSION 1
+/* bytes per chunk in a saved table - an offset, a size and a filter mask */
+#define INDEX_CHUNK_BYTES                                                      \
+  (sizeof(haddr_t) + sizeof(hsize_t) + sizeof(unsigned int))
+
+unsigned long long align_offset(unsigned long long offset) {
+  return (offset + 7) & ~7ULL;
+}
+
+/* the index of the master file at real_path is named by a hash of the path,
+ * which is checked against the path saved in the index when it is read */
+char *get_index_path(const char *real_path) {
+  const char *dir = getenv("DURIN_INDEX_DIR");
+  unsigned long long hash = 14695981039346656037ULL;
+  const unsigned char *c;
+  char *path;
+
+  if (!dir || dir[0] == '\0')
+    return NULL;
+  for (c = (const unsigned char *)real_path; *c; c++) {
+    hash = (hash ^ *c) * 1099511628211ULL;
+  }
+  path = malloc(strlen(dir) + 32);
+  if (path)
+    sprintf(path, "%s/%016llx.idx", dir, hash);
+  return path;
+}
+
+int get_file_mtime(const char *path, long long *mtime) {
+  struct stat st;
+  mtime[0] = 0;
+  mtime[1] = 0;
+  if (!path)
+    return 0;
+  if (stat(path, &st) < 0)
+    return -1;
+  mtime[0] = st.st_mtim.tv_sec;
+  mtime[1] = st.st_mtim.tv_nsec;
+  return 0;
+}
+
+/* non-zero if this build can decode chunks filtered by the pipeline, which
+ * may have been saved by a build with other decoders */
+int check_index_pipeline(const struct filter_pipeline_t *pipeline) {
+  int n;
+  if (pipeline->n_filters < 0 || pipeline->n_filters > CHUNK_MAX_FILTERS)
+    return 0;
+  for (n = 0; n < pipeline->n_filters; n++) {
+    const struct chunk_filter_t *filter = &pipeline->filters[n];
+    if (filter->n_params > CHUNK_MAX_FILTER_PARAMS ||
+        !is_supported_filter(filter))
+      return 0;
+  }
+  return 1;
+}
+
+/* non-zero if the mapped index is complete and describes the file at
+ * real_path as it is now */
+int check_data_index(const void *map, size_t size, const char *real_path) {
+  const struct index_header_t *header = map;
+  const struct index_block_t *blocks;
+  const char *path;
+  size_t length;
+  struct stat st;
+  int n;
+
+  if (size < sizeof(*header) ||
+      memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != INDEX_VERSION ||
+      header->header_size != sizeof(*header) || header->n_blocks < 1)
+    return 0;
+  if (header->path_offset >= size || header->blocks_offset % 8 != 0 ||
+      header->blocks_offset > size ||
+      (size - header->blocks_offset) / sizeof(*blocks) < header->n_blocks ||
+      header->mask_offset > size ||
+      size - header->mask_offset < header->mask_bytes)
+    return 0;
+  if (header->chunk_read && (!check_index_pipeline(&header->pipeline) ||
+                             header->frames_per_chunk < 1))
+    return 0;
+  path = (const char *)map + header->path_offset;
+  length = size - header->path_offset;
+  if (strnlen(path, length) == length || strcmp(path, real_path) != 0)
+    return 0;
+
+  blocks = (const void *)((const char *)map + header->blocks_offset);
+  for (n = 0; n < header->n_blocks; n++) {
+    const struct index_block_t *block = &blocks[n];
+    if (block->n_chunks > 0 &&
+        (block->table_offset % 8 != 0 || block->table_offset > size ||
+         (size - block->table_offset) / INDEX_CHUNK_BYTES < block->n_chunks))
+      return 0;
+  }
+
+  if (stat(real_path, &st) < 0)
+    return 0;
+  return st.st_size == header->master_size &&
+         st.st_mtim.tv_sec == header->master_mtime[0] &&
+         st.st_mtim.tv_nsec == header->master_mtime[1];
+}
+
+int open_data_index(const char *master_path, struct data_index_t **index) {
+  int retval = 0;
+  char *real_path = NULL;
+  char *index_path = NULL;
+  void *map = MAP_FAILED;
+  struct stat st;
+  int fd = -1;
+
+  *index = NULL;
+  real_path = realpath(master_path, NULL);
+  if (!real_path)
+    goto done;
+  index_path = get_index_path(real_path);
+  if (!index_path)
+    goto done;
+  fd = open(index_path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size <= 0)
+    goto done;
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED || !check_data_index(map, st.st_size, real_path))
+    goto done;
+
+  *index = malloc(sizeof(**index));
+  if (!*index)
+    goto done;
+  (*index)->map = map;
+  (*index)->map_size = st.st_size;
+  (*index)->header = map;
+  (*index)->blocks =
+      (const void *)((const char *)map + (*index)->header->blocks_offset);
+  map = MAP_FAILED;
+  retval = 1;
+
+done:
+  if (map != MAP_FAILED)
+    munmap(map, st.st_size);
+  if (fd >= 0)
+    close(fd);
+  free(index_path);
+  free(real_path);
+  return retval;
+}
+
+void close_data_index(struct data_index_t *index) {
+  if (!index)
+    return;
+  munmap(index->map, index->map_size);
+  free(index);
+}
+
+int read_index_mask(const struct data_index_t *index, int *buffer,
+                    size_t length) {
+  int retval = 0;
+  const struct index_header_t *header = index->header;
+  uLongf dest_len = length * sizeof(*buffer);
+  const Bytef *in = (const Bytef *)index->map + header->mask_offset;
+
+  if (!header->has_mask ||
+      uncompress((Bytef *)buffer, &dest_len, in, header->mask_bytes) != Z_OK ||
+      dest_len != length * sizeof(*buffer)) {
+    ERROR_JUMP(-1, done, "Error reading pixel mask from index");
+  }
+done:
+  return retval;
+}
+
+int read_index_chunk_table(const struct data_index_t *index, int n,
+                           struct chunk_table_t *table) {
+  const struct index_block_t *block;
+  const char *data;
+  hsize_t n_chunks = table->n_chunks;
+
+  if (n >= index->header->n_blocks)
+    return 0;
+  block = &index->blocks[n];
+  if (block->n_chunks != n_chunks ||
+      block->chunk_dims[0] != table->chunk_dims[0] ||
+      block->chunk_dims[1] != table->chunk_dims[1] ||
+      block->chunk_dims[2] != table->chunk_dims[2])
+    return 0;
+  data = (const char *)index->map + block->table_offset;
+  memcpy(table->offsets, data, n_chunks * sizeof(*table->offsets));
+  data += n_chunks * sizeof(*table->offsets);
+  memcpy(table->sizes, data, n_chunks * sizeof(*table->sizes));
+  data += n_chunks * sizeof(*table->sizes);
+  memcpy(table->filter_masks, data, n_chunks * sizeof(*table->filter_masks));
+  return 1;
+}
+
+int write_at(int fd, const void *data, size_t size, off_t offset) {
+  const char *next = data;
+  while (size > 0) {
+    ssize_t written = pwrite(fd, next, size, offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    next += written;
+    offset += written;
+    size -= written;
+  }
+  return 0;
+}
+
+/* the saved chunk table of block n of index, if it has one */
+const struct index_block_t *get_index_table(const struct data_index_t *index,
+                                            int n) {
+  if (!index || n >= index->header->n_blocks || !index->blocks[n].n_chunks)
+    return NULL;
+  return &index->blocks[n];
+}
+
+int write_data_index(const char *master_path,
+                     const struct index_header_t *header,
+                     const struct index_block_t *blocks,
+                     const struct data_block_t *data_blocks, const int *mask,
+                     const struct data_index_t *previous) {
+  int retval = 0;
+  char *real_path = NULL;
+  char *index_path = NULL;
+  char *temp_path = NULL;
+  Bytef *mask_bytes = NULL;
+  struct index_block_t *out_blocks = NULL;
+  struct index_header_t out;
+  struct stat st;
+  unsigned long long offset;
+  int fd = -1;
+  int n;
+
+  real_path = realpath(master_path, NULL);
+  if (!real_path) {
+    ERROR_JUMP(-1, done, "Unable to resolve master file path");
+  }
+  index_path = get_index_path(real_path);
+  if (!index_path)
+    goto done;
+
+  out = *header;
+  memcpy(out.magic, INDEX_MAGIC, sizeof(out.magic));
+  out.version = INDEX_VERSION;
+  out.header_size = sizeof(out);
+  if (stat(real_path, &st) < 0) {
+    ERROR_JUMP(-1, done, "Unable to read master file status");
+  }
+  out.master_size = st.st_size;
+  out.master_mtime[0] = st.st_mtim.tv_sec;
+  out.master_mtime[1] = st.st_mtim.tv_nsec;
+  out.path_offset = sizeof(out);
+  out.blocks_offset = align_offset(out.path_offset + strlen(real_path) + 1);
+  out.mask_offset = out.blocks_offset + out.n_blocks * sizeof(*blocks);
+
+  out.has_mask = mask != NULL;
+  out.mask_bytes = 0;
+  if (mask) {
+    uLong in_size = out.dims[1] * out.dims[2] * sizeof(*mask);
+    uLongf dest_len = compressBound(in_size);
+    mask_bytes = malloc(dest_len);
+    if (!mask_bytes) {
+      ERROR_JUMP(-1, done, "Unable to allocate index mask buffer");
+    }
+    if (compress2(mask_bytes, &dest_len, (const Bytef *)mask, in_size,
+                  Z_BEST_SPEED) != Z_OK) {
+      ERROR_JUMP(-1, done, "Error compressing pixel mask for index");
+    }
+    out.mask_bytes = dest_len;
+  }
+
+  /* chunk tables follow the mask for the blocks which have them, or had
+   * them in the previous index */
+  out_blocks = malloc(out.n_blocks * sizeof(*out_blocks));
+  if (!out_blocks) {
+    ERROR_JUMP(-1, done, "Unable to allocate index blocks");
+  }
+  offset = align_offset(out.mask_offset + out.mask_bytes);
+  for (n = 0; n < out.n_blocks; n++) {
+    const struct chunk_table_t *table = &data_blocks[n].chunks;
+    const struct index_block_t *kept = get_index_table(previous, n);
+    out_blocks[n] = blocks[n];
+    out_blocks[n].n_chunks = 0;
+    out_blocks[n].table_offset = 0;
+    memset(out_blocks[n].chunk_dims, 0, sizeof(out_blocks[n].chunk_dims));
+    if (table->offsets) {
+      out_blocks[n].n_chunks = table->n_chunks;
+      memcpy(out_blocks[n].chunk_dims, table->chunk_dims,
+             sizeof(table->chunk_dims));
+    } else if (kept) {
+      out_blocks[n].n_chunks = kept->n_chunks;
+      memcpy(out_blocks[n].chunk_dims, kept->chunk_dims,
+             sizeof(kept->chunk_dims));
+    } else {
+      continue;
+    }
+    out_blocks[n].table_offset = offset;
+    offset = align_offset(offset + out_blocks[n].n_chunks * INDEX_CHUNK_BYTES);
+  }
+
+  /* written alongside and renamed into place, so a reader never sees a
+   * partly written index */
+  temp_path = malloc(strlen(index_path) + 8);
+  if (!temp_path) {
+    ERROR_JUMP(-1, done, "Unable to allocate index file name");
+  }
+  sprintf(temp_path, "%s.XXXXXX", index_path);
+  fd = mkstemp(temp_path);
+  if (fd < 0) {
+    char message[256];
+    sprintf(message, "Unable to create index %.128s: %.64s", temp_path,
+            strerror(errno));
+    free(temp_path);
+    temp_path = NULL;
+    ERROR_JUMP(-1, done, message);
+  }
+  fchmod(fd, 0644);
+
+  if (write_at(fd, &out, sizeof(out), 0) < 0 ||
+      write_at(fd, real_path, strlen(real_path) + 1, out.path_offset) < 0 ||
+      write_at(fd, out_blocks, out.n_blocks * sizeof(*out_blocks),
+               out.blocks_offset) < 0 ||
+      (mask && write_at(fd, mask_bytes, out.mask_bytes, out.mask_offset) < 0)) {
+    ERROR_JUMP(-1, done, "Error writing index");
+  }
+  for (n = 0; n < out.n_blocks; n++) {
+    const struct chunk_table_t *table = &data_blocks[n].chunks;
+    const struct index_block_t *kept = get_index_table(previous, n);
+    hsize_t n_chunks = table->n_chunks;
+    offset = out_blocks[n].table_offset;
+    if (!table->offsets) {
+      if (kept &&
+          write_at(fd, (const char *)previous->map + kept->table_offset,
+                   kept->n_chunks * INDEX_CHUNK_BYTES, offset) < 0) {
+        ERROR_JUMP(-1, done, "Error writing index chunk table");
+      }
+      continue;
+    }
+    if (write_at(fd, table->offsets, n_chunks * sizeof(*table->offsets),
+                 offset) < 0 ||
+        write_at(fd, table->sizes, n_chunks * sizeof(*table->sizes),
+                 offset + n_chunks * sizeof(*table->offsets)) < 0 ||
+        write_at(fd, table->filter_masks,
+                 n_chunks * sizeof(*table->filter_masks),
+                 offset + n_chunks * (sizeof(*table->offsets) +
+                                      sizeof(*table->sizes))) < 0) {
+      ERROR_JUMP(-1, done, "Error writing index chunk table");
+    }
+  }
+
+  if (close(fd) < 0) {
+    fd = -1;
+    ERROR_JUMP(-1, done, "Error writing index");
+  }
+  fd = -1;
+  if (rename(temp_path, index_path) < 0) {
+    char message[256];
+    sprintf(message, "Unable to replace index %.128s: %.64s", index_path,
+            strerror(errno));
+    ERROR_JUMP(-1, done, message);
+  }
+  free(temp_path);
+  temp_path = NULL;
+
+done:
+  if (fd >= 0)
+    close(fd);
+  if (temp_path) {
+    unlink(temp_path);
+    free(temp_path);
+  }
+  free(out_blocks);
+  free(mask_bytes);
+  free(index_path);
+  free(real_path);
+  return retval;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#ifndef NXS_XDS_INDEX_H
+#define NXS_XDS_INDEX_H
+
+#include "file.h"
+#include "filters.h"
+
+/* A sidecar index of the layout of an Eiger data collection - the frame
+ * counts of the data files, how their chunks are filtered and where they
+ * lie, and the pixel mask - kept in the directory DURIN_INDEX_DIR so opening
+ * the master file again need not read the data files. The index is native
+ * endian and only used while the master file and every data file are
+ * unchanged since it was written. */
+
+struct index_header_t {
+  char magic[8];
+  unsigned int version;
+  unsigned int header_size;
+  unsigned long long master_size;
+  long long master_mtime[2];
+  unsigned long long dims[3];
+  int data_width;
+  int n_blocks;
+  /* non-zero if the plugin decodes the chunks itself, as described by the
+   * pipeline, frames_per_chunk and tile_size */
+  int chunk_read;
+  int has_mask;
+  struct filter_pipeline_t pipeline;
+  unsigned long long frames_per_chunk;
+  unsigned long long tile_size[2];
+  /* file offsets of the master file path, the blocks and the deflated mask */
+  unsigned long long path_offset;
+  unsigned long long blocks_offset;
+  unsigned long long mask_offset;
+  unsigned long long mask_bytes;
+};
+
+/* one data_%06d dataset. n_chunks is 0 if the chunk table was not known
+ * when the index was written */
+struct index_block_t {
+  long long mtime[2];
+  unsigned long long n_frames;
+  unsigned long long n_chunks;
+  unsigned long long chunk_dims[3];
+  unsigned long long table_offset;
+};
+
+struct data_index_t {
+  void *map;
+  size_t map_size;
+  const struct index_header_t *header;
+  const struct index_block_t *blocks;
+};
+
+/* map the index of the master file at master_path, if DURIN_INDEX_DIR is set
+ * and an index of the file as it is now exists. Returns 1 if *index was set
+ * and 0 otherwise - a missing or stale index is not an error */
+int open_data_index(const char *master_path, struct data_index_t **index);
+
+void close_data_index(struct data_index_t *index);
+
+/* modification time of the file at path, or zero if path is NULL */
+int get_file_mtime(const char *path, long long *mtime);
+
+/* fill the mask bits of a frame of length pixels from the index */
+int read_index_mask(const struct data_index_t *index, int *buffer,
+                    size_t length);
+
+/* copy the chunk locations of block n into table, whose arrays are already
+ * sized for table->n_chunks chunks. Returns 1 if copied and 0 if the index
+ * has no table of that shape for the block */
+int read_index_chunk_table(const struct data_index_t *index, int n,
+                           struct chunk_table_t *table);
+
+/* write the index of the master file at master_path, if DURIN_INDEX_DIR is
+ * set, replacing any index already there. header holds the layout and blocks
+ * the frame counts and data file times of the n_blocks data_blocks, whose
+ * chunk tables are saved where known, otherwise kept from previous if not
+ * NULL. mask may be NULL */
+int write_data_index(const char *master_path,
+                     const struct index_header_t *header,
+                     const struct index_block_t *blocks,
+                     const struct data_block_t *data_blocks, const int *mask,
+                     const struct data_index_t *previous);
+
+#endif /* NXS_XDS_INDEX_H */
@@ -3,54 +3,53 @@
  * Author: Charles Mita
  */
 
+#define _XOPEN_SOURCE 700
+
 #include <hdf5.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "cache.h"
+#include "convert.h"
+#include "durin.h"
+#include "env.h"
 #include "file.h"
 #include "filters.h"
 #include "plugin.h"
+#include "prefetch.h"
+#include "scratch.h"
+#include "workers.h"
+
+#define BATCH_MAX_THREADS 64
 
 /* XDS does not provide an error callback facility, so just write to stderr
    for now - generally regarded as poor practice */
 #define ERROR_OUTPUT stderr
 
-/* mask bits loosely based on what Neggia does and what NeXus says should be
-   done basically - anything in the low byte (& 0xFF) means "ignore this"
-   Neggia uses the value -2 if bit 1, 2 or 3 are set */
-#define COPY_AND_MASK(in, out, size, mask)                                     \
-  {                                                                            \
-    int i;                                                                     \
-    if (mask) {                                                                \
-      for (i = 0; i < size; ++i) {                                             \
-        out[i] = in[i];                                                        \
-        if (mask[i] & 0xFF)                                                    \
-          out[i] = -1;                                                         \
-        if (mask[i] & 30)                                                      \
-          out[i] = -2;                                                         \
-      }                                                                        \
-    } else {                                                                   \
-      for (i = 0; i < size; i++) {                                             \
-        out[i] = in[i];                                                        \
-      }                                                                        \
-    }                                                                          \
-  }
-
-#define APPLY_MASK(buffer, mask, size)                                         \
-  {                                                                            \
-    int i;                                                                     \
-    if (mask) {                                                                \
-      for (i = 0; i < size; ++i) {                                             \
-        if (mask[i] & 0xFF)                                                    \
-          buffer[i] = -1;                                                      \
-        if (mask[i] & 30)                                                      \
-          buffer[i] = -2;                                                      \
-      }                                                                        \
-    }                                                                          \
-  }
-
 static hid_t file_id = 0;
 static struct ds_desc_t *data_desc = NULL;
-static int *mask_buffer = NULL;
+static struct pixel_mask_t pixel_mask = {NULL, NULL, 0};
+static struct pixel_mask_t *mask = NULL;
+static struct prefetcher_t *prefetcher = NULL;
+static struct frame_cache_t *frame_cache = NULL;
+static struct worker_pool_t *batch_pool = NULL;
+/* frames are cropped to the region of interest, if set, leaving frame_nx by
+ * frame_ny pixels */
+static struct pixel_region_t roi;
+static struct pixel_region_t *region = NULL;
+static int frame_nx = 0;
+static int frame_ny = 0;
+/* each image presented to the caller is the sum of sum_frames frames */
+static int sum_frames = 1;
+static int n_images = 0;
+/* and is binned by bin_size pixels in each direction to image_nx by
+ * image_ny pixels */
+static int bin_size = 1;
+static int image_nx = 0;
+static int image_ny = 0;
+static pthread_mutex_t batch_pool_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void fill_info_array(int info[1024]) {
   info[0] = DLS_CUSTOMER_ID;
@@ -60,44 +59,239 @@ void fill_info_array(int info[1024]) {
   info[4] = VERSION_TIMESTAMP;
 }
 
-int convert_to_int_and_mask(void *in_buffer, int d_width, int *out_buffer,
-                            int length, int *mask) {
-  /* transfer data to output buffer, performing data conversion as required */
+/* bytes per pixel of the images presented to the caller - summed or binned
+ * images can exceed the range of the detector's data type */
+static int image_width() {
+  if (sum_frames > 1 || bin_size > 1)
+    return sizeof(int);
+  return data_desc->data_width;
+}
+
+/* read frame n (counting from 0) as masked int data, cropped to the region of
+ * interest */
+static int read_frame_int(int n, int *data_array) {
   int retval = 0;
-  /* TODO: decide how conversion of data should work */
-  /* Should we sign extend? Neggia doesn't (casts from uint*), but may be more
-   * intuitive */
-  if (d_width == sizeof(signed char)) {
-    signed char *in = in_buffer;
-    COPY_AND_MASK(in, out_buffer, length, mask);
-  } else if (d_width == sizeof(short)) {
-    short *in = in_buffer;
-    COPY_AND_MASK(in, out_buffer, length, mask);
-  } else if (d_width == sizeof(int)) {
-    int *in = in_buffer;
-    COPY_AND_MASK(in, out_buffer, length, mask);
-  } else if (d_width == sizeof(long int)) {
-    long int *in = in_buffer;
-    COPY_AND_MASK(in, out_buffer, length, mask);
-  } else if (d_width == sizeof(long long int)) {
-    long long int *in = in_buffer;
-    COPY_AND_MASK(in, out_buffer, length, mask);
+  int frame_size_px = data_desc->dims[1] * data_desc->dims[2];
+  int row;
+  void *buffer = NULL;
+
+  if (data_desc->get_data_frame_int) {
+    int *frame = data_array;
+    if (region) {
+      frame = get_scratch_buffer(SCRATCH_CROP, frame_size_px * sizeof(*frame));
+      if (!frame) {
+        ERROR_JUMP(-1, done, "Unable to allocate frame buffer");
+      }
+    }
+    if (data_desc->get_data_frame_int(data_desc, n, frame, mask, region) < 0) {
+      char message[64] = {0};
+      sprintf(message, "Failed to retrieve data for frame %d", n + 1);
+      ERROR_JUMP(-2, done, message);
+    }
+    if (region) {
+      for (row = 0; row < frame_ny; row++) {
+        memcpy(data_array + row * frame_nx,
+               frame + (roi.y0 + row) * roi.width + roi.x0,
+               frame_nx * sizeof(*frame));
+      }
+    }
+    goto done;
+  }
+
+  if (sizeof(*data_array) == data_desc->data_width && !region) {
+    buffer = data_array;
+  } else {
+    buffer = get_scratch_buffer(SCRATCH_FRAME,
+                                data_desc->data_width * frame_size_px);
+    if (!buffer) {
+      ERROR_JUMP(-1, done, "Unable to allocate data buffer");
+    }
+  }
+
+  if (data_desc->get_data_frame(data_desc, n, buffer) < 0) {
+    char message[64] = {0};
+    sprintf(message, "Failed to retrieve data for frame %d", n + 1);
+    ERROR_JUMP(-2, done, message);
+  }
+
+  if (region) {
+    for (row = 0; row < frame_ny; row++) {
+      int offset = (roi.y0 + row) * roi.width + roi.x0;
+      if (convert_and_mask_pixels(
+              (char *)buffer + offset * data_desc->data_width,
+              data_desc->data_width, data_array + row * frame_nx, offset,
+              frame_nx, mask) < 0) {
+        char message[64];
+        sprintf(message, "Error converting data for frame %d", n + 1);
+        ERROR_JUMP(-2, done, message);
+      }
+    }
+  } else if (buffer != data_array) {
+    if (convert_and_mask_pixels(buffer, data_desc->data_width, data_array, 0,
+                                frame_size_px, mask) < 0) {
+      char message[64];
+      sprintf(message, "Error converting data for frame %d", n + 1);
+      ERROR_JUMP(-2, done, message);
+    }
   } else {
-    char message[128];
-    sprintf(message, "Unsupported conversion of data width %d to %ld (int)",
-            d_width, sizeof(int));
+    apply_pixel_mask(data_array, mask, 0, frame_size_px);
+  }
+
+done:
+  return retval;
+}
+
+/* frame n from the frame cache or read-ahead if there, otherwise read now */
+static int get_frame(int n, int *data_array) {
+  int retval = 0;
+
+  if (frame_cache && get_cached_frame(frame_cache, n, data_array))
+    return 0;
+  if (!prefetcher || !prefetch_frame(prefetcher, n, data_array)) {
+    retval = read_frame_int(n, data_array);
+  }
+  if (frame_cache && retval == 0) {
+    put_cached_frame(frame_cache, n, data_array);
+  }
+  return retval;
+}
+
+/* the sum of the frames making up image n */
+static int get_summed_frame(int n, int *data_array) {
+  int retval = 0;
+  int frame_size_px = frame_nx * frame_ny;
+  int k;
+  int *frame;
+
+  retval = get_frame(n * sum_frames, data_array);
+  if (retval < 0 || sum_frames == 1)
+    goto done;
+
+  frame = get_scratch_buffer(SCRATCH_SUM, frame_size_px * sizeof(*frame));
+  if (!frame) {
+    ERROR_JUMP(-1, done, "Unable to allocate frame summation buffer");
+  }
+  for (k = 1; k < sum_frames; k++) {
+    retval = get_frame(n * sum_frames + k, frame);
+    if (retval < 0)
+      goto done;
+    accumulate_frame(data_array, frame, frame_size_px);
+  }
+
+done:
+  return retval;
+}
+
+/* image n (counting from 0) as presented to the caller */
+static int get_image(int n, int *data_array) {
+  int retval = 0;
+  int *frame = data_array;
+
+  if (bin_size > 1) {
+    frame =
+        get_scratch_buffer(SCRATCH_BIN, frame_nx * frame_ny * sizeof(*frame));
+    if (!frame) {
+      ERROR_JUMP(-1, done, "Unable to allocate binning buffer");
+    }
+  }
+  retval = get_summed_frame(n, frame);
+  if (retval < 0 || bin_size == 1)
+    goto done;
+  bin_frame(frame, frame_nx, bin_size, image_nx, image_ny, data_array);
+
+done:
+  return retval;
+}
+
+/* a run of consecutive images being read together */
+struct batch_args_t {
+  int first_image;
+  int *data_array;
+};
+
+/* read image first_image + n of a batch into its place in the output */
+static int read_batch_image(void *arg, int n) {
+  const struct batch_args_t *args = arg;
+  int *data_array =
+      args->data_array + (size_t)n * image_nx * image_ny;
+  return get_image(args->first_image + n, data_array);
+}
+
+/* threads reading the frames of a batch, started on the first batch read */
+static struct worker_pool_t *get_batch_pool() {
+  pthread_mutex_lock(&batch_pool_lock);
+  if (!batch_pool) {
+    long n_threads =
+        get_env_long("DURIN_BATCH_THREADS", sysconf(_SC_NPROCESSORS_ONLN));
+    if (n_threads > BATCH_MAX_THREADS)
+      n_threads = BATCH_MAX_THREADS;
+    if (n_threads > 1 && create_worker_pool(n_threads - 1, &batch_pool) < 0) {
+      fprintf(ERROR_OUTPUT, "WARNING: Could not start batch reading threads "
+                            "- frames will be read serially\n");
+      dump_error_stack(ERROR_OUTPUT);
+      reset_error_stack();
+    }
+  }
+  pthread_mutex_unlock(&batch_pool_lock);
+  return batch_pool;
+}
+
+/* read count images from first_image (counting from 0) as masked int data,
+ * one after another in data_array */
+static int read_images(int first_image, int count, int *data_array) {
+  int retval = 0;
+  int n = 0;
+  struct worker_pool_t *pool;
+  struct batch_args_t args = {first_image, data_array};
+
+  if (!data_desc) {
+    ERROR_JUMP(-1, done, "No file is open");
+  }
+  if (count < 1 || first_image < 0 || first_image > n_images ||
+      count > n_images - first_image) {
+    char message[96];
+    sprintf(message, "Frames %d to %d are outside the valid range [1, %d]",
+            first_image + 1, first_image + count, n_images);
     ERROR_JUMP(-1, done, message);
   }
+
+  pool = count > 1 ? get_batch_pool() : NULL;
+  if (pool) {
+    retval = run_worker_tasks(pool, count, &read_batch_image, &args, &n);
+  } else {
+    for (n = 0; n < count; n++) {
+      if ((retval = read_batch_image(&args, n)) < 0)
+        break;
+    }
+  }
+  if (retval < 0) {
+    char message[64];
+    sprintf(message, "Error reading image %d", first_image + n + 1);
+    ERROR_JUMP(-2, done, message);
+  }
+
 done:
   return retval;
 }
 
+/* save the sidecar index, if enabled - failing to is not an error */
+static void save_index(const int *mask_buffer) {
+  if (save_detector_index(data_desc, mask_buffer) < 0) {
+    fprintf(ERROR_OUTPUT,
+            "WARNING: Could not save the index of the data files\n");
+    dump_error_stack(ERROR_OUTPUT);
+    reset_error_stack();
+  }
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 void plugin_open(const char *filename, int info[1024], int *error_flag) {
   int retval = 0;
+  int *mask_buffer = NULL;
+  long roi_values[4];
   *error_flag = 0;
 
   init_error_handling();
@@ -136,6 +330,90 @@ void plugin_open(const char *filename, int info[1024], int *error_flag) {
       mask_buffer = NULL;
     }
   }
+  /* later opens of the same collection can skip reading the data files */
+  save_index(mask_buffer);
+  /* the mask is only needed as runs of masked pixels in most cases, which
+   * is far smaller than a full frame of mask bits */
+  if (mask_buffer) {
+    retval = build_pixel_mask(
+        mask_buffer, data_desc->dims[1] * data_desc->dims[2], &pixel_mask);
+    if (retval < 0) {
+      fprintf(
+          ERROR_OUTPUT,
+          "WARNING: Could not build pixel mask - no masking will be applied\n");
+      dump_error_stack(ERROR_OUTPUT);
+      free(mask_buffer);
+    } else {
+      mask = &pixel_mask;
+    }
+  }
+
+  sum_frames = get_env_long("DURIN_SUM_FRAMES", 1);
+  if (sum_frames < 1 || sum_frames > data_desc->dims[0]) {
+    fprintf(ERROR_OUTPUT,
+            "WARNING: Cannot sum %d of %d frames - frames will not be "
+            "summed\n",
+            sum_frames, (int)data_desc->dims[0]);
+    sum_frames = 1;
+  }
+  n_images = data_desc->dims[0] / sum_frames;
+  if (n_images * sum_frames < data_desc->dims[0]) {
+    fprintf(ERROR_OUTPUT,
+            "WARNING: Ignoring the last %d frames, which do not make up a "
+            "whole image\n",
+            (int)data_desc->dims[0] - n_images * sum_frames);
+  }
+
+  frame_nx = data_desc->dims[2];
+  frame_ny = data_desc->dims[1];
+  if (get_env_longs("DURIN_ROI", 4, roi_values) > 0) {
+    if (roi_values[0] < 0 || roi_values[1] < 0 || roi_values[2] < 1 ||
+        roi_values[3] < 1 || roi_values[0] + roi_values[2] > frame_nx ||
+        roi_values[1] + roi_values[3] > frame_ny) {
+      fprintf(ERROR_OUTPUT,
+              "WARNING: Region of interest %ld,%ld,%ld,%ld is not within "
+              "the %d x %d frame - frames will not be cropped\n",
+              roi_values[0], roi_values[1], roi_values[2], roi_values[3],
+              frame_nx, frame_ny);
+    } else {
+      roi.width = frame_nx;
+      roi.x0 = roi_values[0];
+      roi.x1 = roi_values[0] + roi_values[2];
+      roi.y0 = roi_values[1];
+      roi.y1 = roi_values[1] + roi_values[3];
+      region = &roi;
+      frame_nx = roi_values[2];
+      frame_ny = roi_values[3];
+    }
+  }
+
+  bin_size = get_env_long("DURIN_BIN", 1);
+  if (bin_size < 1 || bin_size > frame_ny || bin_size > frame_nx) {
+    fprintf(ERROR_OUTPUT,
+            "WARNING: Cannot bin %d x %d pixels - frames will not be binned\n",
+            bin_size, bin_size);
+    bin_size = 1;
+  }
+  image_nx = frame_nx / bin_size;
+  image_ny = frame_ny / bin_size;
+
+  retval = create_frame_cache(data_desc->dims[0], frame_nx * frame_ny,
+                              &frame_cache);
+  if (retval < 0) {
+    fprintf(ERROR_OUTPUT,
+            "WARNING: Could not create frame cache - frames will not be "
+            "cached\n");
+    dump_error_stack(ERROR_OUTPUT);
+  }
+
+  retval = create_prefetcher(&read_frame_int, data_desc->dims[0],
+                             frame_nx * frame_ny, &prefetcher);
+  if (retval < 0) {
+    fprintf(ERROR_OUTPUT,
+            "WARNING: Could not start prefetching - frames will be read on "
+            "request\n");
+    dump_error_stack(ERROR_OUTPUT);
+  }
   retval = 0;
 
 done:
@@ -163,12 +441,12 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy,
     ERROR_JUMP(err, done, "Failed to retrieve pixel information");
   }
 
-  *nx = data_desc->dims[2];
-  *ny = data_desc->dims[1];
-  *nbytes = data_desc->data_width;
-  *number_of_frames = data_desc->dims[0];
-  *qx = (float)x_pixel_size;
-  *qy = (float)y_pixel_size;
+  *nx = image_nx;
+  *ny = image_ny;
+  *nbytes = image_width();
+  *number_of_frames = n_images;
+  *qx = (float)(x_pixel_size * bin_size);
+  *qy = (float)(y_pixel_size * bin_size);
 
 done:
   *error_flag = retval;
@@ -181,47 +459,66 @@ void plugin_get_data(int *frame_number, int *nx, int *ny, int *data_array,
                      int info[1024], int *error_flag) {
 
   int retval = 0;
-  int frame_size_px = data_desc->dims[1] * data_desc->dims[2];
   reset_error_stack();
   fill_info_array(info);
 
-  void *buffer = NULL;
-  if (sizeof(*data_array) == data_desc->data_width) {
-    buffer = data_array;
-  } else {
-    buffer = malloc(data_desc->data_width * frame_size_px);
-    if (!buffer) {
-      ERROR_JUMP(-1, done, "Unable to allocate data buffer");
-    }
+  if (*frame_number < 1 || *frame_number > n_images) {
+    char message[64];
+    sprintf(message, "Frame %d is outside the valid range [1, %d]",
+            *frame_number, n_images);
+    ERROR_JUMP(-2, done, message);
   }
+  retval = get_image((*frame_number) - 1, data_array);
 
-  if (data_desc->get_data_frame(data_desc, (*frame_number) - 1, buffer) < 0) {
-    char message[64] = {0};
-    sprintf(message, "Failed to retrieve data for frame %d", *frame_number);
-    ERROR_JUMP(-2, done, message);
+done:
+  *error_flag = retval;
+  if (retval < 0) {
+    dump_error_stack(ERROR_OUTPUT);
   }
+}
 
-  if (buffer != data_array) {
-    if (convert_to_int_and_mask(buffer, data_desc->data_width, data_array,
-                                frame_size_px, mask_buffer) < 0) {
-      char message[64];
-      sprintf(message, "Error converting data for frame %d", *frame_number);
-      ERROR_JUMP(-2, done, message);
-    }
-  } else {
-    APPLY_MASK(data_array, mask_buffer, frame_size_px);
+void plugin_get_data_batch(int *first_frame, int *count, int *nx, int *ny,
+                           int *data_array, int info[1024], int *error_flag) {
+  int retval = 0;
+  reset_error_stack();
+  fill_info_array(info);
+
+  if (data_desc && (*nx != image_nx || *ny != image_ny)) {
+    char message[96];
+    sprintf(message, "Requested frame size %d x %d does not match the data",
+            *nx, *ny);
+    ERROR_JUMP(-1, done, message);
   }
+  retval = read_images((*first_frame) - 1, *count, data_array);
 
 done:
   *error_flag = retval;
   if (retval < 0) {
     dump_error_stack(ERROR_OUTPUT);
   }
-  if (buffer && (buffer != data_array))
-    free(buffer);
 }
 
 void plugin_close(int *error_flag) {
+  /* stop the workers before anything they read from is closed */
+  if (batch_pool) {
+    free_worker_pool(batch_pool);
+    batch_pool = NULL;
+  }
+  if (prefetcher) {
+    free_prefetcher(prefetcher);
+    prefetcher = NULL;
+  }
+  /* add the chunk tables of the data files read since opening */
+  if (data_desc)
+    save_index(NULL);
+  if (frame_cache) {
+    unsigned long hits, misses;
+    get_frame_cache_stats(frame_cache, &hits, &misses);
+    fprintf(ERROR_OUTPUT, "Frame cache: %lu hits, %lu misses\n", hits,
+            misses);
+    free_frame_cache(frame_cache);
+    frame_cache = NULL;
+  }
   if (file_id) {
     if (H5Fclose(file_id) < 0) {
       /* TODO: backtrace */
@@ -230,10 +527,11 @@ void plugin_close(int *error_flag) {
   }
   file_id = 0;
 
-  if (mask_buffer) {
-    free(mask_buffer);
-    mask_buffer = NULL;
+  if (mask) {
+    free_pixel_mask(mask);
+    mask = NULL;
   }
+  region = NULL;
   if (data_desc->free_desc) {
     data_desc->free_desc(data_desc);
     data_desc = NULL;
@@ -243,6 +541,56 @@ void plugin_close(int *error_flag) {
   }
 }
 
+int durin_open(const char *filename) {
+  int info[1024];
+  int error_flag = 0;
+  plugin_open(filename, info, &error_flag);
+  return error_flag;
+}
+
+int durin_get_dims(int *n_frames, int *ny, int *nx, int *data_width) {
+  if (!data_desc)
+    return -1;
+  *n_frames = n_images;
+  *ny = image_ny;
+  *nx = image_nx;
+  *data_width = image_width();
+  return 0;
+}
+
+int durin_get_pixel_size(double *x_size, double *y_size) {
+  int retval = 0;
+  reset_error_stack();
+  if (!data_desc) {
+    ERROR_JUMP(-1, done, "No file is open");
+  }
+  if (data_desc->get_pixel_properties(data_desc, x_size, y_size) < 0) {
+    ERROR_JUMP(-1, done, "Failed to retrieve pixel information");
+  }
+  *x_size *= bin_size;
+  *y_size *= bin_size;
+done:
+  if (retval < 0)
+    dump_error_stack(ERROR_OUTPUT);
+  return retval;
+}
+
+int durin_read_frames(int first_frame, int count, int *data) {
+  int retval;
+  reset_error_stack();
+  retval = read_images(first_frame, count, data);
+  if (retval < 0)
+    dump_error_stack(ERROR_OUTPUT);
+  return retval;
+}
+
+int durin_close() {
+  int error_flag = 0;
+  if (data_desc)
+    plugin_close(&error_flag);
+  return error_flag;
+}
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -30,6 +30,11 @@ void plugin_get_header(int *nx, int *ny, int *nbytes, float *qx, float *qy,
 void plugin_get_data(int *frame_number, int *nx, int *ny, int *data_array,
                      int info[1024], int *error_flag);
 
+/* read count frames starting from first_frame (counting from 1), each nx * ny
+ * pixels, one after another into data_array. Not part of the XDS interface */
+void plugin_get_data_batch(int *first_frame, int *count, int *nx, int *ny,
+                           int *data_array, int info[1024], int *error_flag);
+
 void plugin_close(int *error_flag);
 
 #ifdef __cplusplus
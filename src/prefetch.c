@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "env.h"
+#include "err.h"
+#include "prefetch.h"
+
+#define PREFETCH_DEFAULT_MB 512
+#define PREFETCH_DEFAULT_THREADS 2
+#define PREFETCH_MAX_THREADS 64
+
+enum slot_state_t {
+  SLOT_EMPTY,
+  SLOT_QUEUED,  /* waiting for a worker */
+  SLOT_LOADING, /* being read by a worker */
+  SLOT_READY,
+  SLOT_COPYING, /* being copied out to a caller */
+  SLOT_FAILED
+};
+
+struct prefetch_slot_t {
+  int frame;
+  enum slot_state_t state;
+  unsigned long ticket; /* request count when the slot was last touched */
+  int *buffer;
+};
+
+struct prefetcher_t {
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t ready_cond;
+  struct prefetch_slot_t *slots;
+  int n_slots;
+  pthread_t *workers;
+  int n_workers;
+  int stop;
+  int depth;
+  int n_frames;
+  size_t frame_size_px;
+  unsigned long ticket;
+  prefetch_read_func read_frame;
+};
+
+/* access pattern of one calling thread */
+struct access_pattern_t {
+  int last;
+  int stride;
+  int repeats;
+};
+
+static pthread_key_t pattern_key;
+static pthread_once_t pattern_once = PTHREAD_ONCE_INIT;
+static int pattern_key_valid = 0;
+
+static void create_pattern_key() {
+  pattern_key_valid = pthread_key_create(&pattern_key, &free) == 0;
+}
+
+static struct access_pattern_t *get_access_pattern() {
+  struct access_pattern_t *pattern;
+  pthread_once(&pattern_once, &create_pattern_key);
+  if (!pattern_key_valid)
+    return NULL;
+  pattern = pthread_getspecific(pattern_key);
+  if (!pattern) {
+    pattern = calloc(1, sizeof(*pattern));
+    if (!pattern)
+      return NULL;
+    pattern->last = -1;
+    if (pthread_setspecific(pattern_key, pattern) != 0) {
+      free(pattern);
+      return NULL;
+    }
+  }
+  return pattern;
+}
+
+static int find_slot(const struct prefetcher_t *pf, int frame) {
+  int idx;
+  for (idx = 0; idx < pf->n_slots; idx++) {
+    if (pf->slots[idx].state != SLOT_EMPTY && pf->slots[idx].frame == frame)
+      return idx;
+  }
+  return -1;
+}
+
+/* an empty slot, or failing that the oldest slot nobody has asked for within
+ * the last n_slots requests */
+static int claim_slot(const struct prefetcher_t *pf) {
+  int idx, oldest = -1;
+  for (idx = 0; idx < pf->n_slots; idx++) {
+    const struct prefetch_slot_t *slot = &pf->slots[idx];
+    if (slot->state == SLOT_EMPTY)
+      return idx;
+    if (slot->state == SLOT_LOADING || slot->state == SLOT_COPYING)
+      continue;
+    if (oldest < 0 || slot->ticket < pf->slots[oldest].ticket)
+      oldest = idx;
+  }
+  if (oldest >= 0 && pf->slots[oldest].ticket + pf->n_slots < pf->ticket)
+    return oldest;
+  return -1;
+}
+
+/* queue the frames expected to follow n for this thread - lock must be held */
+static void schedule_frames(struct prefetcher_t *pf, int n) {
+  struct access_pattern_t *pattern = get_access_pattern();
+  int stride, k, idx;
+  if (!pattern)
+    return;
+
+  stride = n - pattern->last;
+  if (stride != 0 && stride == pattern->stride) {
+    pattern->repeats++;
+  } else {
+    pattern->stride = stride;
+    pattern->repeats = 0;
+  }
+  pattern->last = n;
+  if (pattern->repeats < 1)
+    return;
+
+  for (k = 1; k <= pf->depth; k++) {
+    int frame = n + k * stride;
+    if (frame < 0 || frame >= pf->n_frames)
+      break;
+    idx = find_slot(pf, frame);
+    if (idx >= 0) {
+      pf->slots[idx].ticket = pf->ticket;
+      continue;
+    }
+    idx = claim_slot(pf);
+    if (idx < 0)
+      break;
+    pf->slots[idx].frame = frame;
+    pf->slots[idx].state = SLOT_QUEUED;
+    pf->slots[idx].ticket = pf->ticket;
+    pthread_cond_signal(&pf->work_cond);
+  }
+}
+
+static void *prefetch_worker(void *arg) {
+  struct prefetcher_t *pf = arg;
+  pthread_mutex_lock(&pf->lock);
+  while (!pf->stop) {
+    int idx, next = -1;
+    int err = 0;
+    struct prefetch_slot_t *slot;
+    for (idx = 0; idx < pf->n_slots; idx++) {
+      if (pf->slots[idx].state == SLOT_QUEUED &&
+          (next < 0 || pf->slots[idx].ticket < pf->slots[next].ticket))
+        next = idx;
+    }
+    if (next < 0) {
+      pthread_cond_wait(&pf->work_cond, &pf->lock);
+      continue;
+    }
+
+    slot = &pf->slots[next];
+    slot->state = SLOT_LOADING;
+    pthread_mutex_unlock(&pf->lock);
+
+    if (!slot->buffer)
+      slot->buffer = malloc(pf->frame_size_px * sizeof(*slot->buffer));
+    if (slot->buffer)
+      err = pf->read_frame(slot->frame, slot->buffer);
+    /* a failed frame is read again by the caller, which reports any error,
+     * so the trace left on this thread's error stack is not needed */
+    if (err < 0)
+      reset_error_stack();
+
+    pthread_mutex_lock(&pf->lock);
+    slot->state = (slot->buffer && err >= 0) ? SLOT_READY : SLOT_FAILED;
+    pthread_cond_broadcast(&pf->ready_cond);
+  }
+  pthread_mutex_unlock(&pf->lock);
+  return NULL;
+}
+
+int create_prefetcher(prefetch_read_func read_frame, int n_frames,
+                      size_t frame_size_px, struct prefetcher_t **prefetcher) {
+  int retval = 0;
+  long depth = get_env_long("DURIN_PREFETCH_FRAMES", 0);
+  long budget_mb = get_env_long("DURIN_PREFETCH_MB", PREFETCH_DEFAULT_MB);
+  long n_workers =
+      get_env_long("DURIN_PREFETCH_THREADS", PREFETCH_DEFAULT_THREADS);
+  size_t n_slots;
+  struct prefetcher_t *pf = NULL;
+
+  *prefetcher = NULL;
+  if (depth <= 0)
+    goto done;
+
+  if (budget_mb <= 0 || n_workers <= 0 || n_workers > PREFETCH_MAX_THREADS) {
+    ERROR_JUMP(-1, done, "Invalid prefetch memory budget or thread count");
+  }
+  n_slots = ((size_t)budget_mb << 20) / (frame_size_px * sizeof(int));
+  if (n_slots == 0) {
+    ERROR_JUMP(-1, done, "Prefetch memory budget is smaller than one frame");
+  }
+  if (n_slots > (size_t)n_frames)
+    n_slots = n_frames;
+
+  pf = calloc(1, sizeof(*pf));
+  if (!pf) {
+    ERROR_JUMP(-1, done, "Unable to allocate prefetcher");
+  }
+  pthread_mutex_init(&pf->lock, NULL);
+  pthread_cond_init(&pf->work_cond, NULL);
+  pthread_cond_init(&pf->ready_cond, NULL);
+  pf->slots = calloc(n_slots, sizeof(*pf->slots));
+  pf->workers = calloc(n_workers, sizeof(*pf->workers));
+  if (!pf->slots || !pf->workers) {
+    ERROR_JUMP(-1, done, "Unable to allocate prefetcher");
+  }
+  pf->n_slots = n_slots;
+  pf->depth = depth;
+  pf->n_frames = n_frames;
+  pf->frame_size_px = frame_size_px;
+  pf->read_frame = read_frame;
+
+  for (pf->n_workers = 0; pf->n_workers < n_workers; pf->n_workers++) {
+    if (pthread_create(&pf->workers[pf->n_workers], NULL, &prefetch_worker,
+                       pf) != 0) {
+      ERROR_JUMP(-1, done, "Unable to start prefetch threads");
+    }
+  }
+  *prefetcher = pf;
+
+done:
+  if (retval < 0 && pf)
+    free_prefetcher(pf);
+  return retval;
+}
+
+int prefetch_frame(struct prefetcher_t *pf, int n, int *buffer) {
+  int idx;
+  int found = 0;
+  struct prefetch_slot_t *slot = NULL;
+
+  pthread_mutex_lock(&pf->lock);
+  pf->ticket++;
+  idx = find_slot(pf, n);
+  if (idx >= 0) {
+    slot = &pf->slots[idx];
+    while (slot->state == SLOT_LOADING || slot->state == SLOT_COPYING)
+      pthread_cond_wait(&pf->ready_cond, &pf->lock);
+    if (slot->frame == n && slot->state == SLOT_READY) {
+      slot->state = SLOT_COPYING;
+      found = 1;
+    } else if (slot->frame == n) {
+      /* queued or failed - the caller reads it now */
+      slot->state = SLOT_EMPTY;
+    }
+  }
+  schedule_frames(pf, n);
+  pthread_mutex_unlock(&pf->lock);
+
+  if (found) {
+    memcpy(buffer, slot->buffer, pf->frame_size_px * sizeof(*buffer));
+    pthread_mutex_lock(&pf->lock);
+    slot->state = SLOT_EMPTY;
+    pthread_cond_broadcast(&pf->ready_cond);
+    pthread_mutex_unlock(&pf->lock);
+  }
+  return found;
+}
+
+void free_prefetcher(struct prefetcher_t *pf) {
+  int idx;
+  pthread_mutex_lock(&pf->lock);
+  pf->stop = 1;
+  pthread_cond_broadcast(&pf->work_cond);
+  pthread_mutex_unlock(&pf->lock);
+  for (idx = 0; idx < pf->n_workers; idx++) {
+    pthread_join(pf->workers[idx], NULL);
+  }
+
+  for (idx = 0; idx < pf->n_slots; idx++) {
+    free(pf->slots[idx].buffer);
+  }
+  pthread_cond_destroy(&pf->ready_cond);
+  pthread_cond_destroy(&pf->work_cond);
+  pthread_mutex_destroy(&pf->lock);
+  free(pf->workers);
+  free(pf->slots);
+  free(pf);
+}
@@ -0,0 +1,32 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#ifndef NXS_XDS_PREFETCH_H
+#define NXS_XDS_PREFETCH_H
+
+#include <stddef.h>
+
+/* Background read-ahead of frames. The stride between successive requests
+ * is tracked for each calling thread, and once it repeats the following
+ * frames along that stride are read by worker threads into a fixed ring of
+ * frame buffers bounded by a memory budget. */
+struct prefetcher_t;
+
+/* reads frame n (counting from 0) as masked int data into buffer */
+typedef int (*prefetch_read_func)(int n, int *buffer);
+
+/* start a prefetcher if enabled by the environment, otherwise *prefetcher is
+ * set to NULL */
+int create_prefetcher(prefetch_read_func read_frame, int n_frames,
+                      size_t frame_size_px, struct prefetcher_t **prefetcher);
+
+/* copy frame n into buffer if it has been prefetched, waiting for it if it is
+ * being read, and schedule the frames predicted to follow it. Returns 1 if the
+ * buffer was filled, otherwise 0 and the caller must read the frame itself */
+int prefetch_frame(struct prefetcher_t *prefetcher, int n, int *buffer);
+
+void free_prefetcher(struct prefetcher_t *prefetcher);
+
+#endif /* NXS_XDS_PREFETCH_H */
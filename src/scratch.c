@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "scratch.h"
+
+struct scratch_t {
+  void *buffers[SCRATCH_N_SLOTS];
+  size_t sizes[SCRATCH_N_SLOTS];
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static int scratch_key_valid = 0;
+
+static void free_scratch(void *arg) {
+  struct scratch_t *scratch = arg;
+  int n;
+  for (n = 0; n < SCRATCH_N_SLOTS; n++) {
+    free(scratch->buffers[n]);
+  }
+  free(scratch);
+}
+
+static void create_scratch_key() {
+  scratch_key_valid = pthread_key_create(&scratch_key, &free_scratch) == 0;
+}
+
+void *get_scratch_buffer(enum scratch_slot_t slot, size_t size) {
+  struct scratch_t *scratch;
+
+  pthread_once(&scratch_once, &create_scratch_key);
+  if (!scratch_key_valid)
+    return NULL;
+
+  scratch = pthread_getspecific(scratch_key);
+  if (!scratch) {
+    scratch = calloc(1, sizeof(*scratch));
+    if (!scratch)
+      return NULL;
+    if (pthread_setspecific(scratch_key, scratch) != 0) {
+      free(scratch);
+      return NULL;
+    }
+  }
+
+  if (scratch->sizes[slot] < size) {
+    /* contents are not preserved so avoid the copy in realloc */
+    free(scratch->buffers[slot]);
+    scratch->buffers[slot] = malloc(size);
+    scratch->sizes[slot] = scratch->buffers[slot] ? size : 0;
+  }
+  return scratch->buffers[slot];
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#ifndef NXS_XDS_SCRATCH_H
+#define NXS_XDS_SCRATCH_H
+
+#include <stddef.h>
+
+/* Per-thread scratch buffers for the frame read path. Each slot holds one
+ * buffer which grows to the largest size requested and is then reused, so
+ * reading a frame does not allocate once every slot has reached its working
+ * size. Buffers are released when the owning thread exits. */
+enum scratch_slot_t {
+  SCRATCH_CHUNK,     /* compressed chunk as read from file */
+  SCRATCH_FRAME,     /* decoded frame before conversion to int */
+  SCRATCH_BLOCK,     /* decompressed bitshuffle block */
+  SCRATCH_BLOCK_TMP, /* intermediate for the bit untranspose */
+  SCRATCH_BLOCK_OUT, /* untransposed block before conversion to int */
+  SCRATCH_STAGE_A,   /* output of intermediate stages of a filter pipeline */
+  SCRATCH_STAGE_B,
+  SCRATCH_DECODED,   /* decoded chunk before conversion to int */
+  SCRATCH_TILE,      /* decoded tile before copying into the frame */
+  SCRATCH_CROP,      /* whole frame before cropping to the region */
+  SCRATCH_SUM,       /* frame being added into a summed image */
+  SCRATCH_BIN,       /* summed image before binning */
+  SCRATCH_N_SLOTS
+};
+
+void *get_scratch_buffer(enum scratch_slot_t slot, size_t size);
+
+#endif /* NXS_XDS_SCRATCH_H */
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "err.h"
+#include "workers.h"
+
+/* number of reads after two overlapping reads before the pool is used again */
+#define WORKER_SHARED_WINDOW 16
+
+struct worker_pool_t {
+  pthread_mutex_t lock;
+  pthread_cond_t work_cond;
+  pthread_cond_t done_cond;
+  pthread_t *threads;
+  int n_threads;
+  int stop;
+  /* the read being shared out, valid while busy is set */
+  int busy;
+  worker_task_func task;
+  void *arg;
+  int n_tasks;
+  int next_task;
+  int n_done;
+  /* the first part which failed, or n_tasks if none have */
+  int failed;
+  /* reads in progress and when two last overlapped */
+  int callers;
+  unsigned long calls;
+  unsigned long last_shared;
+};
+
+/* take the next part of the current read - lock must be held */
+static int next_task(struct worker_pool_t *pool) {
+  if (!pool->busy || pool->next_task >= pool->n_tasks)
+    return -1;
+  return pool->next_task++;
+}
+
+/* run part n and record the result - lock must be held, and is released
+ * while the part runs */
+static void run_task(struct worker_pool_t *pool, int n) {
+  int err;
+  pthread_mutex_unlock(&pool->lock);
+  err = pool->task(pool->arg, n);
+  pthread_mutex_lock(&pool->lock);
+  if (err < 0 && n < pool->failed)
+    pool->failed = n;
+  if (++pool->n_done == pool->n_tasks)
+    pthread_cond_broadcast(&pool->done_cond);
+}
+
+static void *worker_thread(void *arg) {
+  struct worker_pool_t *pool = arg;
+  pthread_mutex_lock(&pool->lock);
+  while (!pool->stop) {
+    int n = next_task(pool);
+    if (n < 0) {
+      pthread_cond_wait(&pool->work_cond, &pool->lock);
+      continue;
+    }
+    run_task(pool, n);
+    /* a failure reaches the caller through pool->failed, so the trace left
+     * on this thread's error stack would only pile up */
+    reset_error_stack();
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+int create_worker_pool(int n_threads, struct worker_pool_t **pool) {
+  int retval = 0;
+  struct worker_pool_t *wp = NULL;
+
+  *pool = NULL;
+  wp = calloc(1, sizeof(*wp));
+  if (!wp) {
+    ERROR_JUMP(-1, done, "Unable to allocate worker pool");
+  }
+  pthread_mutex_init(&wp->lock, NULL);
+  pthread_cond_init(&wp->work_cond, NULL);
+  pthread_cond_init(&wp->done_cond, NULL);
+  wp->threads = calloc(n_threads, sizeof(*wp->threads));
+  if (!wp->threads) {
+    ERROR_JUMP(-1, done, "Unable to allocate worker pool");
+  }
+  for (wp->n_threads = 0; wp->n_threads < n_threads; wp->n_threads++) {
+    if (pthread_create(&wp->threads[wp->n_threads], NULL, &worker_thread,
+                       wp) != 0) {
+      ERROR_JUMP(-1, done, "Unable to start worker threads");
+    }
+  }
+  *pool = wp;
+
+done:
+  if (retval < 0 && wp)
+    free_worker_pool(wp);
+  return retval;
+}
+
+int run_worker_tasks(struct worker_pool_t *pool, int n_tasks,
+                     worker_task_func task, void *arg, int *failed_task) {
+  int retval = 0;
+  int n, shared;
+  int failed = n_tasks;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->calls++;
+  if (++pool->callers > 1)
+    pool->last_shared = pool->calls;
+  shared = pool->busy || pool->callers > 1 ||
+           (pool->last_shared > 0 &&
+            pool->calls - pool->last_shared <= WORKER_SHARED_WINDOW);
+
+  if (shared || n_tasks < 2) {
+    pthread_mutex_unlock(&pool->lock);
+    for (n = 0; n < n_tasks && failed == n_tasks; n++) {
+      if (task(arg, n) < 0)
+        failed = n;
+    }
+    pthread_mutex_lock(&pool->lock);
+  } else {
+    pool->busy = 1;
+    pool->task = task;
+    pool->arg = arg;
+    pool->n_tasks = n_tasks;
+    pool->next_task = 0;
+    pool->n_done = 0;
+    pool->failed = n_tasks;
+    pthread_cond_broadcast(&pool->work_cond);
+    while ((n = next_task(pool)) >= 0)
+      run_task(pool, n);
+    while (pool->n_done < pool->n_tasks)
+      pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pool->busy = 0;
+    failed = pool->failed;
+  }
+  pool->callers--;
+  pthread_mutex_unlock(&pool->lock);
+  if (failed < n_tasks) {
+    if (failed_task)
+      *failed_task = failed;
+    retval = -1;
+  }
+  return retval;
+}
+
+void free_worker_pool(struct worker_pool_t *pool) {
+  int n;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work_cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (n = 0; n < pool->n_threads; n++) {
+    pthread_join(pool->threads[n], NULL);
+  }
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->work_cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
+}
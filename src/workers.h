@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+#ifndef NXS_XDS_WORKERS_H
+#define NXS_XDS_WORKERS_H
+
+/* A pool of threads which share out the independent parts of a single read
+ * (such as the tiles of a frame) with the calling thread. The pool is only
+ * used while one thread at a time is reading, so a host which already reads
+ * frames from many threads is not oversubscribed. */
+struct worker_pool_t;
+
+/* process part n of a read - returns a negative value on error */
+typedef int (*worker_task_func)(void *arg, int n);
+
+/* create a pool with n_threads threads besides the caller */
+int create_worker_pool(int n_threads, struct worker_pool_t **pool);
+
+/* run task for parts 0 to n_tasks - 1, on the pool if no other thread has
+ * recently been reading at the same time and otherwise on the calling
+ * thread. Returns -1 if any part failed, setting failed_task (if not NULL)
+ * to the first part which did. Errors pushed by a part run on a pool thread
+ * are discarded, so only those of parts run by the caller are kept */
+int run_worker_tasks(struct worker_pool_t *pool, int n_tasks,
+                     worker_task_func task, void *arg, int *failed_task);
+
+void free_worker_pool(struct worker_pool_t *pool);
+
+#endif /* NXS_XDS_WORKERS_H */
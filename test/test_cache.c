@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+/* Tests of the eviction order and memory budget of the frame and chunk
+ * caches. The budgets are read from the environment, so each test sets them
+ * before creating a cache. */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cache.h"
+#include "chunk_cache.h"
+#include "err.h"
+
+/* one MB frames, so DURIN_CACHE_MB is the number of frames held */
+#define FRAME_PX ((1 << 20) / sizeof(int))
+/* a quarter of a MB, so DURIN_CHUNK_CACHE_MB=1 holds four chunks */
+#define CHUNK_BYTES (1 << 18)
+
+static int failures = 0;
+
+#define CHECK(cond, name)                                                      \
+  {                                                                            \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "FAIL: %s - %s (line %d)\n", name, #cond, __LINE__);     \
+      failures++;                                                              \
+    }                                                                          \
+  }
+
+void fill_frame(int *frame, int n, int value) {
+  size_t i;
+  for (i = 0; i < FRAME_PX; i++) {
+    frame[i] = n * 1000 + value + (int)(i % 7);
+  }
+}
+
+/* 1 if frame n is cached holding value, 0 if not cached and -1 if cached
+ * with the wrong pixels. A hit makes n the most recently used frame */
+int cached_frame(struct frame_cache_t *cache, int n, int value, int *buffer) {
+  size_t i;
+  if (!get_cached_frame(cache, n, buffer))
+    return 0;
+  for (i = 0; i < FRAME_PX; i++) {
+    if (buffer[i] != n * 1000 + value + (int)(i % 7))
+      return -1;
+  }
+  return 1;
+}
+
+/* the least recently used frame, counting reads as uses, goes first and no
+ * more frames than fit in the budget are kept */
+void test_frame_cache_lru() {
+  struct frame_cache_t *cache = NULL;
+  int *frame = malloc(FRAME_PX * sizeof(int));
+  int *buffer = malloc(FRAME_PX * sizeof(int));
+  unsigned long hits, misses;
+  const char *name = "frame cache eviction";
+  int n;
+
+  if (!frame || !buffer) {
+    CHECK(0, "allocating frame buffers");
+    goto done;
+  }
+  setenv("DURIN_CACHE_MB", "3", 1);
+  CHECK(create_frame_cache(10, FRAME_PX, &cache) == 0 && cache, name);
+  if (!cache)
+    goto done;
+
+  for (n = 0; n < 3; n++) {
+    fill_frame(frame, n, 1);
+    put_cached_frame(cache, n, frame);
+  }
+  /* reading frame 0 leaves frame 1 as the least recently used */
+  CHECK(cached_frame(cache, 0, 1, buffer) == 1, name);
+  fill_frame(frame, 3, 1);
+  put_cached_frame(cache, 3, frame);
+  CHECK(cached_frame(cache, 1, 1, buffer) == 0, name);
+  CHECK(cached_frame(cache, 2, 1, buffer) == 1, name);
+  CHECK(cached_frame(cache, 3, 1, buffer) == 1, name);
+  CHECK(cached_frame(cache, 0, 1, buffer) == 1, name);
+
+  /* now used 0, 3, 2 from the most recent, so 2 and then 3 go next */
+  fill_frame(frame, 4, 1);
+  put_cached_frame(cache, 4, frame);
+  CHECK(cached_frame(cache, 2, 1, buffer) == 0, name);
+  fill_frame(frame, 5, 1);
+  put_cached_frame(cache, 5, frame);
+  CHECK(cached_frame(cache, 3, 1, buffer) == 0, name);
+  CHECK(cached_frame(cache, 0, 1, buffer) == 1, name);
+  CHECK(cached_frame(cache, 4, 1, buffer) == 1, name);
+  CHECK(cached_frame(cache, 5, 1, buffer) == 1, name);
+
+  /* a frame already cached is not replaced, and frame numbers outside the
+   * collection are never cached */
+  fill_frame(frame, 0, 2);
+  put_cached_frame(cache, 0, frame);
+  CHECK(cached_frame(cache, 0, 1, buffer) == 1, name);
+  put_cached_frame(cache, 10, frame);
+  put_cached_frame(cache, -1, frame);
+  CHECK(cached_frame(cache, 10, 2, buffer) == 0, name);
+  CHECK(cached_frame(cache, 4, 1, buffer) == 1, name);
+  CHECK(cached_frame(cache, 5, 1, buffer) == 1, name);
+
+  /* frames outside the collection count as neither */
+  get_frame_cache_stats(cache, &hits, &misses);
+  CHECK(hits == 10 && misses == 3, name);
+
+done:
+  if (cache)
+    free_frame_cache(cache);
+  free(buffer);
+  free(frame);
+}
+
+/* no cache without a budget, and an error for a budget below one frame */
+void test_frame_cache_budget() {
+  struct frame_cache_t *cache = NULL;
+  const char *name = "frame cache budget";
+
+  unsetenv("DURIN_CACHE_MB");
+  CHECK(create_frame_cache(10, FRAME_PX, &cache) == 0 && !cache, name);
+  setenv("DURIN_CACHE_MB", "0", 1);
+  CHECK(create_frame_cache(10, FRAME_PX, &cache) == 0 && !cache, name);
+  setenv("DURIN_CACHE_MB", "1", 1);
+  CHECK(create_frame_cache(10, 2 * FRAME_PX, &cache) < 0 && !cache, name);
+  reset_error_stack();
+}
+
+struct chunk_load_t {
+  int loads;
+  unsigned long long index;
+  int fail;
+};
+
+int load_chunk(void *arg, void *buffer) {
+  struct chunk_load_t *load = arg;
+  load->loads++;
+  if (load->fail)
+    return -1;
+  ((unsigned long long *)buffer)[0] = load->index;
+  return 0;
+}
+
+/* acquire and release chunk index, returning 1 if it was loaded, 0 if it
+ * was cached and -1 on an error or the wrong contents */
+int use_chunk(struct chunk_cache_t *cache, unsigned long long index) {
+  struct chunk_load_t load = {0, index, 0};
+  const void *data = NULL;
+  int handle = acquire_chunk(cache, cache, index, load_chunk, &load, &data);
+  if (handle < 0)
+    return -1;
+  release_chunk(cache, handle);
+  if (*(const unsigned long long *)data != index)
+    return -1;
+  return load.loads;
+}
+
+/* the least recently acquired chunk nobody holds is replaced first */
+void test_chunk_cache_lru() {
+  struct chunk_cache_t *cache = NULL;
+  struct chunk_load_t load = {0, 9, 1};
+  const void *data = NULL;
+  const char *name = "chunk cache eviction";
+  int handle, n;
+
+  setenv("DURIN_CHUNK_CACHE_MB", "1", 1);
+  CHECK(create_chunk_cache(CHUNK_BYTES, &cache) == 0 && cache, name);
+  if (!cache)
+    return;
+
+  for (n = 0; n < 4; n++) {
+    CHECK(use_chunk(cache, n) == 1, name);
+  }
+  /* using chunk 0 leaves chunk 1 as the least recently used */
+  CHECK(use_chunk(cache, 0) == 0, name);
+  CHECK(use_chunk(cache, 4) == 1, name);
+  CHECK(use_chunk(cache, 2) == 0, name);
+  CHECK(use_chunk(cache, 3) == 0, name);
+  CHECK(use_chunk(cache, 0) == 0, name);
+  CHECK(use_chunk(cache, 4) == 0, name);
+  CHECK(use_chunk(cache, 1) == 1, name);
+
+  /* which replaced chunk 2, leaving chunk 3 the least recently used. A
+   * held chunk is kept however long ago it was acquired */
+  handle = acquire_chunk(cache, cache, 3, load_chunk, &load, &data);
+  CHECK(handle >= 0 && load.loads == 0, name);
+  for (n = 5; n < 10; n++) {
+    CHECK(use_chunk(cache, n) == 1, name);
+  }
+  if (handle >= 0) {
+    CHECK(*(const unsigned long long *)data == 3, name);
+    release_chunk(cache, handle);
+  }
+  CHECK(use_chunk(cache, 3) == 0, name);
+
+  /* a chunk that fails to load is not cached */
+  load.loads = 0;
+  CHECK(acquire_chunk(cache, cache, 10, load_chunk, &load, &data) < 0, name);
+  reset_error_stack();
+  CHECK(acquire_chunk(cache, cache, 10, load_chunk, &load, &data) < 0, name);
+  reset_error_stack();
+  CHECK(load.loads == 2, name);
+  CHECK(use_chunk(cache, 10) == 1, name);
+  CHECK(use_chunk(cache, 3) == 0, name);
+
+  free_chunk_cache(cache);
+}
+
+/* the number of chunks cached is n_chunks if at least n_chunks + 1 chunks
+ * must be loaded again after cycling through them */
+int count_cached_chunks(struct chunk_cache_t *cache, int n_chunks) {
+  int n, loads = 0;
+  for (n = 0; n < n_chunks + 1; n++) {
+    use_chunk(cache, n);
+  }
+  /* with room for n_chunks, chunk 0 is gone but 1 is still there */
+  for (n = 1; n < n_chunks + 1; n++) {
+    loads += use_chunk(cache, n);
+  }
+  return loads == 0 && use_chunk(cache, 0) == 1;
+}
+
+/* the budget sets the number of chunks held, between 2 and 64 */
+void test_chunk_cache_budget() {
+  static const struct {
+    const char *mb;
+    size_t chunk_bytes;
+    int n_chunks;
+  } cases[] = {{"1", CHUNK_BYTES, 4},
+               {"3", CHUNK_BYTES, 12},
+               {"1", 4 << 20, 2},
+               {"1", 1024, 64}};
+  const char *name = "chunk cache budget";
+  struct chunk_cache_t *cache = NULL;
+  int n;
+
+  for (n = 0; n < (int)(sizeof(cases) / sizeof(cases[0])); n++) {
+    setenv("DURIN_CHUNK_CACHE_MB", cases[n].mb, 1);
+    CHECK(create_chunk_cache(cases[n].chunk_bytes, &cache) == 0, name);
+    if (!cache)
+      continue;
+    CHECK(count_cached_chunks(cache, cases[n].n_chunks), name);
+    free_chunk_cache(cache);
+  }
+  setenv("DURIN_CHUNK_CACHE_MB", "-1", 1);
+  CHECK(create_chunk_cache(CHUNK_BYTES, &cache) < 0 && !cache, name);
+  reset_error_stack();
+}
+
+int main(int argc, char **argv) {
+  init_error_handling();
+
+  test_frame_cache_lru();
+  test_frame_cache_budget();
+  test_chunk_cache_lru();
+  test_chunk_cache_budget();
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All cache tests passed\n");
+  return 0;
+}
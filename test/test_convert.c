@@ -0,0 +1,430 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+/* Tests of the pixel conversion and masking kernels against plain scalar
+ * versions written here. The vector kernels are chosen when convert.c is
+ * compiled, so the check target runs these tests against both the normal
+ * build and a build of convert.c without SSE2 or AVX2. Lengths and buffer
+ * offsets are chosen so every kernel finishes with a partial vector. */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "convert.h"
+#include "err.h"
+
+/* longer than a few AVX2 vectors, with a remainder for any vector width */
+#define MAX_LENGTH 1031
+#define MAX_SHIFT 3
+
+static int failures = 0;
+
+#define CHECK(cond, name)                                                      \
+  {                                                                            \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "FAIL: %s - %s (line %d)\n", name, #cond, __LINE__);     \
+      failures++;                                                              \
+    }                                                                          \
+  }
+
+/* lengths either side of multiples of the SSE2 and AVX2 vector widths */
+static const int lengths[] = {0,  1,  3,  4,  5,  7,  8,  9,  15,
+                              16, 17, 31, 33, 63, 65, 1000, MAX_LENGTH};
+#define N_LENGTHS ((int)(sizeof(lengths) / sizeof(lengths[0])))
+
+unsigned next_random(unsigned *state) {
+  *state = *state * 1103515245u + 12345u;
+  return *state >> 8;
+}
+
+/* pixel data of width bytes, covering negative and extreme values */
+void fill_pixels(void *buffer, int width, int length, unsigned seed) {
+  unsigned state = seed;
+  int i;
+  for (i = 0; i < length; i++) {
+    unsigned value = next_random(&state);
+    if (i % 11 == 0)
+      value = ~0u;
+    else if (i % 13 == 0)
+      value = 1u << (8 * width - 1);
+    if (width == 1)
+      ((signed char *)buffer)[i] = (signed char)value;
+    else if (width == 2)
+      ((short *)buffer)[i] = (short)value;
+    else
+      ((int *)buffer)[i] = (int)(value ^ (value << 16));
+  }
+}
+
+/* mask bits mixing unmasked pixels, bits outside the masking bytes, and
+ * ignored and invalid pixels */
+void fill_mask(int *mask, int length, unsigned seed) {
+  static const int bits[] = {0, 0, 0, 0x100, 1, 2, 0x80, 1 | 4, 0x10000};
+  unsigned state = seed;
+  int i;
+  for (i = 0; i < length; i++) {
+    mask[i] = bits[next_random(&state) % (sizeof(bits) / sizeof(bits[0]))];
+  }
+}
+
+int reference_pixel(const void *in, int width, int i) {
+  if (width == 1)
+    return ((const signed char *)in)[i];
+  if (width == 2)
+    return ((const short *)in)[i];
+  return ((const int *)in)[i];
+}
+
+int reference_mask(int value, int bits) {
+  if (bits & MASK_INVALID_BITS)
+    return -2;
+  if (bits & MASK_IGNORE_BITS)
+    return -1;
+  return value;
+}
+
+/* convert_to_int_and_mask for each width, with and without a mask, from
+ * buffers starting at every alignment */
+void test_convert(int width) {
+  char *in = malloc((MAX_LENGTH + MAX_SHIFT) * width);
+  int *mask = malloc((MAX_LENGTH + MAX_SHIFT) * sizeof(int));
+  int *out = malloc((MAX_LENGTH + MAX_SHIFT + 1) * sizeof(int));
+  int n, shift, use_mask, i;
+  char name[64];
+
+  if (!in || !mask || !out) {
+    CHECK(0, "allocating conversion buffers");
+    goto done;
+  }
+  fill_pixels(in, width, MAX_LENGTH + MAX_SHIFT, width);
+  fill_mask(mask, MAX_LENGTH + MAX_SHIFT, width);
+  for (use_mask = 0; use_mask < 2; use_mask++) {
+    for (shift = 0; shift <= MAX_SHIFT; shift++) {
+      for (n = 0; n < N_LENGTHS; n++) {
+        int length = lengths[n];
+        const char *src = in + shift * width;
+        const int *bits = use_mask ? mask + shift : NULL;
+        int *dest = out + shift;
+        int ok = 1;
+        sprintf(name, "convert width %d length %d shift %d%s", width, length,
+                shift, use_mask ? " masked" : "");
+        /* the pixel after the end must be left alone */
+        dest[length] = 12345;
+        CHECK(convert_to_int_and_mask(src, width, dest, length, bits) == 0,
+              name);
+        for (i = 0; i < length && ok; i++) {
+          int expected = reference_pixel(src, width, i);
+          if (bits)
+            expected = reference_mask(expected, bits[i]);
+          ok = dest[i] == expected;
+        }
+        CHECK(ok, name);
+        CHECK(dest[length] == 12345, name);
+      }
+    }
+  }
+
+done:
+  free(out);
+  free(mask);
+  free(in);
+}
+
+/* apply_mask on an int frame, from buffers starting at every alignment */
+void test_apply_mask() {
+  int *data = malloc((MAX_LENGTH + MAX_SHIFT) * sizeof(int));
+  int *mask = malloc((MAX_LENGTH + MAX_SHIFT) * sizeof(int));
+  int *buffer = malloc((MAX_LENGTH + MAX_SHIFT + 1) * sizeof(int));
+  int n, shift, i;
+  char name[64];
+
+  if (!data || !mask || !buffer) {
+    CHECK(0, "allocating mask buffers");
+    goto done;
+  }
+  fill_pixels(data, sizeof(int), MAX_LENGTH + MAX_SHIFT, 17);
+  fill_mask(mask, MAX_LENGTH + MAX_SHIFT, 19);
+  for (shift = 0; shift <= MAX_SHIFT; shift++) {
+    for (n = 0; n < N_LENGTHS; n++) {
+      int length = lengths[n];
+      int ok = 1;
+      sprintf(name, "apply_mask length %d shift %d", length, shift);
+      memcpy(buffer + shift, data + shift, length * sizeof(int));
+      buffer[shift + length] = 12345;
+      apply_mask(buffer + shift, mask + shift, length);
+      for (i = 0; i < length && ok; i++) {
+        ok = buffer[shift + i] ==
+             reference_mask(data[shift + i], mask[shift + i]);
+      }
+      CHECK(ok, name);
+      CHECK(buffer[shift + length] == 12345, name);
+    }
+  }
+
+done:
+  free(buffer);
+  free(mask);
+  free(data);
+}
+
+/* a frame's mask with n_masked runs of masked pixels, the rest unmasked */
+int *make_sparse_mask(int length, int n_masked, unsigned seed) {
+  int *mask = calloc(length, sizeof(int));
+  unsigned state = seed;
+  int n;
+  if (!mask)
+    return NULL;
+  for (n = 0; n < n_masked; n++) {
+    int start = next_random(&state) % length;
+    int run = 1 + next_random(&state) % 5;
+    int bits = n % 3 ? 1 : 2;
+    for (; run > 0 && start < length; run--) {
+      mask[start++] = bits;
+    }
+  }
+  /* the first and last pixels, which the run search must not miss */
+  mask[0] = 1;
+  mask[length - 1] = 4;
+  return mask;
+}
+
+/* the mask is kept as runs only when they are much smaller than the dense
+ * mask, and either form must mask any range of pixels as the dense bits
+ * say */
+void test_pixel_mask(int sparse) {
+  const int length = 97 * 89;
+  int *bits = sparse ? make_sparse_mask(length, 40, 23) : NULL;
+  int *dense = malloc(length * sizeof(int));
+  int *data = malloc(length * sizeof(int));
+  int *out = malloc(length * sizeof(int));
+  const char *name = sparse ? "sparse pixel mask" : "dense pixel mask";
+  struct pixel_mask_t mask = {NULL, NULL, 0};
+  unsigned state = 29;
+  int n, i;
+
+  if (!sparse && dense) {
+    bits = malloc(length * sizeof(int));
+    if (bits)
+      fill_mask(bits, length, 31);
+  }
+  if (!bits || !dense || !data || !out) {
+    CHECK(0, "allocating pixel mask buffers");
+    free(dense);
+    goto done;
+  }
+  /* build_pixel_mask takes ownership of dense */
+  memcpy(dense, bits, length * sizeof(int));
+  CHECK(build_pixel_mask(dense, length, &mask) == 0, name);
+  if (sparse) {
+    CHECK(mask.runs && !mask.dense, name);
+  } else {
+    CHECK(mask.dense && !mask.runs, name);
+  }
+
+  fill_pixels(data, sizeof(int), length, 37);
+  for (n = 0; n < 200; n++) {
+    int offset = n < 2 ? 0 : next_random(&state) % length;
+    int count = n == 0 ? length : next_random(&state) % (length - offset + 1);
+    int ok = 1;
+    CHECK(convert_and_mask_pixels(data + offset, sizeof(int), out, offset,
+                                  count, &mask) == 0,
+          name);
+    for (i = 0; i < count && ok; i++) {
+      ok = out[i] == reference_mask(data[offset + i], bits[offset + i]);
+    }
+    CHECK(ok, name);
+  }
+
+done:
+  free_pixel_mask(&mask);
+  free(out);
+  free(data);
+  free(bits);
+}
+
+/* a mask with no masked pixels at all is an empty list of runs */
+void test_empty_pixel_mask() {
+  int *dense = calloc(100, sizeof(int));
+  struct pixel_mask_t mask = {NULL, NULL, 0};
+  int data[100], out[100], i;
+  if (!dense) {
+    CHECK(0, "allocating pixel mask buffers");
+    return;
+  }
+  CHECK(build_pixel_mask(dense, 100, &mask) == 0, "empty pixel mask");
+  CHECK(!mask.dense && mask.n_runs == 0, "empty pixel mask");
+  for (i = 0; i < 100; i++) {
+    data[i] = i - 50;
+  }
+  CHECK(convert_and_mask_pixels(data, sizeof(int), out, 0, 100, &mask) == 0,
+        "empty pixel mask");
+  CHECK(memcmp(data, out, sizeof(data)) == 0, "empty pixel mask");
+  free_pixel_mask(&mask);
+}
+
+int reference_add(int a, int b) {
+  int low = a < b ? a : b;
+  if (low < 0)
+    return low;
+  return (long long)a + b > INT_MAX ? INT_MAX : a + b;
+}
+
+/* pixel counts near zero and near INT_MAX, with ignored and invalid pixels */
+void fill_counts(int *buffer, int length, unsigned seed) {
+  static const int values[] = {-2, -1, 0, 1, 2, INT_MAX / 2, INT_MAX - 1,
+                               INT_MAX};
+  unsigned state = seed;
+  int i;
+  for (i = 0; i < length; i++) {
+    unsigned r = next_random(&state);
+    if (r % 3)
+      buffer[i] = values[r / 3 % (sizeof(values) / sizeof(values[0]))];
+    else
+      buffer[i] = r % 100000;
+  }
+}
+
+/* accumulate_frame saturates and keeps masked pixels masked, -2 over -1 */
+void test_accumulate_frame() {
+  int *sum = malloc((MAX_LENGTH + MAX_SHIFT + 1) * sizeof(int));
+  int *start = malloc((MAX_LENGTH + MAX_SHIFT) * sizeof(int));
+  int *in = malloc((MAX_LENGTH + MAX_SHIFT) * sizeof(int));
+  int n, shift, i;
+  char name[64];
+
+  if (!sum || !start || !in) {
+    CHECK(0, "allocating summation buffers");
+    goto done;
+  }
+  fill_counts(start, MAX_LENGTH + MAX_SHIFT, 41);
+  fill_counts(in, MAX_LENGTH + MAX_SHIFT, 43);
+  for (shift = 0; shift <= MAX_SHIFT; shift++) {
+    for (n = 0; n < N_LENGTHS; n++) {
+      int length = lengths[n];
+      int ok = 1;
+      sprintf(name, "accumulate_frame length %d shift %d", length, shift);
+      memcpy(sum + shift, start + shift, length * sizeof(int));
+      sum[shift + length] = 12345;
+      accumulate_frame(sum + shift, in + shift, length);
+      for (i = 0; i < length && ok; i++) {
+        ok = sum[shift + i] == reference_add(start[shift + i], in[shift + i]);
+      }
+      CHECK(ok, name);
+      CHECK(sum[shift + length] == 12345, name);
+    }
+  }
+
+  {
+    int a[] = {-1, -2, -1, -2, INT_MAX, INT_MAX - 1, 5, 0};
+    int b[] = {-2, -1, -1, -2, 1, INT_MAX, -1, 0};
+    int expected[] = {-2, -2, -1, -2, INT_MAX, INT_MAX, -1, 0};
+    accumulate_frame(a, b, 8);
+    CHECK(memcmp(a, expected, sizeof(a)) == 0, "accumulate_frame edges");
+  }
+
+done:
+  free(in);
+  free(start);
+  free(sum);
+}
+
+/* bin_frame against summing each bin pixel by pixel */
+void test_bin_frame(int n, int nx, int ny) {
+  int out_nx = nx / n, out_ny = ny / n;
+  int *frame = malloc((size_t)nx * ny * sizeof(int));
+  int *in = malloc((size_t)nx * ny * sizeof(int));
+  int *out = malloc(((size_t)out_nx * out_ny + 1) * sizeof(int));
+  int row, col, i, j, ok = 1;
+  char name[64];
+
+  sprintf(name, "bin_frame %d of %d x %d", n, nx, ny);
+  if (!frame || !in || !out) {
+    CHECK(0, "allocating binning buffers");
+    goto done;
+  }
+  fill_counts(frame, nx * ny, 47 + n);
+  memcpy(in, frame, (size_t)nx * ny * sizeof(int));
+  out[out_nx * out_ny] = 12345;
+  bin_frame(in, nx, n, out_nx, out_ny, out);
+  for (row = 0; row < out_ny && ok; row++) {
+    for (col = 0; col < out_nx && ok; col++) {
+      int value = frame[row * n * nx + col * n];
+      for (j = 0; j < n; j++) {
+        const int *bin = frame + (row * n + j) * nx + col * n;
+        for (i = 0; i < n; i++) {
+          if (i || j)
+            value = reference_add(value, bin[i]);
+        }
+      }
+      ok = out[row * out_nx + col] == value;
+    }
+  }
+  CHECK(ok, name);
+  CHECK(out[out_nx * out_ny] == 12345, name);
+
+done:
+  free(out);
+  free(in);
+  free(frame);
+}
+
+/* region_overlaps against testing each pixel of the range, for ranges
+ * within a row, spanning rows and covering the whole frame */
+void test_region_overlaps() {
+  static const struct pixel_region_t regions[] = {
+      {10, 0, 10, 0, 8}, {10, 3, 7, 2, 5}, {10, 0, 1, 7, 8},
+      {10, 9, 10, 0, 1}, {10, 4, 5, 4, 5}, {1, 0, 1, 2, 6}};
+  const int n_regions = sizeof(regions) / sizeof(regions[0]);
+  int r;
+  char name[64];
+
+  for (r = 0; r < n_regions; r++) {
+    const struct pixel_region_t *region = &regions[r];
+    int frame = region->width * 8;
+    size_t offset, length, i;
+    int ok = 1;
+    sprintf(name, "region_overlaps region %d", r);
+    for (offset = 0; offset <= (size_t)frame && ok; offset++) {
+      for (length = 0; offset + length <= (size_t)frame && ok; length++) {
+        int expected = 0;
+        for (i = offset; i < offset + length && !expected; i++) {
+          int x = i % region->width, y = i / region->width;
+          expected = x >= region->x0 && x < region->x1 && y >= region->y0 &&
+                     y < region->y1;
+        }
+        ok = !region_overlaps(region, offset, length) == !expected;
+        if (!ok)
+          fprintf(stderr, "offset %d length %d\n", (int)offset, (int)length);
+      }
+    }
+    CHECK(ok, name);
+  }
+}
+
+int main(int argc, char **argv) {
+  init_error_handling();
+
+  test_convert(1);
+  test_convert(2);
+  test_convert(4);
+  test_apply_mask();
+  test_pixel_mask(1);
+  test_pixel_mask(0);
+  test_empty_pixel_mask();
+  test_accumulate_frame();
+  test_bin_frame(2, 67, 33);
+  test_bin_frame(3, 100, 31);
+  test_bin_frame(4, 1031, 9);
+  test_region_overlaps();
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All conversion tests passed\n");
+  return 0;
+}
@@ -0,0 +1,849 @@
+/*
+ * Copyright (c) 2018 Diamond Light Source Ltd.
+ * Author: Charles Mita
+ */
+
+/* Round trip tests of the chunk decoders: known frames are compressed with
+ * each codec and decoded by the plugin, then compared with the original
+ * frame and, where the HDF5 library has the filter, with the frame read
+ * back through the HDF5 filter pipeline. Truncated and corrupt chunks must
+ * be rejected rather than decoded. */
+
+#include <hdf5.h>
+#include <hdf5_hl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "bitshuffle.h"
+#include "err.h"
+#include "filters.h"
+#include "lz4.h"
+
+#ifdef DURIN_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/* odd sizes, so no codec works only in whole blocks or vectors */
+#define FRAME_NY 45
+#define FRAME_NX 67
+#define FRAME_PIXELS (FRAME_NY * FRAME_NX)
+
+static int failures = 0;
+
+#define CHECK(cond, name)                                                      \
+  {                                                                            \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "FAIL: %s - %s (line %d)\n", name, #cond, __LINE__);     \
+      failures++;                                                              \
+    }                                                                          \
+  }
+
+/* a frame much like a diffraction image - mostly small counts with a few
+ * large ones - of width bytes per pixel */
+void fill_frame(void *frame, size_t width, size_t n_pixels, unsigned seed) {
+  unsigned state = seed;
+  size_t i;
+  for (i = 0; i < n_pixels; i++) {
+    unsigned value;
+    state = state * 1103515245u + 12345u;
+    value = (state >> 16) % 8;
+    if ((state >> 8) % 97 == 0)
+      value = state >> 12;
+    if (width == 1)
+      ((unsigned char *)frame)[i] = value;
+    else if (width == 2)
+      ((unsigned short *)frame)[i] = value;
+    else
+      ((unsigned int *)frame)[i] = value;
+  }
+}
+
+/* a frame of noise which no codec can compress */
+void fill_noise(void *frame, size_t n_bytes, unsigned seed) {
+  unsigned state = seed;
+  size_t i;
+  for (i = 0; i < n_bytes; i++) {
+    state = state * 1103515245u + 12345u;
+    ((unsigned char *)frame)[i] = state >> 24;
+  }
+}
+
+void put_uint32_BE(void *buffer, unsigned long value) {
+  unsigned char *b = buffer;
+  b[0] = value >> 24;
+  b[1] = value >> 16;
+  b[2] = value >> 8;
+  b[3] = value;
+}
+
+void put_uint64_BE(void *buffer, unsigned long long value) {
+  put_uint32_BE(buffer, value >> 32);
+  put_uint32_BE((char *)buffer + 4, value & 0xFFFFFFFFUL);
+}
+
+/* the frame widened to int, as the plugin returns it - sign extended, as
+ * convert_to_int_and_mask does */
+void widen_frame(const void *frame, size_t width, size_t n_pixels, int *out) {
+  size_t i;
+  for (i = 0; i < n_pixels; i++) {
+    if (width == 1)
+      out[i] = ((const signed char *)frame)[i];
+    else if (width == 2)
+      out[i] = ((const short *)frame)[i];
+    else
+      out[i] = ((const int *)frame)[i];
+  }
+}
+
+/* a frame stored as a single chunk by the HDF5 library */
+struct h5_chunk_t {
+  struct filter_pipeline_t pipeline;
+  unsigned int filter_mask;
+  hsize_t size;
+  void *data;
+  /* the frame as read back through the HDF5 filter pipeline */
+  void *decoded;
+};
+
+void free_h5_chunk(struct h5_chunk_t *chunk) {
+  free(chunk->data);
+  free(chunk->decoded);
+  chunk->data = NULL;
+  chunk->decoded = NULL;
+}
+
+/* the filters of dcpl, as check_for_chunk_read records them */
+int get_pipeline(hid_t dcpl, struct filter_pipeline_t *pipeline) {
+  int retval = 0;
+  int n, n_filters = H5Pget_nfilters(dcpl);
+  if (n_filters < 0 || n_filters > CHUNK_MAX_FILTERS) {
+    ERROR_JUMP(-1, done, "Unexpected number of filters");
+  }
+  memset(pipeline, 0, sizeof(*pipeline));
+  for (n = 0; n < n_filters; n++) {
+    struct chunk_filter_t *filter = &pipeline->filters[n];
+    unsigned int flags, config;
+    size_t n_params = CHUNK_MAX_FILTER_PARAMS;
+    char name[16];
+    filter->id = H5Pget_filter2(dcpl, n, &flags, &n_params, filter->params,
+                                sizeof(name), name, &config);
+    if (filter->id < 0) {
+      ERROR_JUMP(-1, done, "Error retrieving filter information");
+    }
+    filter->n_params = n_params;
+  }
+  pipeline->n_filters = n_filters;
+done:
+  return retval;
+}
+
+/* write frame with the filters of dcpl to a file held in memory, and read
+ * back the stored chunk and the frame as decoded by the HDF5 library */
+int write_h5_chunk(hid_t dcpl, hid_t type, const void *frame,
+                   struct h5_chunk_t *chunk) {
+  int retval = 0;
+  hsize_t dims[3] = {1, FRAME_NY, FRAME_NX};
+  hsize_t offset[3] = {0, 0, 0};
+  size_t frame_bytes = FRAME_PIXELS * H5Tget_size(type);
+  hid_t fapl = 0, f_id = 0, s_id = 0, ds_id = 0, ds_dcpl = 0;
+
+  memset(chunk, 0, sizeof(*chunk));
+  fapl = H5Pcreate(H5P_FILE_ACCESS);
+  if (fapl < 0 || H5Pset_fapl_core(fapl, 1 << 20, 0) < 0) {
+    ERROR_JUMP(-1, done, "Error configuring in memory file");
+  }
+  f_id = H5Fcreate("test_filters.h5", H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+  s_id = H5Screate_simple(3, dims, NULL);
+  if (f_id < 0 || s_id < 0 || H5Pset_chunk(dcpl, 3, dims) < 0) {
+    ERROR_JUMP(-1, done, "Error creating test file");
+  }
+  ds_id = H5Dcreate2(f_id, "data", type, s_id, H5P_DEFAULT, dcpl, H5P_DEFAULT);
+  if (ds_id < 0 ||
+      H5Dwrite(ds_id, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, frame) < 0) {
+    ERROR_JUMP(-1, done, "Error writing test dataset");
+  }
+  /* the dataset's own filter parameters, as the plugin sees them */
+  ds_dcpl = H5Dget_create_plist(ds_id);
+  if (ds_dcpl < 0 || get_pipeline(ds_dcpl, &chunk->pipeline) < 0 ||
+      H5Dget_chunk_storage_size(ds_id, offset, &chunk->size) < 0) {
+    ERROR_JUMP(-1, done, "Error reading test dataset layout");
+  }
+  chunk->data = malloc(chunk->size);
+  chunk->decoded = malloc(frame_bytes);
+  if (!chunk->data || !chunk->decoded) {
+    ERROR_JUMP(-1, done, "Unable to allocate chunk buffers");
+  }
+  if (H5DOread_chunk(ds_id, H5P_DEFAULT, offset, &chunk->filter_mask,
+                     chunk->data) < 0 ||
+      H5Dread(ds_id, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, chunk->decoded) <
+          0) {
+    ERROR_JUMP(-1, done, "Error reading test dataset");
+  }
+
+done:
+  if (retval < 0)
+    free_h5_chunk(chunk);
+  if (ds_dcpl > 0)
+    H5Pclose(ds_dcpl);
+  if (ds_id > 0)
+    H5Dclose(ds_id);
+  if (s_id > 0)
+    H5Sclose(s_id);
+  if (f_id > 0)
+    H5Fclose(f_id);
+  if (fapl > 0)
+    H5Pclose(fapl);
+  return retval;
+}
+
+/* decode a chunk of one frame with decode_chunk and decode_chunk_to_int and
+ * compare both with the frame */
+void check_decode(const struct filter_pipeline_t *pipeline,
+                  unsigned int filter_mask, size_t width, const void *chunk,
+                  size_t chunk_bytes, const void *frame, const char *name) {
+  size_t frame_bytes = FRAME_PIXELS * width;
+  void *in = malloc(chunk_bytes);
+  void *out = malloc(frame_bytes);
+  int *int_out = malloc(FRAME_PIXELS * sizeof(int));
+  int *expected = malloc(FRAME_PIXELS * sizeof(int));
+  int err;
+
+  if (!in || !out || !int_out || !expected) {
+    CHECK(0, "allocating decode buffers");
+    goto done;
+  }
+  /* decoders may work in place on their input, so decode a copy */
+  memcpy(in, chunk, chunk_bytes);
+  err = decode_chunk(pipeline, filter_mask, width, chunk_bytes, in,
+                     frame_bytes, out);
+  if (err < 0)
+    dump_error_stack(stderr);
+  CHECK(err >= 0, name);
+  CHECK(memcmp(out, frame, frame_bytes) == 0, name);
+
+  memcpy(in, chunk, chunk_bytes);
+  widen_frame(frame, width, FRAME_PIXELS, expected);
+  err = decode_chunk_to_int(pipeline, filter_mask, width, chunk_bytes, in,
+                            frame_bytes, int_out, NULL, NULL);
+  if (err < 0)
+    dump_error_stack(stderr);
+  CHECK(err >= 0, name);
+  CHECK(memcmp(int_out, expected, FRAME_PIXELS * sizeof(int)) == 0, name);
+
+done:
+  reset_error_stack();
+  free(expected);
+  free(int_out);
+  free(out);
+  free(in);
+}
+
+/* decoding must fail, not crash or read past the end of the chunk */
+void check_rejected(const struct filter_pipeline_t *pipeline,
+                    unsigned int filter_mask, size_t width, const void *chunk,
+                    size_t chunk_bytes, const char *name) {
+  size_t frame_bytes = FRAME_PIXELS * width;
+  /* an exact sized copy, so a read past the end can be caught by tools */
+  void *in = malloc(chunk_bytes ? chunk_bytes : 1);
+  void *out = malloc(frame_bytes);
+  if (!in || !out) {
+    CHECK(0, "allocating decode buffers");
+  } else {
+    memcpy(in, chunk, chunk_bytes);
+    CHECK(decode_chunk(pipeline, filter_mask, width, chunk_bytes, in,
+                       frame_bytes, out) < 0,
+          name);
+  }
+  reset_error_stack();
+  free(out);
+  free(in);
+}
+
+/* a chunk cut short at several points must be rejected */
+void check_truncated(const struct filter_pipeline_t *pipeline,
+                     unsigned int filter_mask, size_t width, const void *chunk,
+                     size_t chunk_bytes, const char *name) {
+  check_rejected(pipeline, filter_mask, width, chunk, 0, name);
+  check_rejected(pipeline, filter_mask, width, chunk, 11, name);
+  check_rejected(pipeline, filter_mask, width, chunk, chunk_bytes / 2, name);
+  check_rejected(pipeline, filter_mask, width, chunk, chunk_bytes - 1, name);
+}
+
+/* overwrite part of the middle of a chunk - the result must be rejected */
+void check_corrupt(const struct filter_pipeline_t *pipeline,
+                   unsigned int filter_mask, size_t width, const void *chunk,
+                   size_t chunk_bytes, const char *name) {
+  char *copy = malloc(chunk_bytes);
+  if (!copy) {
+    CHECK(0, "allocating corrupt chunk");
+    return;
+  }
+  memcpy(copy, chunk, chunk_bytes);
+  memset(copy + chunk_bytes / 2, 0xA5, chunk_bytes / 8 + 1);
+  check_rejected(pipeline, filter_mask, width, copy, chunk_bytes, name);
+  free(copy);
+}
+
+/* the HDF5 shuffle and deflate filters, alone and together, checked against
+ * the HDF5 library's own decoding of the same chunk */
+void test_hdf5_filters(int shuffle, int deflate, size_t width,
+                       const char *name) {
+  hid_t type = width == 2 ? H5T_NATIVE_USHORT : H5T_NATIVE_UINT;
+  void *frame = malloc(FRAME_PIXELS * width);
+  struct h5_chunk_t chunk;
+  hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+
+  memset(&chunk, 0, sizeof(chunk));
+  if (!frame || dcpl < 0 || (shuffle && H5Pset_shuffle(dcpl) < 0) ||
+      (deflate && H5Pset_deflate(dcpl, 6) < 0)) {
+    CHECK(0, name);
+    goto done;
+  }
+  fill_frame(frame, width, FRAME_PIXELS, 1 + width);
+  if (write_h5_chunk(dcpl, type, frame, &chunk) < 0) {
+    dump_error_stack(stderr);
+    reset_error_stack();
+    CHECK(0, name);
+    goto done;
+  }
+  CHECK(chunk.filter_mask == 0, name);
+  CHECK(memcmp(chunk.decoded, frame, FRAME_PIXELS * width) == 0, name);
+
+  check_decode(&chunk.pipeline, chunk.filter_mask, width, chunk.data,
+               chunk.size, chunk.decoded, name);
+  check_truncated(&chunk.pipeline, chunk.filter_mask, width, chunk.data,
+                  chunk.size, name);
+  if (deflate)
+    check_corrupt(&chunk.pipeline, chunk.filter_mask, width, chunk.data,
+                  chunk.size, name);
+
+done:
+  free_h5_chunk(&chunk);
+  if (dcpl > 0)
+    H5Pclose(dcpl);
+  free(frame);
+}
+
+/* compress frame as the HDF5 LZ4 filter (32004) does: the frame size and
+ * block size, then each block with its compressed size, stored as is if it
+ * does not compress. Returns the chunk size, or 0 on error */
+size_t lz4_compress_frame(const void *frame, size_t frame_bytes,
+                          size_t block_bytes, char **chunk) {
+  size_t done_bytes = 0, c_size = 12;
+  char *out;
+  *chunk = malloc(12 + (frame_bytes / block_bytes + 1) *
+                           (4 + LZ4_compressBound(block_bytes)));
+  if (!*chunk)
+    return 0;
+  out = *chunk;
+  put_uint64_BE(out, frame_bytes);
+  put_uint32_BE(out + 8, block_bytes);
+  while (done_bytes < frame_bytes) {
+    size_t n_bytes = frame_bytes - done_bytes;
+    int c_bytes;
+    if (n_bytes > block_bytes)
+      n_bytes = block_bytes;
+    c_bytes = LZ4_compress_default((const char *)frame + done_bytes,
+                                   out + c_size + 4, n_bytes,
+                                   LZ4_compressBound(n_bytes));
+    if (c_bytes <= 0)
+      return 0;
+    if ((size_t)c_bytes >= n_bytes) {
+      c_bytes = n_bytes;
+      memcpy(out + c_size + 4, (const char *)frame + done_bytes, n_bytes);
+    }
+    put_uint32_BE(out + c_size, c_bytes);
+    c_size += 4 + c_bytes;
+    done_bytes += n_bytes;
+  }
+  return c_size;
+}
+
+/* LZ4 chunks with a short final block and, for noise, blocks stored as is.
+ * The HDF5 library has no LZ4 filter of its own, so the decoded chunk is
+ * compared with the frame that was compressed */
+void test_lz4(size_t width, size_t block_bytes, int noise, const char *name) {
+  struct filter_pipeline_t pipeline;
+  size_t frame_bytes = FRAME_PIXELS * width;
+  void *frame = malloc(frame_bytes);
+  char *chunk = NULL;
+  size_t chunk_bytes;
+
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.n_filters = 1;
+  pipeline.filters[0].id = LZ4_H5_FILTER_ID;
+  if (!frame) {
+    CHECK(0, name);
+    return;
+  }
+  if (noise)
+    fill_noise(frame, frame_bytes, 7);
+  else
+    fill_frame(frame, width, FRAME_PIXELS, 3 + width);
+  chunk_bytes = lz4_compress_frame(frame, frame_bytes, block_bytes, &chunk);
+  CHECK(chunk_bytes > 0, name);
+  if (chunk_bytes == 0)
+    goto done;
+
+  check_decode(&pipeline, 0, width, chunk, chunk_bytes, frame, name);
+  check_truncated(&pipeline, 0, width, chunk, chunk_bytes, name);
+
+  /* a header which does not match the frame, a zero block size, and a first
+   * block shorter or longer than was written */
+  put_uint64_BE(chunk, frame_bytes + width);
+  check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+  put_uint64_BE(chunk, frame_bytes);
+  put_uint32_BE(chunk + 8, 0);
+  check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+  put_uint32_BE(chunk + 8, block_bytes);
+  if (!noise) {
+    unsigned long c_bytes = ((unsigned char)chunk[12] << 24 |
+                             (unsigned char)chunk[13] << 16 |
+                             (unsigned char)chunk[14] << 8 |
+                             (unsigned char)chunk[15]);
+    put_uint32_BE(chunk + 12, c_bytes - 7);
+    check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+  }
+  put_uint32_BE(chunk + 12, chunk_bytes);
+  check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+
+done:
+  free(chunk);
+  free(frame);
+}
+
+/* compress one bitshuffled block into out, returning its size or -1 */
+int compress_block(int compression, const char *in, size_t n_bytes,
+                   char *out, size_t out_bytes) {
+  if (compression == BS_H5_PARAM_LZ4_COMPRESS)
+    return LZ4_compress_default(in, out, n_bytes, out_bytes);
+#ifdef DURIN_WITH_ZSTD
+  if (compression == BS_H5_PARAM_ZSTD_COMPRESS) {
+    size_t c_bytes = ZSTD_compress(out, out_bytes, in, n_bytes, 3);
+    return ZSTD_isError(c_bytes) ? -1 : (int)c_bytes;
+  }
+#endif
+  return -1;
+}
+
+/* compress frame as the HDF5 bitshuffle filter (32008) does: the frame size
+ * and block size in bytes, then each block bitshuffled and compressed with
+ * its compressed size. The final block is cut to a multiple of 8 elements
+ * and any elements left over are stored as is. Returns the chunk size, or 0
+ * on error */
+size_t bitshuffle_compress_frame(const void *frame, size_t width,
+                                 size_t n_elems, size_t block_elems,
+                                 int compression, char **chunk) {
+  size_t done_elems = 0, c_size = 12;
+  size_t bound = 2 * block_elems * width + 64;
+  char *out, *shuffled = malloc(block_elems * width);
+  *chunk = malloc(12 + (n_elems / block_elems + 1) * (4 + bound));
+  if (!*chunk || !shuffled) {
+    free(shuffled);
+    return 0;
+  }
+  out = *chunk;
+  put_uint64_BE(out, n_elems * width);
+  put_uint32_BE(out + 8, block_elems * width);
+  while (done_elems + 8 <= n_elems) {
+    size_t block_n = n_elems - done_elems;
+    int c_bytes;
+    if (block_n > block_elems)
+      block_n = block_elems;
+    block_n -= block_n % 8;
+    if (bshuf_bitshuffle((const char *)frame + done_elems * width, shuffled,
+                         block_n, width, block_n) < 0)
+      goto fail;
+    c_bytes = compress_block(compression, shuffled, block_n * width,
+                             out + c_size + 4, bound);
+    if (c_bytes <= 0)
+      goto fail;
+    put_uint32_BE(out + c_size, c_bytes);
+    c_size += 4 + c_bytes;
+    done_elems += block_n;
+  }
+  memcpy(out + c_size, (const char *)frame + done_elems * width,
+         (n_elems - done_elems) * width);
+  c_size += (n_elems - done_elems) * width;
+  free(shuffled);
+  return c_size;
+fail:
+  free(shuffled);
+  return 0;
+}
+
+/* bitshuffle chunks compressed with compression, decoded a block at a time
+ * by bslz4_decode_blocks, with a short final block and leftover elements */
+void test_bitshuffle(size_t width, size_t block_elems, int compression,
+                     const char *name) {
+  struct filter_pipeline_t pipeline;
+  size_t frame_bytes = FRAME_PIXELS * width;
+  void *frame = malloc(frame_bytes);
+  char *chunk = NULL;
+  size_t chunk_bytes;
+
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.n_filters = 1;
+  pipeline.filters[0].id = BS_H5_FILTER_ID;
+  pipeline.filters[0].n_params = BS_H5_N_PARAMS;
+  pipeline.filters[0].params[2] = width;
+  pipeline.filters[0].params[3] = block_elems;
+  pipeline.filters[0].params[4] = compression;
+  if (!frame) {
+    CHECK(0, name);
+    return;
+  }
+  fill_frame(frame, width, FRAME_PIXELS, 5 + width);
+  chunk_bytes = bitshuffle_compress_frame(frame, width, FRAME_PIXELS,
+                                          block_elems, compression, &chunk);
+  CHECK(chunk_bytes > 0, name);
+  if (chunk_bytes == 0)
+    goto done;
+
+  /* the LZ4 blocks must be exactly those the bitshuffle library writes,
+   * which shows the chunks built here are laid out as the filter does */
+  if (compression == BS_H5_PARAM_LZ4_COMPRESS) {
+    char *reference =
+        malloc(bshuf_compress_lz4_bound(FRAME_PIXELS, width, block_elems));
+    int64_t reference_bytes =
+        reference ? bshuf_compress_lz4(frame, reference, FRAME_PIXELS, width,
+                                       block_elems)
+                  : -1;
+    CHECK(reference_bytes == (int64_t)chunk_bytes - 12, name);
+    CHECK(reference_bytes < 0 ||
+              memcmp(reference, chunk + 12, reference_bytes) == 0,
+          name);
+    free(reference);
+  }
+
+  check_decode(&pipeline, 0, width, chunk, chunk_bytes, frame, name);
+  check_truncated(&pipeline, 0, width, chunk, chunk_bytes, name);
+
+  /* a header which does not match the frame, a block size which is not a
+   * multiple of 8 elements, and a first block longer than the chunk */
+  put_uint64_BE(chunk, frame_bytes + width);
+  check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+  put_uint64_BE(chunk, frame_bytes);
+  put_uint32_BE(chunk + 8, (block_elems + 1) * width);
+  check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+  put_uint32_BE(chunk + 8, block_elems * width);
+  put_uint32_BE(chunk + 12, chunk_bytes);
+  check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+
+done:
+  free(chunk);
+  free(frame);
+}
+
+/* uncompressed bitshuffle chunks, which the filter writes with no header
+ * and a block size from its parameters - or its default with n_params 3 or
+ * a block size of 0 */
+void test_bitshuffle_uncompressed(size_t width, size_t n_params,
+                                  size_t block_elems, const char *name) {
+  struct filter_pipeline_t pipeline;
+  size_t frame_bytes = FRAME_PIXELS * width;
+  void *frame = malloc(frame_bytes);
+  char *chunk = malloc(frame_bytes);
+
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.n_filters = 1;
+  pipeline.filters[0].id = BS_H5_FILTER_ID;
+  pipeline.filters[0].n_params = n_params;
+  pipeline.filters[0].params[2] = width;
+  if (n_params > 3)
+    pipeline.filters[0].params[3] = block_elems;
+  if (!frame || !chunk) {
+    CHECK(0, name);
+    goto done;
+  }
+  CHECK(is_supported_filter(&pipeline.filters[0]), name);
+  fill_frame(frame, width, FRAME_PIXELS, 11 + width);
+  if (bshuf_bitshuffle(frame, chunk, FRAME_PIXELS, width,
+                       n_params > 3 ? block_elems : 0) < 0) {
+    CHECK(0, name);
+    goto done;
+  }
+
+  check_decode(&pipeline, 0, width, chunk, frame_bytes, frame, name);
+  check_truncated(&pipeline, 0, width, chunk, frame_bytes, name);
+
+  /* a block size which is not a multiple of 8 elements */
+  if (n_params > 3) {
+    pipeline.filters[0].params[3] = block_elems + 1;
+    check_rejected(&pipeline, 0, width, chunk, frame_bytes, name);
+  }
+
+done:
+  free(chunk);
+  free(frame);
+}
+
+/* which bitshuffle parameters is_supported_filter accepts, by compression */
+void test_bitshuffle_support() {
+  static const struct {
+    size_t n_params;
+    unsigned int block_elems;
+    unsigned int compression;
+    int supported;
+  } cases[] = {
+      {2, 0, 0, 0},
+      {3, 0, 0, 1},
+      {4, 512, 0, 1},
+      {4, 12, 0, 0},
+      {5, 0, 0, 1},
+      {5, 512, 0, 1},
+      {5, 12, 0, 0},
+      {5, 0, BS_H5_PARAM_LZ4_COMPRESS, 1},
+      {5, 12, BS_H5_PARAM_LZ4_COMPRESS, 1},
+#ifdef DURIN_WITH_ZSTD
+      {6, 0, BS_H5_PARAM_ZSTD_COMPRESS, 1},
+#else
+      {6, 0, BS_H5_PARAM_ZSTD_COMPRESS, 0},
+#endif
+      {5, 0, 1, 0},
+      {5, 0, 4, 0},
+  };
+  struct chunk_filter_t filter;
+  char name[64];
+  int n;
+
+  for (n = 0; n < (int)(sizeof(cases) / sizeof(cases[0])); n++) {
+    memset(&filter, 0, sizeof(filter));
+    filter.id = BS_H5_FILTER_ID;
+    filter.n_params = cases[n].n_params;
+    filter.params[2] = 2;
+    filter.params[3] = cases[n].block_elems;
+    filter.params[4] = cases[n].compression;
+    sprintf(name, "bitshuffle support, %d parameters compression %u",
+            (int)cases[n].n_params, cases[n].compression);
+    CHECK(!is_supported_filter(&filter) == !cases[n].supported, name);
+  }
+}
+
+/* blosc header flags, and the compressor formats in its top three bits */
+#define BLOSC_DOSHUFFLE 0x1
+#define BLOSC_MEMCPYED 0x2
+#define BLOSC_DOBITSHUFFLE 0x4
+#define BLOSC_DONT_SPLIT 0x10
+#define BLOSC_LZ4 (1 << 5)
+#define BLOSC_ZLIB (3 << 5)
+
+void put_uint32_LE(void *buffer, unsigned long value) {
+  unsigned char *b = buffer;
+  b[0] = value;
+  b[1] = value >> 8;
+  b[2] = value >> 16;
+  b[3] = value >> 24;
+}
+
+/* the HDF5 shuffle filter - byte k of every element stored together */
+void byte_shuffle(size_t width, size_t n_bytes, const char *in, char *out) {
+  size_t n_elems = n_bytes / width, i, k;
+  for (k = 0; k < width; k++) {
+    for (i = 0; i < n_elems; i++) {
+      out[k * n_elems + i] = in[i * width + k];
+    }
+  }
+  memcpy(out + n_elems * width, in + n_elems * width,
+         n_bytes - n_elems * width);
+}
+
+/* compress one stream of a blosc block into out, storing it as is if it
+ * does not compress. Returns its size, or 0 on error */
+size_t blosc_compress_stream(int format, const char *in, size_t n_bytes,
+                             char *out, size_t out_bytes) {
+  size_t c_bytes = 0;
+  if (format == BLOSC_LZ4) {
+    int lz4_bytes = LZ4_compress_default(in, out, n_bytes, out_bytes);
+    c_bytes = lz4_bytes > 0 ? lz4_bytes : 0;
+  } else if (format == BLOSC_ZLIB) {
+    uLongf z_bytes = out_bytes;
+    if (compress2((Bytef *)out, &z_bytes, (const Bytef *)in, n_bytes, 5) ==
+        Z_OK)
+      c_bytes = z_bytes;
+  }
+  if (c_bytes == 0 || c_bytes >= n_bytes) {
+    memcpy(out, in, n_bytes);
+    c_bytes = n_bytes;
+  }
+  return c_bytes;
+}
+
+/* compress frame as a Blosc (version 1 format) buffer, as written by the
+ * HDF5 Blosc filter (32001): the header, the offset of each block, and each
+ * block shuffled as flags say then split into one stream per byte of the
+ * element where blosc would. Returns the chunk size, or 0 on error */
+size_t blosc_compress_frame(const void *frame, size_t width, size_t n_bytes,
+                            size_t block_bytes, int flags, char **chunk) {
+  size_t n_blocks = (n_bytes + block_bytes - 1) / block_bytes;
+  size_t bound = 16 + 4 * n_blocks + 2 * n_bytes + 64 * n_blocks * width;
+  size_t c_size, b;
+  char *out, *block = malloc(block_bytes);
+  *chunk = malloc(bound);
+  if (!*chunk || !block) {
+    free(block);
+    return 0;
+  }
+  out = *chunk;
+  out[0] = 2;
+  out[1] = 1;
+  out[2] = flags;
+  out[3] = width;
+  put_uint32_LE(out + 4, n_bytes);
+  put_uint32_LE(out + 8, block_bytes);
+  if (flags & BLOSC_MEMCPYED) {
+    memcpy(out + 16, frame, n_bytes);
+    put_uint32_LE(out + 12, 16 + n_bytes);
+    free(block);
+    return 16 + n_bytes;
+  }
+
+  c_size = 16 + 4 * n_blocks;
+  for (b = 0; b < n_blocks; b++) {
+    const char *src = (const char *)frame + b * block_bytes;
+    size_t b_bytes = n_bytes - b * block_bytes;
+    size_t n_elems, n_splits = 1, split_bytes, s;
+    int leftover = b_bytes < block_bytes;
+    if (!leftover)
+      b_bytes = block_bytes;
+    n_elems = b_bytes / width;
+    if ((flags & BLOSC_DOSHUFFLE) && width > 1) {
+      byte_shuffle(width, b_bytes, src, block);
+      src = block;
+    } else if ((flags & BLOSC_DOBITSHUFFLE) && n_elems % 8 == 0) {
+      if (bshuf_bitshuffle(src, block, n_elems, width, n_elems) < 0) {
+        free(block);
+        return 0;
+      }
+      memcpy(block + n_elems * width, src + n_elems * width,
+             b_bytes - n_elems * width);
+      src = block;
+    }
+    if (!(flags & BLOSC_DONT_SPLIT) && width <= 16 &&
+        block_bytes / width >= 128 && !leftover)
+      n_splits = width;
+    split_bytes = b_bytes / n_splits;
+
+    put_uint32_LE(out + 16 + 4 * b, c_size);
+    for (s = 0; s < n_splits; s++) {
+      size_t stream_bytes =
+          blosc_compress_stream(flags & 0xE0, src + s * split_bytes,
+                                split_bytes, out + c_size + 4,
+                                bound - c_size - 4);
+      put_uint32_LE(out + c_size, stream_bytes);
+      c_size += 4 + stream_bytes;
+    }
+  }
+  put_uint32_LE(out + 12, c_size);
+  free(block);
+  return c_size;
+}
+
+/* Blosc chunks with each shuffle and compressor durin decodes, a short
+ * final block, and streams stored as is. The HDF5 library has no Blosc
+ * filter of its own, so the decoded chunk is compared with the frame */
+void test_blosc(size_t width, size_t block_bytes, int flags, int noise,
+                const char *name) {
+  struct filter_pipeline_t pipeline;
+  size_t frame_bytes = FRAME_PIXELS * width;
+  void *frame = malloc(frame_bytes);
+  char *chunk = NULL;
+  size_t chunk_bytes;
+
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.n_filters = 1;
+  pipeline.filters[0].id = BLOSC_H5_FILTER_ID;
+  if (!frame) {
+    CHECK(0, name);
+    return;
+  }
+  if (noise)
+    fill_noise(frame, frame_bytes, 11);
+  else
+    fill_frame(frame, width, FRAME_PIXELS, 9 + width);
+  chunk_bytes =
+      blosc_compress_frame(frame, width, frame_bytes, block_bytes, flags,
+                           &chunk);
+  CHECK(chunk_bytes > 0, name);
+  if (chunk_bytes == 0)
+    goto done;
+
+  check_decode(&pipeline, 0, width, chunk, chunk_bytes, frame, name);
+  check_truncated(&pipeline, 0, width, chunk, chunk_bytes, name);
+
+  /* an unknown format version, a size which does not match the frame, a
+   * buffer size beyond the chunk and a zero block size */
+  chunk[0] = 3;
+  check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+  chunk[0] = 2;
+  put_uint32_LE(chunk + 4, frame_bytes + width);
+  check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+  put_uint32_LE(chunk + 4, frame_bytes);
+  put_uint32_LE(chunk + 12, chunk_bytes + 1);
+  check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+  put_uint32_LE(chunk + 12, chunk_bytes);
+  if (!(flags & BLOSC_MEMCPYED)) {
+    size_t first = 16 + 4 * ((frame_bytes + block_bytes - 1) / block_bytes);
+    put_uint32_LE(chunk + 8, 0);
+    check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+    put_uint32_LE(chunk + 8, block_bytes);
+    /* the first stream longer than the chunk */
+    put_uint32_LE(chunk + first, chunk_bytes);
+    check_rejected(&pipeline, 0, width, chunk, chunk_bytes, name);
+  }
+
+done:
+  free(chunk);
+  free(frame);
+}
+
+int main(int argc, char **argv) {
+  init_error_handling();
+  /* failures are expected, so keep the library quiet */
+  H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+
+  test_hdf5_filters(0, 1, 2, "deflate 16 bit");
+  test_hdf5_filters(0, 1, 4, "deflate 32 bit");
+  test_hdf5_filters(1, 0, 2, "shuffle 16 bit");
+  test_hdf5_filters(1, 0, 4, "shuffle 32 bit");
+  test_hdf5_filters(1, 1, 2, "shuffle and deflate 16 bit");
+  test_hdf5_filters(1, 1, 4, "shuffle and deflate 32 bit");
+
+  test_lz4(2, 1000, 0, "lz4 16 bit");
+  test_lz4(4, 8192, 0, "lz4 32 bit");
+  test_lz4(4, 1 << 20, 0, "lz4 32 bit in one block");
+  test_lz4(2, 1000, 1, "lz4 blocks stored as is");
+
+  test_bitshuffle(2, 1024, BS_H5_PARAM_LZ4_COMPRESS, "bitshuffle lz4 16 bit");
+  test_bitshuffle(4, 512, BS_H5_PARAM_LZ4_COMPRESS, "bitshuffle lz4 32 bit");
+  test_bitshuffle_support();
+  test_bitshuffle_uncompressed(2, 3, 0, "bitshuffle default parameters");
+  test_bitshuffle_uncompressed(4, 5, 0, "bitshuffle default block size");
+  test_bitshuffle_uncompressed(2, 5, 512, "bitshuffle uncompressed 16 bit");
+  test_bitshuffle_uncompressed(4, 5, 256, "bitshuffle uncompressed 32 bit");
+#ifdef DURIN_WITH_ZSTD
+  test_bitshuffle(2, 1024, BS_H5_PARAM_ZSTD_COMPRESS,
+                  "bitshuffle zstd 16 bit");
+  test_bitshuffle(4, 512, BS_H5_PARAM_ZSTD_COMPRESS, "bitshuffle zstd 32 bit");
+#endif
+
+  test_blosc(2, 2048, BLOSC_LZ4 | BLOSC_DOSHUFFLE, 0, "blosc lz4 shuffle");
+  test_blosc(4, 4096, BLOSC_LZ4 | BLOSC_DOBITSHUFFLE, 0,
+             "blosc lz4 bitshuffle");
+  test_blosc(4, 4096, BLOSC_ZLIB | BLOSC_DOSHUFFLE, 0, "blosc zlib shuffle");
+  test_blosc(2, 2048, BLOSC_ZLIB | BLOSC_DOBITSHUFFLE | BLOSC_DONT_SPLIT, 0,
+             "blosc zlib bitshuffle unsplit");
+  test_blosc(2, 256, BLOSC_LZ4, 0, "blosc lz4 small blocks");
+  test_blosc(4, 4096, BLOSC_LZ4 | BLOSC_DOSHUFFLE, 1,
+             "blosc streams stored as is");
+  test_blosc(2, 2048, BLOSC_LZ4 | BLOSC_MEMCPYED, 0, "blosc memcpyed");
+
+  if (failures) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All filter tests passed\n");
+  return 0;
+}